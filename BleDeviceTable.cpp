@@ -8,7 +8,7 @@ void BleStar::resetBleDeviceTable() {
 		bleDevice->peerName = NULL;
 		bleDevice->isConnected = false;
 		bleDevice->index = i;
-		bleDevice->tempReceiveBuffer = new MessageBuilder(MAX_BLE_CHUNK_LENGTH + 1);
+		bleDevice->tempReceiveBuffer = new MessageBuilder(MAX_UNFORMED_MESSAGE_LENGTH + 1);
 		resetReceiveMessage(bleDevice);
 		resetSendMessage(bleDevice);
 	}
@@ -25,38 +25,92 @@ void BleStar::recalculateNumberOfBleConnections() {
 // Common receive methods
 
 void BleStar::resetReceiveMessage(BleDeviceTable * bleDevice) {
-
 	bleDevice->receiveState = AWAITING_NEW_MESSAGE;
 	bleDevice->tempReceiveBuffer->reset();
-	bleDevice->isUsingTempReceiveBuffer = true;
-	bleDevice->receiveBuffer = bleDevice->tempReceiveBuffer;
+	bleDevice->lastreceivedTime = 0;
+	for (int i = 0; i < BLE_LINK_CHANNELS; i++) {
+		bleDevice->receiveChannel[i].channel = i;
+		resetReceiveChannel(&bleDevice->receiveChannel[i]);
+	}
+}
 
-	if (bleDevice->messageBeingReceived != NULL) {
-		bleDevice->messageBeingReceived->setMessageType(MESSAGE_TYPE_NONE);
-		bleDevice->messageBeingReceived->getMessageBuilder()->reset();
+void BleStar::resetReceiveChannel(BleReceiveChannel * channel) {
+	if (channel->messageBeingReceived != NULL && !channel->isCutThrough) {		// a cut through message's entry belongs to the router already
+		channel->messageBeingReceived->setMessageType(MESSAGE_TYPE_NONE);
+		channel->messageBeingReceived->getMessageBuilder()->reset();
 	}
-	bleDevice->messageBeingReceived = NULL;
-	bleDevice->receiveChunkInProgress = 0;
-	bleDevice->indexWithinReceiveChunk = 0;
-	bleDevice->receiveChunksExpected = 0;
-	bleDevice->chunkResendIndex = 0;
-	bleDevice->receiveAttempts = 0;
-	bleDevice->lastreceivedTime = 0;
-	bleDevice->lastResendRequestTime = 0;
-	for (int j = 0; j < CHUNK_FLAG_TABLE_CAPACITY + 1; j++) { bleDevice->receivedChunkFlags[j] = 0xFF; }
+	channel->messageBeingReceived = NULL;
+	channel->receiveBuffer = NULL;
+	channel->isDiscarding = false;
+	channel->receiveMessageLength = 0;
+	channel->receiveChunkInProgress = 0;
+	channel->receiveChunksExpected = 0;
+	channel->receiveChunksContiguous = 0;
+	channel->runningCrc16 = CRC_START_MODBUS;
+	channel->runningCrc16Length = COMPILED_MESSAGE_ORIGIN_NAME_POSITION;
+	channel->isCheckingChunks = false;
+	channel->chunkCheckAttempts = 0;
+	channel->chunkChecksOutstanding = 0;
+	channel->chunksFoundByChecks = 0;
+	channel->isCutThrough = false;
+	channel->receiveAttempts = 0;
+	channel->lastreceivedTime = 0;
+	channel->lastSackTime = 0;
+	channel->chunksSinceLastSack = 0;
+	channel->rttTimedSackTime = 0;
+	for (int j = 0; j < CHUNK_FLAG_TABLE_CAPACITY + 1; j++) { channel->receivedChunkFlags[j] = 0xFF; }
+}
+
+// What the peer can do is learned again every time the link connects
+void BleStar::resetLinkCapabilities(BleDeviceTable * bleDevice) {
+	bleDevice->capabilitiesSent = false;
+	bleDevice->hasPeerCapabilities = false;
+	bleDevice->peerCapabilities = 0;
+	bleDevice->peerFecGroupSize = 0;
+	bleDevice->chunksRepairedByParity = 0;
+	bleDevice->chunksRepairedByChecks = 0;
+	bleDevice->lastHeartbeatTime = 0;
+	bleDevice->isLinkFailed = false;
+}
+
+// Unformed messages can arrive between the chunks of compiled messages, so finishing one must not disturb the others
+void BleStar::resetUnformedMessage(BleDeviceTable * bleDevice) {
+	bleDevice->tempReceiveBuffer->reset();
+	bleDevice->receiveState = AWAITING_NEW_MESSAGE;
 }
 
-boolean BleStar::getChunkReceived(BleDeviceTable * bleDevice, int chunkNumber) {
-	return ((bleDevice->receivedChunkFlags[chunkNumber / 8] & bitSetArray[chunkNumber % 8]) > 0);
+boolean BleStar::getChunkReceived(BleReceiveChannel * channel, int chunkNumber) {
+	return ((channel->receivedChunkFlags[chunkNumber / 8] & bitSetArray[chunkNumber % 8]) == 0);
 }
 
-void BleStar::setChunkReceived(BleDeviceTable * bleDevice, int chunkNumber) {
-	bleDevice->receivedChunkFlags[chunkNumber / 8] = bleDevice->receivedChunkFlags[chunkNumber / 8] & bitResetArray[chunkNumber % 8];
+// The message's crc16 is worked out as its chunks arrive, over each run of them once it's contiguous, so checking it
+// once the message is complete costs nothing
+void BleStar::setChunkReceived(BleReceiveChannel * channel, int chunkNumber) {
+	channel->receivedChunkFlags[chunkNumber / 8] = channel->receivedChunkFlags[chunkNumber / 8] & bitResetArray[chunkNumber % 8];
+	while (channel->receiveChunksContiguous < channel->receiveChunksExpected && getChunkReceived(channel, channel->receiveChunksContiguous)) {
+		channel->receiveChunksContiguous++;
+	}
+	if (channel->receiveBuffer == NULL) { return; }
+
+	int contiguousLength = min(channel->receiveMessageLength, getMessageBuilderIndexForChunkNumber(channel->receiveChunksContiguous, channel->chunkLength));
+	if (contiguousLength > channel->runningCrc16Length) {
+		channel->runningCrc16 = CRC::updateCrc16(channel->runningCrc16,
+				&channel->receiveBuffer->getBuffer()[channel->runningCrc16Length], contiguousLength - channel->runningCrc16Length);
+		channel->runningCrc16Length = contiguousLength;
+	}
 }
 
-boolean BleStar::getAllChunksReceived(BleDeviceTable * bleDevice) {
-	for (int i = 0; i < bleDevice->receiveChunksExpected; i++) {
-			if ((bleDevice->receivedChunkFlags[i / 8] & bitSetArray[i % 8]) !=0 ) { return false; }
+// A chunk found to be corrupt after it arrived.  The running crc16 is worked out again from the start once it's back
+void BleStar::setChunkNotReceived(BleReceiveChannel * channel, int chunkNumber) {
+	channel->receivedChunkFlags[chunkNumber / 8] = channel->receivedChunkFlags[chunkNumber / 8] | bitSetArray[chunkNumber % 8];
+	channel->receiveChunksContiguous = min(channel->receiveChunksContiguous, chunkNumber);
+	channel->runningCrc16 = CRC_START_MODBUS;
+	channel->runningCrc16Length = COMPILED_MESSAGE_ORIGIN_NAME_POSITION;
+}
+
+boolean BleStar::getAllChunksReceived(BleReceiveChannel * channel) {
+	for (int i = 0; i < channel->receiveChunksExpected; i++) {
+			if ((channel->receivedChunkFlags[i / 8] & bitSetArray[i % 8]) !=0 ) { return false; }
 	}
 	return (true);
 }
@@ -64,35 +118,135 @@ boolean BleStar::getAllChunksReceived(BleDeviceTable * bleDevice) {
 
 
 void BleStar::resetSendMessage(BleDeviceTable * bleDevice) {
-	bleDevice->sendBuffer = NULL;
-	bleDevice->sendChunkResendRequested = false;
-	if (bleDevice->messageBeingSent != NULL) {
-		bleDevice->messageBeingSent->setMessageType(MESSAGE_TYPE_NONE);
-		bleDevice->messageBeingSent = NULL;
+	for (int i = 0; i < BLE_LINK_CHANNELS; i++) {
+		bleDevice->sendChannel[i].channel = i;
+		resetSendChannel(&bleDevice->sendChannel[i]);
 	}
-	for (int j = 0; j < CHUNK_FLAG_TABLE_CAPACITY + 1; j++) { bleDevice->sentChunkFlags[j] = 0x00; }
+	bleDevice->nextSendChannel = 0;
+	bleDevice->channelMidChunk = NO_CHANNEL;
+	bleDevice->chunkLengthTier = 0;
+	bleDevice->chunkLossPermille = 0;
+	bleDevice->chunksSentInWindow = 0;
+	bleDevice->chunksLostInWindow = 0;
+	bleDevice->congestionWindow = CONGESTION_WINDOW_INITIAL;
+	bleDevice->congestionWindowCredit = 0;
+	bleDevice->lastCongestionWindowDecreaseTime = 0;
+	bleDevice->lastSackRequestTime = 0;
 }
 
-boolean BleStar::getChunkNeedsToBeSent(BleDeviceTable * bleDevice, int chunkNumber) {
-	return ((bleDevice->receivedChunkFlags[chunkNumber / 8] & bitSetArray[chunkNumber % 8]) > 0);
+void BleStar::resetSendChannel(BleSendChannel * channel) {
+	channel->sendBuffer = NULL;
+	channel->sendChunksExpected = 0;
+	channel->sendChunkInProgress = 0;
+	channel->indexWithinSendChunk = 0;
+	channel->sendChunkResendRequested = false;
+	channel->rttTimedSendTime = 0;
+	channel->isResuming = false;
+	channel->priority = MESSAGE_PRIORITY_NORMAL;
+	channel->fecGroupSize = 0;
+	channel->sendParityCoveredTo = 0;
+	channel->sendParityChunkCount = 0;
+	if (channel->messageBeingSent != NULL) {
+		channel->messageBeingSent->setMessageType(MESSAGE_TYPE_NONE);
+		channel->messageBeingSent = NULL;
+	}
+	for (int j = 0; j < CHUNK_FLAG_TABLE_CAPACITY + 1; j++) { channel->sentChunkFlags[j] = 0x00; }
+	for (int j = 0; j < CHUNK_FLAG_TABLE_CAPACITY + 1; j++) { channel->lostChunkFlags[j] = 0x00; }
 }
 
-void BleStar::setChunkNotSent(BleDeviceTable * bleDevice, int chunkNumber) {
-	bleDevice->sentChunkFlags[chunkNumber / 8] = bleDevice->sentChunkFlags[chunkNumber / 8] | bitSetArray[chunkNumber % 8];
+// Channels, and those of suspended transfers, point straight into messageTable, so it asks before freeing an entry
+// and says when one moves
+boolean BleStar::messageInUseCallbackWrapper(Message * m) { return (_pointerToBleStarClass->getIsMessageInUse(m)); }
+boolean BleStar::getIsMessageInUse(Message * m) {
+	for (int i = BLE_PERIPHERAL_INDEX; i < MAX_CENTRAL_CONNECTIONS + 2; i++) {
+		for (int j = 0; j < BLE_LINK_CHANNELS; j++) {
+			if (bleDeviceTable[i].sendChannel[j].messageBeingSent == m) { return true; }
+			if (bleDeviceTable[i].receiveChannel[j].messageBeingReceived == m) { return true; }
+		}
+	}
+	for (int i = 0; i < MAX_SUSPENDED_TRANSFERS; i++) {
+		SuspendedTransfer * transfer = &suspendedTransfer[i];
+		if (transfer->peerName == NULL) { continue; }
+		if (transfer->isSending ? transfer->sendChannel.messageBeingSent == m : transfer->receiveChannel.messageBeingReceived == m) { return true; }
+	}
+	return false;
 }
 
-void BleStar::setChunkSent(BleDeviceTable * bleDevice, int chunkNumber) {
-	bleDevice->sentChunkFlags[chunkNumber / 8] = bleDevice->sentChunkFlags[chunkNumber / 8] & bitResetArray[chunkNumber % 8];
+void BleStar::messageMovedCallbackWrapper(Message * from, Message * to) { _pointerToBleStarClass->messageMoved(from, to); }
+void BleStar::messageMoved(Message * from, Message * to) {
+	for (int i = BLE_PERIPHERAL_INDEX; i < MAX_CENTRAL_CONNECTIONS + 2; i++) {
+		for (int j = 0; j < BLE_LINK_CHANNELS; j++) {
+			if (bleDeviceTable[i].sendChannel[j].messageBeingSent == from) { bleDeviceTable[i].sendChannel[j].messageBeingSent = to; }
+			if (bleDeviceTable[i].receiveChannel[j].messageBeingReceived == from) { bleDeviceTable[i].receiveChannel[j].messageBeingReceived = to; }
+		}
+	}
+	for (int i = 0; i < MAX_SUSPENDED_TRANSFERS; i++) {
+		SuspendedTransfer * transfer = &suspendedTransfer[i];
+		if (transfer->sendChannel.messageBeingSent == from) { transfer->sendChannel.messageBeingSent = to; }
+		if (transfer->receiveChannel.messageBeingReceived == from) { transfer->receiveChannel.messageBeingReceived = to; }
+	}
 }
 
+boolean BleStar::getChunkNeedsToBeSent(BleSendChannel * channel, int chunkNumber) {
+	return ((channel->sentChunkFlags[chunkNumber / 8] & bitSetArray[chunkNumber % 8]) > 0);
+}
+
+void BleStar::setChunkNotSent(BleSendChannel * channel, int chunkNumber) {
+	channel->sentChunkFlags[chunkNumber / 8] = channel->sentChunkFlags[chunkNumber / 8] | bitSetArray[chunkNumber % 8];
+}
 
-boolean BleStar::getAllChunksSent(BleDeviceTable * bleDevice) {
-	for (int i = 0; i < bleDevice->receiveChunksExpected; i++) {
-			if ((bleDevice->sentChunkFlags[i / 8] & bitSetArray[i % 8]) != 0 ) { return false; }
+void BleStar::setChunkSent(BleSendChannel * channel, int chunkNumber) {
+	channel->sentChunkFlags[chunkNumber / 8] = channel->sentChunkFlags[chunkNumber / 8] & bitResetArray[chunkNumber % 8];
+}
+
+// A hole is reported again by every SACK until its resend arrives, so a chunk only counts towards the loss rate once
+boolean BleStar::getChunkCountedLost(BleSendChannel * channel, int chunkNumber) {
+	return ((channel->lostChunkFlags[chunkNumber / 8] & bitSetArray[chunkNumber % 8]) > 0);
+}
+
+void BleStar::setChunkCountedLost(BleSendChannel * channel, int chunkNumber) {
+	channel->lostChunkFlags[chunkNumber / 8] = channel->lostChunkFlags[chunkNumber / 8] | bitSetArray[chunkNumber % 8];
+}
+
+
+boolean BleStar::getAllChunksSent(BleSendChannel * channel) {
+	for (int i = 0; i < channel->sendChunksExpected; i++) {
+			if ((channel->sentChunkFlags[i / 8] & bitSetArray[i % 8]) != 0 ) { return false; }
 	}
 	return (true);
 }
 
+boolean BleStar::getLinkStatistics(int bleDeviceIndex, BleLinkStatistics * stats) {
+	if (bleDeviceIndex < BLE_PERIPHERAL_INDEX || bleDeviceIndex >= MAX_CENTRAL_CONNECTIONS + 2) { return false; }
+	BleDeviceTable * bleDevice = &bleDeviceTable[bleDeviceIndex];
+	stats->peerName = bleDevice->peerName;
+	stats->isConnected = bleDevice->isConnected;
+	stats->chunkLength = bleDevice->chunkLength;
+	stats->sendChunkLength = getSendChunkLength(bleDevice);
+	stats->chunkLossPermille = bleDevice->chunkLossPermille;
+	stats->congestionWindow = bleDevice->congestionWindow;
+	stats->chunksInFlight = getChunksInFlight(bleDevice);
+	stats->srttMillis = bleDevice->rtt.getSrtt();
+	stats->rttVarMillis = bleDevice->rtt.getRttVar();
+	stats->rtoMillis = bleDevice->rtt.getRto();
+	stats->rttSamples = bleDevice->rtt.getSampleCount();
+	stats->drainRateBytesPerSecond = bleDevice->writer.getDrainRate();
+	stats->pendingControlBytes = bleDevice->writer.getPendingFrameLength();
+	stats->fecGroupSize = getFecGroupSizeForLink(bleDevice);
+	stats->peerFecGroupSize = bleDevice->peerFecGroupSize;
+	stats->chunksRepairedByParity = bleDevice->chunksRepairedByParity;
+	stats->chunksRepairedByChecks = bleDevice->chunksRepairedByChecks;
+	stats->transfersResumed = bleDevice->transfersResumed;
+	stats->qos0MessagesSent = bleDevice->qos0MessagesSent;
+	stats->qos0MessagesReceived = bleDevice->qos0MessagesReceived;
+	stats->qos0MessagesDropped = bleDevice->qos0MessagesDropped;
+	stats->framesPiggybacked = bleDevice->writer.getFramesPiggybacked();
+	stats->linkFailures = bleDevice->linkFailures;
+	stats->lastDetectionMillis = bleDevice->lastDetectionMillis;
+	stats->lastFailoverMillis = bleDevice->lastFailoverMillis;
+	return true;
+}
+
 int BleStar::getBleDeviceIndex(char * deviceName) {
 	int bleDeviceIndex = ERROR_BLE_DEVICE_NA;
 	for (int i = BLE_PERIPHERAL_INDEX; i < MAX_CENTRAL_CONNECTIONS + 2; i++) {
@@ -0,0 +1,157 @@
+#include "BleLinkWriter.h"
+
+
+void BleLinkWriter::attach(Stream * uart, uint32_t initialDrainRate) {
+	_uart = uart;
+	_isMidChunk = false;
+	_pendingLength = 0;
+	_deferredLength = 0;
+	_isDeferredPassedOver = false;
+	_notificationLength = MAX_BLE_CHUNK_LENGTH;
+	_drainRate = max((uint32_t)LINK_MIN_DRAIN_RATE, initialDrainRate);
+	_windowStart = millis();
+	_bytesAcceptedInWindow = 0;
+	_wasFullInWindow = false;
+	setPacerRate();
+	_pacer.reset(_pacer.getRate(), _pacer.getCapacity());
+}
+
+void BleLinkWriter::detach() {
+	_uart = NULL;
+	_isMidChunk = false;
+	_pendingLength = 0;
+	_deferredLength = 0;
+	_isDeferredPassedOver = false;
+}
+
+void BleLinkWriter::beginPass() {
+	if (_uart == NULL) { return; }
+	uint32_t now = millis();
+	updateDrainRate(now);
+	_pacer.refill(now);
+	if (_deferredLength > 0 && (int32_t)(now - _deferredDeadline) >= 0) { sendDeferredFrames(); }	// nothing came along in time
+	if (!_isMidChunk) { flushPendingFrames(); }
+}
+
+boolean BleLinkWriter::getCanStartChunk(int chunkLength) {
+	if (_uart == NULL || _isMidChunk || _pendingLength > 0) { return false; }
+	return (_pacer.getTokens() >= chunkLength + LINK_CONTROL_RESERVE_BYTES);
+}
+
+int BleLinkWriter::writeChunk(uint8_t * header, int headerLength, uint8_t * payload, int payloadLength, int bytesAlreadyWritten) {
+	if (_uart == NULL) { return 0; }
+
+	int chunkLength = headerLength + payloadLength;
+	if (bytesAlreadyWritten >= chunkLength) { return 0; }
+
+	int bytesWritten;
+	if (bytesAlreadyWritten >= headerLength) {									// header is already out, so the payload can be written in place
+		int payloadIndex = bytesAlreadyWritten - headerLength;
+		bytesWritten = write(&payload[payloadIndex], payloadLength - payloadIndex);
+	} else {
+		chunkLength = min(chunkLength, MAX_NEGOTIATED_BLE_CHUNK_LENGTH);
+		memcpy(_chunkBuffer, header, headerLength);
+		memcpy(&_chunkBuffer[headerLength], payload, chunkLength - headerLength);
+
+		// deferred frames ride in the rest of the notification if there's room; only a fresh chunk can take them
+		int trailerLength = (bytesAlreadyWritten == 0 && chunkLength + _deferredLength <= _notificationLength ? _deferredLength : 0);
+		memcpy(&_chunkBuffer[chunkLength], _deferredFrames, trailerLength);
+		bytesWritten = write(&_chunkBuffer[bytesAlreadyWritten], chunkLength + trailerLength - bytesAlreadyWritten);
+		if (trailerLength > 0 && bytesWritten > chunkLength) {
+			int trailerUnwritten = chunkLength + trailerLength - bytesWritten;	// goes ahead of everything else still queued
+			memmove(&_pendingFrames[trailerUnwritten], _pendingFrames, _pendingLength);
+			memcpy(_pendingFrames, &_deferredFrames[trailerLength - trailerUnwritten], trailerUnwritten);
+			_pendingLength += trailerUnwritten;
+			_deferredLength = 0;
+			_framesPiggybacked++;
+			bytesWritten = chunkLength;
+		}
+		_isDeferredPassedOver = (_deferredLength > 0 && bytesWritten > 0);		// this chunk had no room for them, and the next likely won't either
+	}
+	if (bytesAlreadyWritten + bytesWritten == 0) { return 0; }					// the FIFO took none of it, so it hasn't started
+	if (bytesAlreadyWritten == 0) { _pacer.forceConsume(chunkLength); }			// a chunk pays for itself up front, once it's started
+	_isMidChunk = (bytesAlreadyWritten + bytesWritten < chunkLength);
+	if (!_isMidChunk && _isDeferredPassedOver) {
+		_isDeferredPassedOver = false;
+		sendDeferredFrames();													// straight after the chunk, rather than at their deadline
+	}
+	if (!_isMidChunk) { flushPendingFrames(); }									// control frames queued during the chunk go before the next one
+	return (bytesWritten);
+}
+
+boolean BleLinkWriter::writeFrame(uint8_t * buffer, int length) {
+	if (_uart == NULL) { return false; }
+	if (_pendingLength + length > LINK_PENDING_FRAME_CAPACITY) { return false; }
+	memcpy(&_pendingFrames[_pendingLength], buffer, length);
+	_pendingLength += length;
+	_pacer.forceConsume(length);												// comes out of the reserve if need be
+	if (!_isMidChunk) { flushPendingFrames(); }
+	return true;
+}
+
+boolean BleLinkWriter::deferFrame(uint8_t * buffer, int length, uint32_t maxDelayMillis) {
+	if (_uart == NULL) { return false; }
+	if (_deferredLength + length > LINK_DEFERRED_FRAME_CAPACITY) { sendDeferredFrames(); }		// make room
+	if (_deferredLength + length > LINK_DEFERRED_FRAME_CAPACITY) { return (writeFrame(buffer, length)); }
+
+	uint32_t deadline = millis() + maxDelayMillis;
+	if (_deferredLength == 0 || (int32_t)(deadline - _deferredDeadline) < 0) { _deferredDeadline = deadline; }
+	memcpy(&_deferredFrames[_deferredLength], buffer, length);
+	_deferredLength += length;
+	_pacer.forceConsume(length);												// paid for now, whichever way it goes
+	return true;
+}
+
+// Moves the deferred frames to the pending queue, to be written by themselves ahead of the next chunk
+boolean BleLinkWriter::sendDeferredFrames() {
+	if (_deferredLength == 0) { return true; }
+	if (_pendingLength + _deferredLength > LINK_PENDING_FRAME_CAPACITY) { return false; }	// try again next pass
+	memcpy(&_pendingFrames[_pendingLength], _deferredFrames, _deferredLength);
+	_pendingLength += _deferredLength;
+	_deferredLength = 0;
+	if (!_isMidChunk) { flushPendingFrames(); }
+	return true;
+}
+
+void BleLinkWriter::flushPendingFrames() {
+	if (_pendingLength == 0) { return; }
+	int bytesWritten = write(_pendingFrames, _pendingLength);
+	_pendingLength -= bytesWritten;
+	if (bytesWritten > 0 && _pendingLength > 0) { memmove(_pendingFrames, &_pendingFrames[bytesWritten], _pendingLength); }
+}
+
+int BleLinkWriter::write(uint8_t * buffer, int length) {
+	if (_uart == NULL || length <= 0) { return 0; }
+	int bytesWritten = (int)_uart->write(buffer, (size_t)length);
+	_bytesAcceptedInWindow += bytesWritten;
+	if (bytesWritten < length) { _wasFullInWindow = true; }
+	return (bytesWritten);
+}
+
+// Only a window in which the FIFO filled up says how fast the link really drains, and that estimate is smoothed like
+// SRTT (1/8 gain).  A window that never filled only shows the link can go at least that fast
+void BleLinkWriter::updateDrainRate(uint32_t nowMillis) {
+	uint32_t elapsed = nowMillis - _windowStart;
+	if (elapsed < LINK_DRAIN_RATE_WINDOW_MILLIS) { return; }
+
+	uint32_t measuredRate = _bytesAcceptedInWindow * 1000 / elapsed;
+	if (_wasFullInWindow) {
+		_drainRate = _drainRate - (_drainRate >> 3) + (measuredRate >> 3);
+	} else if (measuredRate > _drainRate) {
+		_drainRate = measuredRate;
+	}
+	_drainRate = max((uint32_t)LINK_MIN_DRAIN_RATE, _drainRate);
+	setPacerRate();
+
+	_windowStart = nowMillis;
+	_bytesAcceptedInWindow = 0;
+	_wasFullInWindow = false;
+}
+
+void BleLinkWriter::setPacerRate() {
+	_pacer.setRate(_drainRate + (_drainRate >> LINK_PACER_PROBE_SHIFT));
+	_pacer.setCapacity(max(
+			(uint32_t)(MAX_NEGOTIATED_BLE_CHUNK_LENGTH + LINK_CONTROL_RESERVE_BYTES),
+			_drainRate * LINK_PACER_BURST_MILLIS / 1000
+		));
+}
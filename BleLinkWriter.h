@@ -0,0 +1,105 @@
+#ifndef BleLinkWriter_h
+#define BleLinkWriter_h
+
+#include "Common/CommonDefinitions.h"
+#include "Arduino.h"
+#include "Utility/TokenBucket.h"
+
+
+#define LINK_CONTROL_RESERVE_BYTES							MAX_BLE_CHUNK_LENGTH	// tokens data chunks leave untouched, so ACKs and SACKs are never starved
+#define LINK_PENDING_FRAME_CAPACITY							(MAX_BLE_CHUNK_LENGTH * 4)	// control frames waiting for room in the TX FIFO
+#define LINK_DEFERRED_FRAME_CAPACITY						MAX_BLE_CHUNK_LENGTH	// control frames waiting to ride along with a chunk
+#define LINK_PACER_BURST_MILLIS								20					// bucket holds this much drain time, and always at least one whole chunk
+#define LINK_DRAIN_RATE_WINDOW_MILLIS						50					// accepted bytes are counted over this long before the drain rate is updated
+#define LINK_PACER_PROBE_SHIFT								3					// tokens arrive 1/8 faster than the measured drain rate, to find out if it's grown
+#define LINK_MIN_DRAIN_RATE									200					// bytes per second; a link is never paced slower than this
+
+
+/**
+	BleLinkWriter is the transmit side of a single BLE link.  Each bleDeviceTable entry owns one, bound to either this
+	device's peripheral UART or one of the central mode client UARTs when the link connects, so the send methods never
+	need to work out which UART they are writing to.\n\n
+
+	A chunk (header byte(s) plus its slice of the compiled message) is handed over in one call and written with a single
+	UART write, so it normally leaves as a single notification.  If the UART's TX FIFO cannot take the whole chunk, the
+	number of bytes accepted is returned and the caller resumes from that offset on a later pass.  Until that chunk is
+	finished, control frames are queued rather than written, so they can never land in the middle of a chunk.\n\n
+
+	Nothing here ever waits.  Writes are paced by a token bucket filled at the rate the link has been measured to drain
+	its FIFO (how many bytes the UART accepted over a window in which it was full at least once), so each pass a slow
+	link only gets the chunks it can actually move.  LINK_CONTROL_RESERVE_BYTES of the bucket are kept for control
+	frames, which are written ahead of any new chunk.\n\n
+
+	A control frame that can wait a little (an ACK while data is flowing the other way) can be deferred instead.  It then
+	goes out in the same write, and so the same notification, as the next chunk if that has room left over for it.  If
+	it hasn't, the frame goes out by itself straight after that chunk, and if no chunk comes along, at its deadline.
+*/
+
+class BleLinkWriter {
+public:
+
+	/// Binds this writer to the UART of a newly connected link, starting the pacer at an estimate of the link's drain
+	/// rate.  BLEUart and BLEClientUart are both Streams
+	void attach(Stream * uart, uint32_t initialDrainRate);
+	void detach();
+	boolean getIsAttached() { return (_uart != NULL); }
+
+	/// Called once per pass before anything is written: refills the pacer, updates the drain rate estimate and writes
+	/// any control frames still waiting
+	void beginPass();
+
+	/// True if a data chunk of chunkLength bytes may start now.  A chunk already partly written may always continue
+	///
+	boolean getCanStartChunk(int chunkLength);
+
+	/// Writes bytes [bytesAlreadyWritten, headerLength + payloadLength) of the chunk made up of header followed by payload.
+	/// Returns the number of bytes the UART accepted in this call, 0 if the TX FIFO is full or the writer is not attached
+	int writeChunk(uint8_t * header, int headerLength, uint8_t * payload, int payloadLength, int bytesAlreadyWritten);
+
+	/// Writes a control frame (ACK, SACK...) now if it can, else queues it to go ahead of the next chunk.  Returns false
+	/// only if the queue is full
+	boolean writeFrame(uint8_t * buffer, int length);
+
+	/// Holds a control frame for up to maxDelayMillis, to be piggybacked on the next chunk that leaves room for it in its
+	/// notification.  Returns false only if it can't be queued at all
+	boolean deferFrame(uint8_t * buffer, int length, uint32_t maxDelayMillis);
+
+	/// The most a single notification can carry on this link; chunks shorter than this have room for deferred frames
+	///
+	void setNotificationLength(int length) { _notificationLength = min(length, MAX_NEGOTIATED_BLE_CHUNK_LENGTH); }
+
+	boolean getIsMidChunk() { return _isMidChunk; }
+	uint32_t getDrainRate() { return _drainRate; }
+	int getPendingFrameLength() { return _pendingLength; }
+	uint32_t getFramesPiggybacked() { return _framesPiggybacked; }
+
+private:
+	Stream * _uart = NULL;
+	boolean _isMidChunk = false;												// true while a chunk has been only partly accepted by the UART
+	uint8_t _chunkBuffer[MAX_NEGOTIATED_BLE_CHUNK_LENGTH];						// header and payload are assembled here so the chunk goes out in one write
+
+	uint8_t _pendingFrames[LINK_PENDING_FRAME_CAPACITY];
+	int _pendingLength = 0;
+
+	uint8_t _deferredFrames[LINK_DEFERRED_FRAME_CAPACITY];
+	int _deferredLength = 0;
+	uint32_t _deferredDeadline = 0;												// when the oldest deferred frame must go, chunk or not
+	boolean _isDeferredPassedOver = false;										// the chunk being written had no room for the deferred frames
+	int _notificationLength = MAX_BLE_CHUNK_LENGTH;
+	uint32_t _framesPiggybacked = 0;											// times deferred frames rode along with a chunk
+
+	TokenBucket _pacer;
+	uint32_t _drainRate = LINK_MIN_DRAIN_RATE;									// bytes per second the TX FIFO has been seen to empty at
+	uint32_t _windowStart = 0;
+	uint32_t _bytesAcceptedInWindow = 0;
+	boolean _wasFullInWindow = false;
+
+	int write(uint8_t * buffer, int length);
+	void flushPendingFrames();
+	boolean sendDeferredFrames();
+	void updateDrainRate(uint32_t nowMillis);
+	void setPacerRate();
+
+};
+
+#endif
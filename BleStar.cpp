@@ -20,6 +20,7 @@ void BleStar::begin(int maxConnectionsAsPeripheral, int maxConnectionsAsCentral,
 	Log.initialize(&Serial, "BleStar:", Log.VERBOSE);
 
 	_pointerToBleStarClass = this;
+	mTable.setMessageCallbacks(messageInUseCallbackWrapper, messageMovedCallbackWrapper);
 	_maxConnectionsAsPeripheral = maxConnectionsAsPeripheral;
 	_maxConnectionsAsCentral = min(MAX_CENTRAL_CONNECTIONS, maxConnectionsAsCentral);
 	_transmitPowerDbm = power;
@@ -28,7 +29,6 @@ void BleStar::begin(int maxConnectionsAsPeripheral, int maxConnectionsAsCentral,
 	bleDeviceTable[0].peerName = _thisDeviceName;
 	_isGateway = isGateway;
 
-	CRC::initializeTables();
 	Message::initialize();
 
 	setUuidForSignalStrengthMonitoring(DEFAULT_UUID_FOR_SIGNAL_STRENGTH_MONITORING);
@@ -38,6 +38,9 @@ void BleStar::begin(int maxConnectionsAsPeripheral, int maxConnectionsAsCentral,
 	Log.v("starting BleStar with max %d peripheral, %d central connections\n", maxConnectionsAsPeripheral, maxConnectionsAsCentral);
 
 #ifdef ARCHITECTURE_NRF52
+	// must be configured before Bluefruit.begin(); the MTU actually used per link is whatever the exchange after connection settles on
+	Bluefruit.configPrphConn(MAX_BLE_MTU, CONNECTION_EVENT_LENGTH, CONNECTION_HVN_QUEUE_SIZE, BLE_GATTC_WRITE_CMD_TX_QUEUE_SIZE_DEFAULT);
+	Bluefruit.configCentralConn(MAX_BLE_MTU, CONNECTION_EVENT_LENGTH, CONNECTION_HVN_QUEUE_SIZE, BLE_GATTC_WRITE_CMD_TX_QUEUE_SIZE_DEFAULT);
 	Bluefruit.begin(maxConnectionsAsPeripheral, maxConnectionsAsCentral);
 	Bluefruit.setTxPower(power);
 	Bluefruit.setName(thisDeviceName);
@@ -57,6 +60,7 @@ void BleStar::begin(int maxConnectionsAsPeripheral, int maxConnectionsAsCentral,
 }
 
 void BleStar::loop() {
+	mTable.defragmentMessages();												// first, while only the channels hold Message *s
 
 	pollReceivingMessages();
 	pollRoutingMessages();
@@ -6,16 +6,52 @@
 #include "RoutingTable.h"
 #include "Message/Message.h"
 #include "MessageTable.h"
+#include "BleLinkWriter.h"
 #include "Utility/MessageBuilder.h"
 #include "Utility/Logger.h"
 #include "Utility/CRC.h"
+#include "Utility/RttEstimator.h"
+#include "Utility/Delta.h"
 #include "stdarg.h"
 #include "functional"
 
 
 #define DEFAULT_POWER_LEVEL									0					// usually can go up to +8 depending on chipset
-#define DELAY_IF_BLE_TX_BUFFER_FULL							3					// guesstimate.  Need this in send so we don't fill up the tx buffer ever
-#define MIN_INTERVAL_BETWEEN_RESEND_REQUESTS				100					// 100 ms minimum between adjacent nodes.  This can be tuned once we have data
+#define SACK_EVERY_N_CHUNKS									16					// while a message streams in, receivedChunkFlags are reported at least this often
+#define CONNECTION_EVENT_LENGTH								6					// in units of 1.25 ms; long enough for a full 251 byte DLE packet each way
+#define CONNECTION_HVN_QUEUE_SIZE							3					// notifications queued in the SoftDevice per connection
+#define CHUNK_LENGTH_TIERS									3					// a link sends chunks of its full notification length, or that halved once or twice
+#define CHUNK_LOSS_WINDOW									64					// chunks sent between updates of a link's chunk loss rate
+#define CHUNK_LOSS_STEP_DOWN_PERMILLE						100					// smoothed loss above this, and messages start going in smaller chunks...
+#define CHUNK_LOSS_STEP_UP_PERMILLE							20					// ...and below this, in larger ones
+#define CONGESTION_WINDOW_INITIAL							32					// chunks a link may have sent but not yet acknowledged, across its channels
+#define CONGESTION_WINDOW_MIN								4
+#define CONGESTION_WINDOW_MAX								128
+#define DELAYED_ACK_MILLIS									10					// longest an ACK or NACK waits for a chunk going the other way to carry it
+#define DEFAULT_DELAYED_ACK									true				// if true, ACKs and NACKs wait to ride with a chunk going the other way
+#define DEFAULT_FEC_GROUP_SIZE								0					// chunks per parity chunk; 0 = no parity chunks are sent
+#define MAX_FEC_GROUP_SIZE									32
+#define DEFAULT_CHUNK_CHECK_REPAIR							true				// if true, a message failing its crc16 has its bad chunks found and resent, not all of it
+#define MAX_CHUNK_CHECK_ATTEMPTS							2					// times one message is repaired by chunk checks before it's NACKed
+#define DEFAULT_RESUME_GRACE_MILLIS							0					// how long transfers cut off by a disconnect wait for the peer; 0 = failed at once
+#define MAX_SUSPENDED_TRANSFERS								8
+#define DEFAULT_LINK_FAILURE_DETECTION_MILLIS				0					// a link nothing is heard on for this long is dropped; 0 = left to the supervision timeout
+#define HEARTBEAT_PROBES_PER_DETECTION						3					// a quiet link is probed this many times before it's given up on
+#define DEFAULT_CUT_THROUGH_FORWARDING						false				// if true, messages are forwarded as their chunks arrive rather than once complete
+#define MAX_DELTA_STREAMS									4					// (destination, messageId) streams sent with sendDelta; as many are tracked receiving
+#define MAX_DELTA_PAYLOAD_LENGTH							128					// longer payloads are always sent whole
+#define DELTA_HEADER_LENGTH									2					// crc16 of the base payload, ahead of the Delta encoding
+#define DELTA_KEYFRAME_INTERVAL								20					// deltas between keyframes, so a destination that lost its base recovers unasked
+#define DELTA_KEYFRAME_REQUEST_INTERVAL_MILLIS				1000				// a destination missing its base asks for a keyframe at most this often
+#define DEFAULT_COALESCE_LINGER_MILLIS						0					// how long a small message waits for others to share its hop; 0 = no coalescing
+#define COALESCE_MAX_RECORD_LENGTH							64					// compiled messages longer than this are never held back
+#define MAX_COALESCED_PAYLOAD_LENGTH						240
+#define MAX_CONFLATED_DESTINATIONS							8
+#define SCAN_SCHEDULE_INTERVAL_MILLIS						250					// how often the scan mode is looked at again
+#define SCAN_BACKGROUND_INTERVAL							1600				// in units of 0.625 ms; scanning 3% of the time
+#define SCAN_BACKGROUND_WINDOW								48
+#define SCAN_AGGRESSIVE_INTERVAL							160					// scanning 50% of the time
+#define SCAN_AGGRESSIVE_WINDOW								80
 
 
 #define MAX_NUMBER_OF_BLE_DEVICES_TO_LISTEN_FOR_BY_NAME		5
@@ -27,8 +63,6 @@ const int DEFAULT_MESSAGE_TABLE_CAPACITY			= 60;						// Max number of messages
 const int DEFAULT_NAME_TABLE_CAPACITY 				= 100;						// Max number of individual device names or subscriptions to track
 const int DEFAULT_ROUTING_TABLE_CAPACITY 			= 100;						// Max number of individual routes each node can maintain
 
-#define ACK_NOT_RECEIVED_BETWEEN_NODES_TIMEOUT				150					// 150 milliseconds
-
 #define GENERATED_UUID_FOR_CONNECTION					"69957c6e-b4de-4cea-a1dc-95ba5b1ffb64"
 #define UUID_FOR_SIGNAL_STRENGTH_MONITORING				"09a9b7e8-5cb1-4299-bf78-1213333e6b9f"
 #define GATEWAY_UUID									"0c80b78a-b610-4d73-8b20-20a7e480d40b" // unique ID for gateway so that nothing in network tries to connect with it
@@ -41,7 +75,6 @@ const uint8_t DEFAULT_UUID_FOR_GATEWAY[16] = { 0x0c, 0x80, 0xb7, 0x8a, 0xb6, 0x1
 #define TIMEOUT 				3
 
 const unsigned long EXPONENTIAL_BACKOFF_TABLE_MILLIS[] = { 0, 100, 200, 400, 2000, 6000, 20000 };   // jumps to allow time for complete reconnects
-const unsigned long DELAY_FOR_ACK[] = { 0, 50, 100, 200, 500, 1000, 1500 };
 
 #define ERROR_BLE_DEVICE_NA									-1
 #define ERROR_BLE_DEVICE_SAME								-2
@@ -49,57 +82,193 @@ const unsigned long DELAY_FOR_ACK[] = { 0, 50, 100, 200, 500, 1000, 1500 };
 
 #define AWAITING_NEW_MESSAGE								0
 #define RECEIVING_UNFORMED_MESSAGE							1
-#define AWAITING_END_OF_FIRST_CHUNK							2
-
-#define AWAITING_START_OF_IN_SEQUENCE_CHUNK					3
-#define AWAITING_START_OF_OUT_OF_SEQUENCE_CHUNK				4
 
-#define AWAITING_END_OF_IN_SEQUENCE_CHUNK					5
-#define AWAITING_END_OF_OUT_OF_SEQUENCE_CHUNK				6
+#define RECEIVE_STAGING_BUFFER_LENGTH						(MAX_NEGOTIATED_BLE_CHUNK_LENGTH * 2)	// room for one partial chunk plus a whole one behind it
 
 #define SENDING_COMPILED_MESSAGE							10
 #define SENDING_UNFORMED_MESSAGE							11
 
+#define BLE_LINK_CHANNELS									4					// messages in flight each way on a link at once; at most DATA_CHUNK_CHANNEL_MASK + 1
+#define NO_CHANNEL											-1
+#define BLE_LINK_CHANNELS_KEPT_FOR_URGENT					1					// idle send channels normal messages leave free, so an urgent one can start at once
 
-/* 	Holds an array of devices connected to this device, and a reference to a message if one is actively receiving data
-	Each device number has a meaning:
-		index # 0 = THIS device
-		index # 1 = PERIPHERAL device
-		index #2 - (MAX_CENTRAL_CONNECTIONS + 2) = CENTRAL DEVICES -- IF this is a nRF52
-*/
-struct BleDeviceTable {
-	int index;																	// index 0 to _numberOfBleCentralConnections + 2
-	boolean isConnected;														// true if device is connected and UART available
-	char * peerName;															// name of remote device that's connected
+#define CHUNK_WRITE_NOTHING_TO_SEND							0
+#define CHUNK_WRITE_COMPLETE								1
+#define CHUNK_WRITE_BLOCKED									2					// paced out, or the TX FIFO filled part way through the chunk
 
-	boolean isUsingTempReceiveBuffer = true;									// a 21 byte receive buffer is kept to receive short messages
-	MessageBuilder * tempReceiveBuffer;											// without the overhead of creating a message in messageTable
-																				// if messages are > 20 bytes, a message in messageTable is created
 
-	//int sendState = 0;
-	Message * messageBeingSent;													// pointer to message that's in process of being sent
+/*	One message being sent on a link.  Each link has BLE_LINK_CHANNELS of these, so several messages can be in flight
+	to the same neighbour at once, and one message's ACK round trip overlaps the chunks of the next
+*/
+struct BleSendChannel {
+	int channel;																// goes in the low bits of every chunk's marker byte
+	Message * messageBeingSent = NULL;												// pointer to message that's in process of being sent
 	MessageBuilder * sendBuffer;												// pointer to the underlying MessageBuilder
+	int chunkLength = MAX_BLE_CHUNK_LENGTH;										// fixed for the whole message, even if the link's MTU changes meanwhile
+	uint8_t priority = MESSAGE_PRIORITY_NORMAL;									// urgent channels write all their chunks before any normal channel writes
 	uint8_t sentChunkFlags[(CHUNK_FLAG_TABLE_CAPACITY+1)];						// an array of bits that holds whether a chunk needs to be resent or not.  1 = needs resent
+	uint8_t lostChunkFlags[(CHUNK_FLAG_TABLE_CAPACITY+1)];						// 1 = already counted in chunksLostInWindow while sending this message
 	int sendChunksExpected = 0;
 	int sendChunkInProgress = 0;
 	int indexWithinSendChunk = 0;
 	int sendAttempts = 0;
 	uint32_t lastSendTime;														// last time a chunk was sent
-	boolean sendChunkResendRequested = false;									// if a resend request is received, this goes true
-
+	boolean sendChunkResendRequested = false;									// if a SACK or NACK reports holes, this goes true
+	int sendResendFromChunk = 0;												// lowest hole reported; sending rewinds here at the next chunk boundary
+	int sendChunksAcknowledged = 0;												// every chunk below this is known to have arrived
+	uint32_t rttTimedSendTime = 0;												// when the last chunk first went out, if it's being timed to the ACK; else 0
+	boolean sendHasRetransmitted = false;										// Karn's rule: once anything is resent, the ACK can't be timed
+	boolean isResuming = false;													// sent a LINK_CONTROL_RESUME, and waiting for the SACK (or NACK) answering it
+	int fecGroupSize = 0;														// a parity chunk follows every fecGroupSize chunks; 0 if the link doesn't use them
+	int sendParityCoveredTo = 0;												// highest chunk a parity chunk has gone out (or is due) for
+	int sendParityFromChunk = 0;												// the parity chunk due next covers this chunk...
+	int sendParityChunkCount = 0;												// ...and this many after it; 0 = none due
+};
 
-	int receiveState = AWAITING_NEW_MESSAGE;									// flag for how to process incoming bytes to reconstruct a message
-	Message * messageBeingReceived;												// pointer to message once it's clear that a message needs to be created
-	MessageBuilder * receiveBuffer;												// MessageBuilder that can point to the tempReceiveBuffer or the receiveBuffer in a Message
+// One message being received on a link; the counterpart of the sender's BleSendChannel with the same number
+struct BleReceiveChannel {
+	int channel;
+	Message * messageBeingReceived = NULL;											// pointer to message once chunk 0 has arrived and space is reserved
+	MessageBuilder * receiveBuffer;												// the MessageBuilder in messageBeingReceived
+	int chunkLength = MAX_BLE_CHUNK_LENGTH;										// taken from the link when chunk 0 arrives
+	int receiveMessageLength = 0;
+	boolean isDiscarding = false;												// chunk 0 arrived but there was no room; skip this message's chunks
 	uint8_t receivedChunkFlags[(CHUNK_FLAG_TABLE_CAPACITY+1)];					// each bit == 0 if has been received successfully, 1 not yet and/or resend needed
 	int receiveChunksExpected = 0;
-	int receiveChunkInProgress = 0;
-	int indexWithinReceiveChunk = 0;
-	int chunkResendIndex = 0;
+	int receiveChunksContiguous = 0;											// every chunk below this has arrived, so that much of the message can be forwarded
+	uint16_t runningCrc16 = CRC_START_MODBUS;									// crc16 of the message up to runningCrc16Length, kept up as chunks arrive
+	int runningCrc16Length = COMPILED_MESSAGE_ORIGIN_NAME_POSITION;
+	boolean isCheckingChunks = false;											// crc16 failed; waiting for chunk checks to find the bad chunks
+	int chunkCheckAttempts = 0;
+	int chunkChecksOutstanding = 0;												// check requests not yet answered; the SACK waits for all of them
+	int chunksFoundByChecks = 0;												// corrupt chunks the answers so far have found
+	int receiveChunkInProgress = 0;												// next chunk expected if chunks arrive in sequence
+	boolean isCutThrough = false;												// routed from its first chunks; its hops forward chunks as they arrive
 	int receiveAttempts = 0;
 	uint32_t lastreceivedTime;
-	uint32_t lastResendRequestTime;
+	uint32_t lastSackTime;
+	int chunksSinceLastSack = 0;
+	uint32_t rttTimedSackTime = 0;												// when a SACK reporting a new gap went out, if it's being timed; else 0
+	int rttTimedChunk = 0;														// first chunk that SACK reported missing
+};
 
+
+/* 	Holds an array of devices connected to this device, and a reference to a message if one is actively receiving data
+	Each device number has a meaning:
+		index # 0 = THIS device
+		index # 1 = PERIPHERAL device
+		index #2 - (MAX_CENTRAL_CONNECTIONS + 2) = CENTRAL DEVICES -- IF this is a nRF52
+*/
+struct BleDeviceTable {
+	int index;																	// index 0 to _numberOfBleCentralConnections + 2
+	boolean isConnected;														// true if device is connected and UART available
+	BleLinkWriter writer;														// bound to this link's UART while connected; all chunks and raw frames go through it
+	char * peerName;															// name of remote device that's connected
+	uint16_t connectionHandle = BLE_CONN_HANDLE_INVALID;						// SoftDevice handle for this link, used to look up the negotiated MTU
+	int chunkLength = MAX_BLE_CHUNK_LENGTH;										// bytes per chunk on this link (ATT MTU - 3); refreshed at the start of every message
+	int chunkLengthTier = 0;													// messages are sent in chunks of chunkLength halved this many times
+	int chunkLossPermille = 0;													// smoothed share of the chunks sent that the peer reported lost
+	int chunksSentInWindow = 0;
+	int chunksLostInWindow = 0;
+	int congestionWindow = CONGESTION_WINDOW_INITIAL;							// most chunks that may be in flight on this link at once
+	int congestionWindowCredit = 0;												// chunks acknowledged cleanly since the window last grew
+	uint32_t lastCongestionWindowDecreaseTime = 0;
+	uint32_t lastSackRequestTime = 0;
+	RttEstimator rtt;															// drives the sender's ACK timeout and the receiver's SACK timers for this link
+
+	MessageBuilder * tempReceiveBuffer;											// holds unformed (text) messages, which never get a messageTable entry
+	uint8_t receiveStagingBuffer[RECEIVE_STAGING_BUFFER_LENGTH];				// bytes block read from the UART FIFO, decoded a whole frame at a time
+	int receiveStagingLength = 0;
+
+	BleSendChannel sendChannel[BLE_LINK_CHANNELS];
+	int nextSendChannel = 0;													// chunks are written round robin across channels, starting here
+	int channelMidChunk = NO_CHANNEL;											// channel whose chunk the TX FIFO only partly took; it finishes before any other writes
+	int classCredit[MESSAGE_PRIORITY_CLASSES] = { 0 };							// smooth weighted round robin state for picking the next class to send
+	uint8_t parityBuffer[MAX_NEGOTIATED_BLE_CHUNK_LENGTH];						// payload of the parity chunk being written; only one chunk per link is ever part written
+
+	boolean capabilitiesSent = false;											// a LINK_CONTROL_CAPABILITIES frame has been sent since the link connected
+	boolean hasPeerCapabilities = false;
+	uint8_t peerCapabilities = 0;												// LINK_CAPABILITY_... flags the peer announced
+	int peerFecGroupSize = 0;													// parity group size the peer sends with; 0 = none
+	uint32_t chunksRepairedByParity = 0;
+	uint32_t chunksRepairedByChecks = 0;										// corrupt chunks found by chunk checks and resent on their own
+	uint32_t transfersResumed = 0;												// messages either way carried on from where a disconnect cut them off
+	uint32_t lastHeartbeatTime = 0;
+	boolean isLinkFailed = false;												// heard nothing for too long, and disconnecting
+	uint32_t linkFailedTime = 0;												// when the heartbeat, or else the disconnect, found the link dead
+	uint32_t linkFailures = 0;													// times the link went down, however it was found
+	uint32_t lastDetectionMillis = 0;											// last heard from to found dead, the last time it went down
+	uint32_t lastFailoverMillis = 0;											// its messages routed again to the first on another link, the last time
+	boolean isFailoverPending = false;											// none of the messages routed again has reached another link yet
+	uint32_t qos0MessagesSent = 0;												// QoS 0 messages written in full to the peer
+	uint32_t qos0MessagesReceived = 0;
+	uint32_t qos0MessagesDropped = 0;											// QoS 0 messages either way given up on part way through
+
+	int receiveState = AWAITING_NEW_MESSAGE;									// flag for how to process incoming bytes that aren't chunks or control frames
+	uint32_t lastreceivedTime;
+	BleReceiveChannel receiveChannel[BLE_LINK_CHANNELS];
+};
+
+
+// One stream of payloads sent with sendDelta.  The base is the last payload the first hop acknowledged
+struct DeltaSendStream {
+	char * destination = NULL;													// from rTable; NULL = unused
+	uint16_t messageId = 0;
+	uint8_t base[MAX_DELTA_PAYLOAD_LENGTH];
+	int baseLength = 0;															// 0 = no base, so the next payload goes as a keyframe
+	uint8_t pending[MAX_DELTA_PAYLOAD_LENGTH];									// payload in flight; it becomes the base once its hop is ACKed
+	int pendingLength = 0;														// 0 = nothing in flight
+	uint16_t pendingCrc16 = 0;													// the in flight message's crc16, to recognise it when its hop completes
+	int deltasSinceKeyframe = 0;
+	boolean isKeyframeRequested = false;
+};
+
+// A message part way across a link when it disconnected, parked with its channel as it was in case the peer comes back
+struct SuspendedTransfer {
+	char * peerName = NULL;														// from rTable; NULL = unused
+	boolean isSending = false;
+	uint32_t suspendedTime = 0;
+	BleSendChannel sendChannel;													// if isSending
+	BleReceiveChannel receiveChannel;											// if not
+};
+
+// The receiving end of a DeltaSendStream; the base is the last payload rebuilt for the callback
+struct DeltaReceiveStream {
+	char * origin = NULL;														// from rTable; NULL = unused
+	uint16_t messageId = 0;
+	uint8_t base[MAX_DELTA_PAYLOAD_LENGTH];
+	int baseLength = 0;															// 0 = base lost; deltas are dropped until a keyframe arrives
+	uint32_t lastKeyframeRequestTime = 0;
+};
+
+
+// Snapshot of one link's state, for checking how the timers have adapted to it
+struct BleLinkStatistics {
+	char * peerName;
+	boolean isConnected;
+	int chunkLength;
+	int sendChunkLength;														// chunk length new messages are sent in, after loss adaptation
+	int chunkLossPermille;
+	int congestionWindow;
+	int chunksInFlight;
+	uint32_t srttMillis;
+	uint32_t rttVarMillis;
+	uint32_t rtoMillis;
+	uint32_t rttSamples;
+	uint32_t drainRateBytesPerSecond;
+	int pendingControlBytes;
+	int fecGroupSize;															// parity group size used sending on this link; 0 = none
+	int peerFecGroupSize;														// parity group size the peer sends with; 0 = none
+	uint32_t chunksRepairedByParity;
+	uint32_t chunksRepairedByChecks;
+	uint32_t transfersResumed;
+	uint32_t qos0MessagesSent;
+	uint32_t qos0MessagesReceived;
+	uint32_t qos0MessagesDropped;
+	uint32_t framesPiggybacked;													// times ACKs/NACKs rode along with a chunk instead of going alone
+	uint32_t linkFailures;
+	uint32_t lastDetectionMillis;												// how long the link was quiet before it was found dead
+	uint32_t lastFailoverMillis;												// from its messages going back to be routed to the first taking another link
 };
 
 
@@ -136,6 +305,22 @@ public:
 	void setUuidForSignalStrengthMonitoring(BLEUuid uuid);
 	void setUuidForSignalStrengthMonitoring(uint8_t uuidArray[16]);
 	boolean send(uint8_t * payload, int payloadLength, char * destination, uint16_t messageId, boolean isSystemMessage);
+	boolean send(uint8_t * payload, int payloadLength, char * destination, uint16_t messageId, boolean isSystemMessage, uint8_t priority);
+	boolean sendUrgent(uint8_t * payload, int payloadLength, char * destination, uint16_t messageId);
+	boolean sendDelta(uint8_t * payload, int payloadLength, char * destination, uint16_t messageId);
+	boolean getLinkStatistics(int bleDeviceIndex, BleLinkStatistics * stats);
+	void setForwardErrorCorrection(int groupSize);
+	void setChunkCheckRepair(boolean enabled);
+	void setDelayedAck(boolean enabled);
+	void setResumableTransfers(uint32_t graceMillis);
+	void setLinkFailureDetection(uint32_t detectionMillis);
+	void setCutThroughForwarding(boolean enabled);
+	void setPayloadCompression(boolean enabled);
+	void setCoalescing(uint32_t lingerMillis);
+	boolean setConflation(char * destination, boolean enabled);
+	void setScanMode(int mode);
+	int getScanMode() { return _scanMode; }
+	uint32_t getScanModeMillis(int mode);
 
 	// User facing callbacks
 	typedef void (*listenerFunctionCallback) (ble_gap_evt_adv_report_t*);
@@ -182,6 +367,28 @@ private:
 	int _maxConnectionsAsPeripheral;
 	char * _thisDeviceName;
 	boolean _isGateway = false;
+	int _fecGroupSize = DEFAULT_FEC_GROUP_SIZE;
+	boolean _isCutThroughForwarding = DEFAULT_CUT_THROUGH_FORWARDING;
+	boolean _isChunkCheckRepair = DEFAULT_CHUNK_CHECK_REPAIR;
+	boolean _isDelayedAck = DEFAULT_DELAYED_ACK;
+	uint32_t _resumeGraceMillis = DEFAULT_RESUME_GRACE_MILLIS;
+	SuspendedTransfer suspendedTransfer[MAX_SUSPENDED_TRANSFERS];
+	uint32_t _linkFailureDetectionMillis = DEFAULT_LINK_FAILURE_DETECTION_MILLIS;
+	Message _expandedMessage;													// uncompressed copy of the last compressed message routed to this device
+	uint8_t _expandedMessageBuffer[MAX_EXPANDED_MESSAGE_LENGTH];				// big enough for any message that can arrive
+	uint32_t _coalesceLingerMillis = DEFAULT_COALESCE_LINGER_MILLIS;
+	char * conflatedDestinations[MAX_CONFLATED_DESTINATIONS];					// from rTable; NULL = unused
+	int _numberOfConflatedDestinations = 0;
+	DeltaSendStream deltaSendStream[MAX_DELTA_STREAMS];
+	int _nextDeltaSendStream = 0;												// the stream reused next when all are taken
+	DeltaReceiveStream deltaReceiveStream[MAX_DELTA_STREAMS];
+	int _nextDeltaReceiveStream = 0;
+	boolean _isScanningEnabled = false;
+	int _scanPolicy = SCAN_MODE_AUTOMATIC;										// or a fixed SCAN_MODE_... from setScanMode
+	int _scanMode = SCAN_MODE_OFF;												// the mode the scanner is in now
+	uint32_t _scanModeSince = 0;
+	uint32_t _lastScanScheduleTime = 0;
+	uint32_t _scanModeMillis[SCAN_MODES] = { 0 };								// time spent in each mode, up to _scanModeSince
 
 	void loop();
 
@@ -206,7 +413,11 @@ private:
 	void addToRoutingTable(char * branchNodeName, char * destinationNodeName);
 	boolean routeMessage(Message * m);
 	boolean getDestinationNodePattern(char * message, char * target);
-	void processRoutedMessage(BleDeviceTable * bleDevice);
+	void processRoutedMessage(BleDeviceTable * bleDevice, BleReceiveChannel * channel);
+	void deliverRoutedMessage(Message * m);
+	void startCutThroughIfReady(BleDeviceTable * bleDevice, BleReceiveChannel * channel);
+	void cancelCutThrough(BleReceiveChannel * channel);
+	int getBytesAvailableToForward(uint8_t * compiledMessage, int messageLength);
 	void processUnformedMessage(BleDeviceTable * bleDevice);
 	void pollRoutingMessages();
 
@@ -240,6 +451,9 @@ private:
 	// Central mode public methods
 	void startScanning();
 	void stopScanning();
+	void scheduleScanning(boolean isRestartNeeded);
+	int getScanModeForState();
+	boolean getIsBulkTransferActive();
 	static void scanCallbackWrapper(ble_gap_evt_adv_report_t* report);
 	void scanCallback(ble_gap_evt_adv_report_t* report);
 
@@ -257,56 +471,123 @@ private:
 
 
 	// Abstracted send methods (work regardless of whether peripheral or central connection)
-	int bleWriteDeviceIndex;
-	BleCentralConnectionTable * bcct;
-
 	void pollSendingMessages();
-	void assignMessageToBleDevice(Message * m, BleDeviceTable * bleDevice);
+	void coalesceMessagesForHop(BleDeviceTable * bleDevice);
+	boolean getIsCoalescable(Message * m);
+	void unpackCoalescedMessage(Message * m);
+	void fireTransmissionFailedCallbacks(Message * m);
+	boolean addNewMessageToSend(uint8_t * payload, int payloadLength, char * destination, uint16_t messageId, boolean isSystemMessage, uint8_t flags);
+	boolean getIsConflated(char * destinationName);
+	Message * getNextMessageForHop(BleDeviceTable * bleDevice, boolean isWeightedClassAllowed);
+	void assignMessageToSendChannel(Message * m, BleDeviceTable * bleDevice, BleSendChannel * channel);
 	void pollSendingMessage(BleDeviceTable * bleDevice);
-	int writeToBleDevice(uint8_t u);
+	void updateSendChannel(BleDeviceTable * bleDevice, BleSendChannel * channel);
+	int writeChunksRoundRobin(BleDeviceTable * bleDevice, uint8_t priority);
+	int writeNextChunk(BleDeviceTable * bleDevice, BleSendChannel * channel);
+	int writeParityChunk(BleDeviceTable * bleDevice, BleSendChannel * channel);
+	int getFecGroupSizeForLink(BleDeviceTable * bleDevice);
 
 	boolean sendRawToBleDevice(uint8_t * buffer, int bufferLength, char * destinationDevice);
 	boolean sendRawToBleDevice(uint8_t * buffer, int bufferLength, int bleDeviceIndex);
 	int getBleDeviceIndex(char * deviceName);
-	void setBleWriteDevice(int bleDeviceIndex);
 
-	int getNumberOfChunksForMessageLength(int messageLength);
-	int getMessageBuilderIndexForChunkNumber(int chunkNumber);
+	int getNumberOfChunksForMessageLength(int messageLength, int chunkLength);
+	int getMessageBuilderIndexForChunkNumber(int chunkNumber, int chunkLength);
+	int getChunkLengthForConnection(uint16_t connectionHandle);
+	uint32_t getInitialRttForConnection(uint16_t connectionHandle);
+	uint32_t getInitialDrainRateForConnection(uint16_t connectionHandle);
+	void updateChunkLength(BleDeviceTable * bleDevice);
+	int getSendChunkLength(BleDeviceTable * bleDevice);
+	void updateChunkLossRate(BleDeviceTable * bleDevice);
+	int getChunksInFlight(BleDeviceTable * bleDevice);
+	boolean getIsCongestionWindowOpen(BleDeviceTable * bleDevice);
+	void growCongestionWindow(BleDeviceTable * bleDevice, int chunksAcknowledged);
+	void shrinkCongestionWindow(BleDeviceTable * bleDevice, boolean isForced);
+	void processReceiveOverflow(BleDeviceTable * bleDevice, uint8_t * body, int bodyLength);
+	void suspendTransfers(BleDeviceTable * bleDevice);
+	SuspendedTransfer * getFreeSuspendedTransfer();
+	void pollSuspendedTransfers();
+	void resumeSuspendedTransfers(BleDeviceTable * bleDevice);
+	void sendResume(BleDeviceTable * bleDevice, BleSendChannel * channel);
+	void pollLinkHeartbeat(BleDeviceTable * bleDevice);
+	void sendHeartbeat(BleDeviceTable * bleDevice, uint8_t heartbeatType);
+	void requeueMessagesForLink(BleDeviceTable * bleDevice);
+	void updateFailoverTime(Message * m, BleDeviceTable * bleDevice);
 	void resetSendMessage(BleDeviceTable * bleDevice);
-
-	boolean getChunkNeedsToBeSent(BleDeviceTable * bleDevice, int chunkNumber);
-	void setChunkNotSent(BleDeviceTable * bleDevice, int chunkNumber);
-	void setChunkSent(BleDeviceTable * bleDevice, int chunkNumber);
-	boolean getAllChunksSent(BleDeviceTable * bleDevice);
+	void resetSendChannel(BleSendChannel * channel);
+	static boolean messageInUseCallbackWrapper(Message * m);
+	boolean getIsMessageInUse(Message * m);
+	static void messageMovedCallbackWrapper(Message * from, Message * to);
+	void messageMoved(Message * from, Message * to);
+
+	boolean getChunkNeedsToBeSent(BleSendChannel * channel, int chunkNumber);
+	void setChunkNotSent(BleSendChannel * channel, int chunkNumber);
+	void setChunkSent(BleSendChannel * channel, int chunkNumber);
+	boolean getChunkCountedLost(BleSendChannel * channel, int chunkNumber);
+	void setChunkCountedLost(BleSendChannel * channel, int chunkNumber);
+	boolean getAllChunksSent(BleSendChannel * channel);
 	void failAndClearAnyMessagesBeingSent(BleDeviceTable * bleDevice);
+	void failAndClearSendChannel(BleDeviceTable * bleDevice, BleSendChannel * channel);
 
 	// Abstracted receive methods (work regardless of whether peripheral or central connection)
 	void pollReceivingMessages();
 	void pollReceivingMessage(int bleDeviceIndex);
-	void parseAndReorderReceivedData(uint8_t u, BleDeviceTable * bleDevice);
-
-	boolean sendResendRequestSequence(BleDeviceTable * bleDevice, int fromChunk, int toChunkInclusive);
-	void sendResendRequest(BleDeviceTable * bleDevice, int upToAndIncludingThisChunkNumber);
+	int readFromBleDevice(BleDeviceTable * bleDevice, uint8_t * buffer, int maxLength);
+	void processReceiveStagingBuffer(BleDeviceTable * bleDevice);
+	int decodeReceivedFrame(BleDeviceTable * bleDevice, uint8_t * frame, int length);
+	void receiveFirstChunk(BleDeviceTable * bleDevice, BleReceiveChannel * channel, uint8_t * frame, int chunkLength);
+	int receiveChunk(BleDeviceTable * bleDevice, uint8_t * frame, int length);
+	int receiveParityChunk(BleDeviceTable * bleDevice, uint8_t * frame, int length);
+	int getChunkPayloadLength(BleReceiveChannel * channel, int chunkNumber);
+	int receiveUnformedBytes(BleDeviceTable * bleDevice, uint8_t * frame, int length);
+	void completeReceivedMessage(BleDeviceTable * bleDevice, BleReceiveChannel * channel);
+
+	int receiveLinkControlFrame(BleDeviceTable * bleDevice, uint8_t * frame, int length);
+	int sendSelectiveAck(BleDeviceTable * bleDevice, BleReceiveChannel * channel, int upToChunk);
+	void processSelectiveAck(BleDeviceTable * bleDevice, uint8_t * body, int bodyLength);
+	boolean sendLinkCapabilities(BleDeviceTable * bleDevice);
+	void processLinkCapabilities(BleDeviceTable * bleDevice, uint8_t * body, int bodyLength);
+	void resetLinkCapabilities(BleDeviceTable * bleDevice);
+	boolean startChunkCheckRepair(BleDeviceTable * bleDevice, BleReceiveChannel * channel);
+	void sendChunkCheckRequest(BleDeviceTable * bleDevice, BleReceiveChannel * channel, int firstChunk, int chunkCount);
+	void processChunkCheckRequest(BleDeviceTable * bleDevice, uint8_t * body, int bodyLength);
+	void processChunkChecks(BleDeviceTable * bleDevice, uint8_t * body, int bodyLength);
+	void processSackRequest(BleDeviceTable * bleDevice, uint8_t * body, int bodyLength);
+	void sendReceiveOverflow(BleDeviceTable * bleDevice, BleReceiveChannel * channel);
+	void processResume(BleDeviceTable * bleDevice, uint8_t * body, int bodyLength);
+	void processHeartbeat(BleDeviceTable * bleDevice, uint8_t * body, int bodyLength);
+	uint8_t getChunkCheck(uint8_t * compiledMessage, int messageLength, int chunkLength, int firstChunk, int chunkCount);
 
-	void parseExpectedStartOfChunk(uint8_t u, BleDeviceTable * bleDevice, boolean isInSequence);
 	void resetReceiveMessage(BleDeviceTable * bleDevice);
+	void resetReceiveChannel(BleReceiveChannel * channel);
+	void resetUnformedMessage(BleDeviceTable * bleDevice);
 
-	boolean getChunkReceived(BleDeviceTable * bleDevice, int chunkNumber);
-	void setChunkReceived(BleDeviceTable * bleDevice, int chunkNumber);
-	boolean getAllChunksReceived(BleDeviceTable * bleDevice);
+	boolean getChunkReceived(BleReceiveChannel * channel, int chunkNumber);
+	void setChunkReceived(BleReceiveChannel * channel, int chunkNumber);
+	void setChunkNotReceived(BleReceiveChannel * channel, int chunkNumber);
+	boolean getAllChunksReceived(BleReceiveChannel * channel);
 
-	void sendAck(BleDeviceTable * bleDevice);
-	void sendNack(BleDeviceTable * bleDevice);
+	void sendAck(BleDeviceTable * bleDevice, BleReceiveChannel * channel);
+	void sendNack(BleDeviceTable * bleDevice, BleReceiveChannel * channel);
+	void processAck(BleDeviceTable * bleDevice, uint8_t * body, int bodyLength);
+	void processNack(BleDeviceTable * bleDevice, uint8_t * body, int bodyLength);
+	void sendDeferrableToBleDevice(BleDeviceTable * bleDevice, uint8_t * buffer, int bufferLength);
 
-	void checkForDelimiterOnUnformedMessage(BleDeviceTable * bleDevice, uint8_t u);
-	void checkForFirstChunkComplete(BleDeviceTable * bleDevice);
-	void checkForEndOfChunk(BleDeviceTable * bleDevice);
 	void printEntireMessage(BleDeviceTable * bleDevice);
 
-	boolean isShortIncomingSystemMessage(BleDeviceTable * bleDevice);
 	void failAndClearAnyMessagesBeingReceived(BleDeviceTable * bleDevice);
+	void failAndClearReceiveChannel(BleDeviceTable * bleDevice, BleReceiveChannel * channel);
 
 	void processRoutedSystemMessage(Message * m);
+	Message * getScratchMessage();
+	Message * getExpandedMessage(Message * m);
+	Message * getDeltaDecodedMessage(Message * m);
+	DeltaSendStream * getDeltaSendStream(char * destination, uint16_t messageId);
+	DeltaReceiveStream * getDeltaReceiveStream(char * origin, uint16_t messageId);
+	void deltaMessageDelivered(Message * m);
+	void deltaMessageFailed(Message * m);
+	void requestKeyframe(DeltaReceiveStream * stream);
+	void processKeyframeRequest(Message * m);
 	void sendRoutingInformationUpstream(char * routingChangesList);
 	void sendAllRoutingInformationUpstream();
 	void subscribe(char * subscriptionName);
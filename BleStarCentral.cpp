@@ -1,8 +1,17 @@
 #include "BleStar.h"
 
-// scanner start and stop or resume not clear here 
+/*
+	Scanning takes radio time from every connection event, so the scanner isn't left running flat out.  Every
+	SCAN_SCHEDULE_INTERVAL_MILLIS, scheduleScanning picks a scan mode from the state of the device, and only touches the
+	scanner if the mode has changed:
 
+		SCAN_MODE_OFF			every central slot is taken, or a bulk message is moving on some link
+		SCAN_MODE_AGGRESSIVE	slots are free and nothing is upstream of this device (or it's the gateway)
+		SCAN_MODE_BACKGROUND	anything else; a low duty cycle, enough to pick up new devices eventually
 
+	Advertisement listeners need the scanner, so with any registered it never goes below SCAN_MODE_BACKGROUND.
+	setScanMode fixes the mode instead, and getScanModeMillis reports the time spent in each
+*/
 
 void BleStar::centralBegin() {
 	Bluefruit.Central.setConnectCallback(connectAsCentralCallbackWrapper);
@@ -11,19 +20,80 @@ void BleStar::centralBegin() {
 
 void BleStar::startScanning() {
 	Bluefruit.Scanner.setRxCallback(scanCallbackWrapper);
-	Bluefruit.Scanner.restartOnDisconnect(true);
-	Bluefruit.Scanner.setInterval(160, 80); // in unit of 0.625 ms
+	Bluefruit.Scanner.restartOnDisconnect(false);								// scheduleScanning decides
 	Bluefruit.Scanner.filterUuid(thisDeviceAsPeripheralUart.uuid);
 	Bluefruit.Scanner.useActiveScan(false);
-	Bluefruit.Scanner.start(0);                   // 0 = Don't stop scanning after n seconds
+	_isScanningEnabled = true;
+	scheduleScanning(true);
 	Log.v("Scanning started");
 }
 
 void BleStar::stopScanning() {
-	Bluefruit.Scanner.stop();
+	_isScanningEnabled = false;
+	scheduleScanning(true);
 	Log.v("Scanning stopped");
 }
 
+// SCAN_MODE_AUTOMATIC (the default) lets scheduleScanning choose
+void BleStar::setScanMode(int mode) {
+	if (mode != SCAN_MODE_AUTOMATIC && (mode < 0 || mode >= SCAN_MODES)) {
+		Log.e("Cannot set scan mode %d; unknown mode", mode);
+		return;
+	}
+	_scanPolicy = mode;
+	scheduleScanning(true);
+}
+
+uint32_t BleStar::getScanModeMillis(int mode) {
+	if (mode < 0 || mode >= SCAN_MODES) { return 0; }
+	return (_scanModeMillis[mode] + (mode == _scanMode ? millis() - _scanModeSince : 0));
+}
+
+// isRestartNeeded re-applies the mode now, even if it hasn't changed, for when something else has stopped the scanner
+void BleStar::scheduleScanning(boolean isRestartNeeded) {
+	uint32_t now = millis();
+	if (!isRestartNeeded && now - _lastScanScheduleTime < SCAN_SCHEDULE_INTERVAL_MILLIS) { return; }
+	_lastScanScheduleTime = now;
+
+	int mode = SCAN_MODE_OFF;
+	if (_isScanningEnabled) { mode = (_scanPolicy == SCAN_MODE_AUTOMATIC) ? getScanModeForState() : _scanPolicy; }
+	if (mode == _scanMode && !isRestartNeeded) { return; }
+
+	_scanModeMillis[_scanMode] += now - _scanModeSince;
+	_scanModeSince = now;
+	if (mode != _scanMode) { Log.v("Scan mode changed from %d to %d", _scanMode, mode); }
+	_scanMode = mode;
+
+	Bluefruit.Scanner.stop();
+	switch (mode) {
+		case SCAN_MODE_BACKGROUND: Bluefruit.Scanner.setInterval(SCAN_BACKGROUND_INTERVAL, SCAN_BACKGROUND_WINDOW); break;
+		case SCAN_MODE_AGGRESSIVE: Bluefruit.Scanner.setInterval(SCAN_AGGRESSIVE_INTERVAL, SCAN_AGGRESSIVE_WINDOW); break;
+		default: return;
+	}
+	Bluefruit.Scanner.start(0);													// 0 = Don't stop scanning after n seconds
+}
+
+int BleStar::getScanModeForState() {
+	int lowestMode = (_numberOfDevicesListenedByName + _numberOfDevicesListenedByUuid > 0) ? SCAN_MODE_BACKGROUND : SCAN_MODE_OFF;
+	if (_numberOfBleCentralConnections >= _maxConnectionsAsCentral || getIsBulkTransferActive()) { return lowestMode; }
+	if (_isGateway || !bleDeviceTable[BLE_PERIPHERAL_INDEX].isConnected) { return SCAN_MODE_AGGRESSIVE; }
+	return SCAN_MODE_BACKGROUND;
+}
+
+boolean BleStar::getIsBulkTransferActive() {
+	for (int i = BLE_PERIPHERAL_INDEX; i < _numberOfBleCentralConnections + BLE_CENTRAL_INDEX_0; i++) {
+		BleDeviceTable * bleDevice = &bleDeviceTable[i];
+		if (!bleDevice->isConnected) { continue; }
+		for (int j = 0; j < BLE_LINK_CHANNELS; j++) {
+			Message * sending = bleDevice->sendChannel[j].messageBeingSent;
+			Message * receiving = bleDevice->receiveChannel[j].messageBeingReceived;
+			if (sending != NULL && sending->getSchedulingClass() == MESSAGE_PRIORITY_BULK) { return true; }
+			if (receiving != NULL && receiving->getSchedulingClass() == MESSAGE_PRIORITY_BULK) { return true; }
+		}
+	}
+	return false;
+}
+
 void BleStar::resetBleCentralConnectionTable() {
 	for (int i = 0; i < MAX_CENTRAL_CONNECTIONS; i++) {
 		bleCentralConnectionTable[i].bleConnectionHandle = BLE_CONN_HANDLE_INVALID;
@@ -93,15 +163,24 @@ void BleStar::connectAsCentralCallback(uint16_t connectionHandle) {
 	if (bleCentralConnection->bleCentralUart.discover(connectionHandle)) {
 		resetReceiveMessage(bleDevice);
 		resetSendMessage(bleDevice);
+		bleDevice->receiveStagingLength = 0;
+		resetLinkCapabilities(bleDevice);
 		bleDevice->peerName = rTable.getNamePointerFromName(connectedDeviceName, bleDevice->index);
+		bleDevice->connectionHandle = connectionHandle;
+		bleDevice->rtt.reset(getInitialRttForConnection(connectionHandle));
 		bleDevice->isConnected = true;
+		bleDevice->writer.attach(&bleCentralConnection->bleCentralUart, getInitialDrainRateForConnection(connectionHandle));
 		bleCentralConnection->bleCentralUart.enableTXD();
 
+		connection->requestMtuExchange(MAX_BLE_MTU);								// as central, this device starts the MTU exchange for the link
+		connection->requestDataLengthUpdate();
+		updateChunkLength(bleDevice);
+
 		_numberOfBleCentralConnections++;
 		recalculateNumberOfBleConnections();
 		Log.i("Connected to %s and UART started", bleDevice->peerName);
 
-		Bluefruit.Scanner.start(0);
+		scheduleScanning(true);														// connecting stopped the scanner
 	} else {
 		Bluefruit.disconnect(connectionHandle);
 		Log.e("Connected to %s but UART could not be established; disconnecting", bleDevice->peerName);
@@ -123,11 +202,16 @@ void BleStar::disconnectAsCentralCallback(uint16_t connectionHandle, uint8_t rea
 					reason,
 					--_numberOfBleCentralConnections);
 
+	suspendTransfers(bleDevice);
+	requeueMessagesForLink(bleDevice);
 	failAndClearAnyMessagesBeingSent(bleDevice);
 	failAndClearAnyMessagesBeingReceived(bleDevice);
 
 	bleDevice->peerName = NULL;
 	bleDevice->isConnected = false;
+	bleDevice->writer.detach();
+	bleDevice->connectionHandle = BLE_CONN_HANDLE_INVALID;
+	bleDevice->chunkLength = MAX_BLE_CHUNK_LENGTH;
 	recalculateNumberOfBleConnections();
 	rTable.invalidatePeerBleDeviceRoutes(bleDevice->index);
 }
@@ -148,11 +232,3 @@ int BleStar::findConnectionHandle(uint16_t connectionHandle) {
 	return (-1);
 }
 
-
-
-
-/*
-configPrphConn(247, 150, 3, BLE_GATTC_WRITE_CMD_TX_QUEUE_SIZE_DEFAULT);
-configCentralConn(247, 150, 3, BLE_GATTC_WRITE_CMD_TX_QUEUE_SIZE_DEFAULT);
-(uint16_t mtu_max, uint8_t event_len, uint8_t hvn_qsize, uint8_t wrcmd_qsize);
-*/
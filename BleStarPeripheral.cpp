@@ -56,6 +56,11 @@ void BleStar::connectAsPeripheralCallback(uint16_t connectionHandle) {
 
 	bleDeviceTable[BLE_PERIPHERAL_INDEX].peerName = rTable.getNamePointerFromName(name, BLE_PERIPHERAL_INDEX);;
 	Log.v("Connected to device %s\n", bleDeviceTable[BLE_PERIPHERAL_INDEX].peerName);
+	bleDeviceTable[BLE_PERIPHERAL_INDEX].connectionHandle = connectionHandle;		// MTU is picked up from this once the central has exchanged it
+	bleDeviceTable[BLE_PERIPHERAL_INDEX].writer.attach(&thisDeviceAsPeripheralUart, getInitialDrainRateForConnection(connectionHandle));
+	bleDeviceTable[BLE_PERIPHERAL_INDEX].rtt.reset(getInitialRttForConnection(connectionHandle));
+	bleDeviceTable[BLE_PERIPHERAL_INDEX].receiveStagingLength = 0;
+	resetLinkCapabilities(&bleDeviceTable[BLE_PERIPHERAL_INDEX]);
 	bleDeviceTable[BLE_PERIPHERAL_INDEX].isConnected = true;
 
 	recalculateNumberOfBleConnections();
@@ -70,11 +75,16 @@ void BleStar::disconnectAsPeripheralCallback(uint16_t connectionHandle, uint8_t
 	connection->getPeerName(remoteDeviceName,sizeof(remoteDeviceName));
 	Log.v("Disconnected from device %s for reason code %d\n",remoteDeviceName, reason);
 
+	suspendTransfers(&bleDeviceTable[BLE_PERIPHERAL_INDEX]);
+	requeueMessagesForLink(&bleDeviceTable[BLE_PERIPHERAL_INDEX]);
 	failAndClearAnyMessagesBeingReceived(&bleDeviceTable[BLE_PERIPHERAL_INDEX]);
 	failAndClearAnyMessagesBeingSent(&bleDeviceTable[BLE_PERIPHERAL_INDEX]);
 
 	rTable.invalidatePeerBleDeviceRoutes(BLE_PERIPHERAL_INDEX);
 	bleDeviceTable[BLE_PERIPHERAL_INDEX].isConnected = false;
+	bleDeviceTable[BLE_PERIPHERAL_INDEX].writer.detach();
+	bleDeviceTable[BLE_PERIPHERAL_INDEX].connectionHandle = BLE_CONN_HANDLE_INVALID;
+	bleDeviceTable[BLE_PERIPHERAL_INDEX].chunkLength = MAX_BLE_CHUNK_LENGTH;
 	recalculateNumberOfBleConnections();
 }
 
@@ -0,0 +1,140 @@
+#include "BleStar.h"
+
+/*
+	Repairing a message whose crc16 fails without resending all of it.  Normally the receiver then sends a NACK and the
+	whole message goes again from chunk 0.  If the peer understands LINK_CAPABILITY_CHUNK_CHECKS, the receiver keeps
+	the buffer and asks the sender for check values over its chunks instead:
+
+		LINK_CONTROL_CHUNK_CHECK_REQUEST	[channel][crc16 of message, 2 bytes][first chunk][chunks covered]
+		LINK_CONTROL_CHUNK_CHECKS			[channel][crc16 of message, 2 bytes][first chunk][chunks covered]
+											[chunks per check][CRC8 of each group of chunks' payloads]
+
+	A CHUNK_CHECKS frame always fits a single notification, so it has room for CHUNK_CHECKS_PER_FRAME checks, and
+	each covers as many chunks as it takes to span the range asked for.  The receiver works out the same CRC8s over
+	its copy: a group that doesn't match is asked about again on its own, and a single chunk that doesn't match is
+	marked missing.  That makes a tree, so a 200 chunk message gets down to the bad chunk in a few round trips of one
+	small frame each.  Once every request has been answered, the chunks found are asked for with a single SACK, and
+	are resent like any other hole.
+
+	Chunk 0's CRC8 was checked when it arrived, but covers only as much of it as fits a MAX_BLE_CHUNK_LENGTH chunk, so
+	on a link with larger chunks chunk 0 is checked over the rest of it; on one without, chunk 0 is left out.  If the
+	tree finds nothing, or the message was already being forwarded cut through, it's a NACK as before.  Costs nothing
+	unless a crc16 actually fails.
+	setChunkCheckRepair(false) stops this device asking; it always answers.
+*/
+
+void BleStar::setChunkCheckRepair(boolean enabled) {
+	_isChunkCheckRepair = enabled;
+}
+
+// Called instead of a NACK when a complete message's crc16 fails.  Returns false if the message can't be repaired
+boolean BleStar::startChunkCheckRepair(BleDeviceTable * bleDevice, BleReceiveChannel * channel) {
+	if (!_isChunkCheckRepair || (bleDevice->peerCapabilities & LINK_CAPABILITY_CHUNK_CHECKS) == 0) { return false; }
+	if (channel->isCutThrough || channel->receiveChunksExpected < 2) { return false; }
+	if (channel->chunkCheckAttempts >= MAX_CHUNK_CHECK_ATTEMPTS) { return false; }
+
+	channel->chunkCheckAttempts++;
+	channel->isCheckingChunks = true;
+	channel->chunkChecksOutstanding = 0;
+	channel->chunksFoundByChecks = 0;
+	int firstChunk = (channel->chunkLength > MAX_BLE_CHUNK_LENGTH ? 0 : 1);		// chunk 0 has bytes its crc8 doesn't cover
+	sendChunkCheckRequest(bleDevice, channel, firstChunk, channel->receiveChunksExpected - firstChunk);
+	return true;
+}
+
+void BleStar::sendChunkCheckRequest(BleDeviceTable * bleDevice, BleReceiveChannel * channel, int firstChunk, int chunkCount) {
+	uint16_t crc16 = channel->messageBeingReceived->getStoredMessageCrc16();
+	uint8_t frame[LINK_CONTROL_FRAME_HEADER_LENGTH + CHUNK_CHECK_REQUEST_BODY_LENGTH] = {
+		LINK_CONTROL_FRAME_MARKER,
+		LINK_CONTROL_CHUNK_CHECK_REQUEST,
+		CHUNK_CHECK_REQUEST_BODY_LENGTH,
+		(uint8_t)channel->channel,
+		(uint8_t)(crc16 / 256),
+		(uint8_t)(crc16 & 0xFF),
+		(uint8_t)firstChunk,
+		(uint8_t)chunkCount
+	};
+	sendRawToBleDevice(frame, sizeof(frame), bleDevice->index);
+	channel->chunkChecksOutstanding++;
+	channel->lastSackTime = millis();											// the receive timeout waits for the answer as it would for a SACK's
+}
+
+// The sender's side: answer with the checks, and hold off the ACK timeout, as the receiver has every chunk already
+void BleStar::processChunkCheckRequest(BleDeviceTable * bleDevice, uint8_t * body, int bodyLength) {
+	if (bodyLength < CHUNK_CHECK_REQUEST_BODY_LENGTH || body[0] >= BLE_LINK_CHANNELS) { return; }
+	BleSendChannel * channel = &bleDevice->sendChannel[body[0]];
+	if (channel->messageBeingSent == NULL) { return; }
+	if (body[1] * 256 + body[2] != channel->messageBeingSent->getStoredMessageCrc16()) { return; }	// for an earlier message
+
+	int firstChunk = body[3];
+	int chunkCount = min((int)body[4], channel->sendChunksExpected - firstChunk);
+	if (chunkCount <= 0) { return; }
+	int chunksPerCheck = (chunkCount + CHUNK_CHECKS_PER_FRAME - 1) / CHUNK_CHECKS_PER_FRAME;
+
+	uint8_t frame[MAX_BLE_CHUNK_LENGTH];
+	int checks = 0;
+	for (int i = firstChunk; i < firstChunk + chunkCount; i += chunksPerCheck) {
+		frame[LINK_CONTROL_FRAME_HEADER_LENGTH + CHUNK_CHECKS_BODY_HEADER_LENGTH + checks++] =
+				getChunkCheck(channel->sendBuffer->getBuffer(), channel->sendBuffer->getLength(), channel->chunkLength,
+						i, min(chunksPerCheck, firstChunk + chunkCount - i));
+	}
+	frame[0] = LINK_CONTROL_FRAME_MARKER;
+	frame[1] = LINK_CONTROL_CHUNK_CHECKS;
+	frame[2] = (uint8_t)(CHUNK_CHECKS_BODY_HEADER_LENGTH + checks);
+	memcpy(&frame[3], body, CHUNK_CHECK_REQUEST_BODY_LENGTH);					// channel, crc16, first chunk...
+	frame[7] = (uint8_t)chunkCount;
+	frame[8] = (uint8_t)chunksPerCheck;
+
+	sendRawToBleDevice(frame, LINK_CONTROL_FRAME_HEADER_LENGTH + CHUNK_CHECKS_BODY_HEADER_LENGTH + checks, bleDevice->index);
+	channel->lastSendTime = millis();
+}
+
+// The receiver's side: narrow down every group that doesn't match, and once nothing is left to narrow down, ask for the
+// chunks found.  A SACK any earlier would have the sender resend them while other chunks are still unchecked
+void BleStar::processChunkChecks(BleDeviceTable * bleDevice, uint8_t * body, int bodyLength) {
+	if (bodyLength < CHUNK_CHECKS_BODY_HEADER_LENGTH || body[0] >= BLE_LINK_CHANNELS) { return; }
+	BleReceiveChannel * channel = &bleDevice->receiveChannel[body[0]];
+	if (channel->messageBeingReceived == NULL || !channel->isCheckingChunks || channel->chunkChecksOutstanding == 0) { return; }
+	if (body[1] * 256 + body[2] != channel->messageBeingReceived->getStoredMessageCrc16()) { return; }
+
+	int firstChunk = body[3];
+	int chunkCount = body[4];
+	int chunksPerCheck = body[5];
+	if (chunksPerCheck < 1 || firstChunk + chunkCount > channel->receiveChunksExpected) { return; }
+
+	channel->chunkChecksOutstanding--;
+	uint8_t * checks = &body[CHUNK_CHECKS_BODY_HEADER_LENGTH];
+	for (int i = 0; i < bodyLength - CHUNK_CHECKS_BODY_HEADER_LENGTH; i++) {
+		int groupStart = firstChunk + i * chunksPerCheck;
+		int groupCount = min(chunksPerCheck, firstChunk + chunkCount - groupStart);
+		if (groupCount <= 0) { break; }
+		uint8_t check = getChunkCheck(channel->receiveBuffer->getBuffer(), channel->receiveMessageLength, channel->chunkLength,
+				groupStart, groupCount);
+		if (check == checks[i]) { continue; }
+		if (groupCount > 1) {
+			sendChunkCheckRequest(bleDevice, channel, groupStart, groupCount);
+		} else if (getChunkReceived(channel, groupStart)) {
+			setChunkNotReceived(channel, groupStart);
+			channel->chunksFoundByChecks++;
+		}
+	}
+	if (channel->chunkChecksOutstanding > 0) { return; }
+	if (channel->chunksFoundByChecks == 0) {									// the tree found nothing
+		sendNack(bleDevice, channel);
+		failAndClearReceiveChannel(bleDevice, channel);
+		return;
+	}
+
+	Log.v("%d corrupt chunk(s) from %s found by chunk checks; asking for them again", channel->chunksFoundByChecks, bleDevice->peerName);
+	bleDevice->chunksRepairedByChecks += channel->chunksFoundByChecks;
+	channel->isCheckingChunks = false;
+	sendSelectiveAck(bleDevice, channel, channel->receiveChunksExpected);
+}
+
+// CRC8 of the payloads of chunkCount chunks from firstChunk, which sit end to end in the compiled message.  The part of
+// chunk 0 its own crc8 covers is left out
+uint8_t BleStar::getChunkCheck(uint8_t * compiledMessage, int messageLength, int chunkLength, int firstChunk, int chunkCount) {
+	int start = max(getMessageBuilderIndexForChunkNumber(firstChunk, chunkLength), DATA_CHUNK_PAYLOAD_LENGTH(MAX_BLE_CHUNK_LENGTH));
+	int end = min(messageLength, getMessageBuilderIndexForChunkNumber(firstChunk + chunkCount, chunkLength));
+	return (CRC::getCrc8(&compiledMessage[start], max(0, end - start)));
+}
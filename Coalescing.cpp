@@ -0,0 +1,132 @@
+#include "BleStar.h"
+
+/*
+	Coalescing.  With setCoalescing(lingerMillis), small messages this device originates (compiled length up to
+	COALESCE_MAX_RECORD_LENGTH) don't go to a send channel as soon as they're routed.  They're held as
+	MESSAGE_TYPE_HOP_LINGERING for up to lingerMillis, and every small message waiting for the same hop by then is
+	packed into one system message addressed to that hop:
+
+		STRING_COALESCED[length][compiled message][length][compiled message]...
+
+	so a burst of small sends costs one messageTable entry, one set of chunks and one ACK round trip on the first hop
+	instead of one each.  A bundle goes as soon as it's full (MAX_COALESCED_PAYLOAD_LENGTH), and a message left on its
+	own when its linger time is up goes as it is.  The hop unpacks every record into a messageTable entry of its own,
+	which from there on is delivered or routed just like a message that arrived by itself.
+
+	System messages, urgent messages and delta encoded messages (whose origin needs their own ACK) are never held back.
+	If a bundle fails, transmissionFailedCallback fires once for each message inside it, with that message's messageId.
+*/
+
+void BleStar::setCoalescing(uint32_t lingerMillis) {
+	_coalesceLingerMillis = lingerMillis;
+	if (lingerMillis > 0) { return; }
+	for (int i = 0; i < mTable.getSize(); i++) {								// release anything still held back
+		Message * m = mTable.getMessage(i);
+		if (m->getMessageType() == MESSAGE_TYPE_HOP_LINGERING) { m->setMessageType(MESSAGE_TYPE_HOP); }
+	}
+}
+
+// A HOP is only ever held back once: firstSendAttemptTimestamp is when it started lingering
+boolean BleStar::getIsCoalescable(Message * m) {
+	if (m->getMessageType() == MESSAGE_TYPE_HOP_LINGERING) { return true; }
+	return (m->getMessageType() == MESSAGE_TYPE_HOP
+			&& m->getFirstSendAttemptTimestamp() == 0
+			&& !m->getIsSystemMessage()
+			&& m->getFlags() == MESSAGE_PRIORITY_NORMAL
+			&& m->getCompiledMessageLength() <= COALESCE_MAX_RECORD_LENGTH
+			&& strcmp(m->getOrigin(), _thisDeviceName) == 0);
+}
+
+void BleStar::coalesceMessagesForHop(BleDeviceTable * bleDevice) {
+	Message * records[MAX_COALESCED_PAYLOAD_LENGTH / 2];
+	int numberOfRecords = 0;
+	int payloadLength = strlen(STRING_COALESCED);
+	boolean isLingerOver = false;
+	boolean isFull = false;
+
+	for (int i = 0; i < mTable.getSize(); i++) {
+		Message * m = mTable.getMessage(i);
+		if (m->getToHop() != bleDevice->peerName || !getIsCoalescable(m)) { continue; }
+		if (payloadLength + 1 + m->getCompiledMessageLength() > MAX_COALESCED_PAYLOAD_LENGTH) { isFull = true; break; }
+		if (m->getMessageType() == MESSAGE_TYPE_HOP) {
+			m->setMessageType(MESSAGE_TYPE_HOP_LINGERING);
+			m->setFirstSendAttemptTimestamp(max(1UL, (unsigned long)millis()));
+		}
+		if (millis() - m->getFirstSendAttemptTimestamp() >= _coalesceLingerMillis) { isLingerOver = true; }
+		records[numberOfRecords++] = m;
+		payloadLength += 1 + m->getCompiledMessageLength();
+	}
+	if (numberOfRecords == 0 || (!isLingerOver && !isFull)) { return; }
+
+	if (numberOfRecords == 1) {
+		records[0]->setMessageType(MESSAGE_TYPE_HOP);							// nothing to share with; it goes by itself
+		return;
+	}
+
+	uint8_t payload[MAX_COALESCED_PAYLOAD_LENGTH];
+	uint16_t messageIds[MAX_COALESCED_PAYLOAD_LENGTH / 2];
+	MessageBuilder mb(payload, MAX_COALESCED_PAYLOAD_LENGTH);
+	mb.append(STRING_COALESCED);
+	for (int i = 0; i < numberOfRecords; i++) {
+		mb.append((uint8_t)records[i]->getCompiledMessageLength());
+		mb.append(records[i]->getStartOfCompiledMessage(), records[i]->getCompiledMessageLength());
+		messageIds[i] = records[i]->getMessageId();
+		records[i]->invalidateMessage();										// before the bundle is added, which may move entries about
+	}
+
+	if (mTable.addNewMessageToSend(payload, mb.getLength(), _thisDeviceName, bleDevice->peerName, 0, true, MESSAGE_PRIORITY_NORMAL) == NULL) {
+		Log.e("Error: no room to coalesce %d messages to %s; dropped", numberOfRecords, bleDevice->peerName);
+		for (int i = 0; i < numberOfRecords; i++) { fireTransmissionFailedCallback(messageIds[i]); }
+		return;
+	}
+	Log.v("Coalesced %d messages to %s into %d bytes", numberOfRecords, bleDevice->peerName, mb.getLength());
+}
+
+// Fires transmissionFailedCallback for a message this device gave up sending.  A bundle it packed fires it for each
+// record's messageId, read from the record's compiled header, as its own messageId (0) means nothing to the caller
+void BleStar::fireTransmissionFailedCallbacks(Message * m) {
+	if (!m->getIsSystemMessage() || strcmp(m->getOrigin(), _thisDeviceName) != 0) {
+		fireTransmissionFailedCallback(m->getMessageId());
+		return;
+	}
+	Message * bundle = getExpandedMessage(m);
+	if (bundle == NULL || strncmp((char *)bundle->getPayload(), STRING_COALESCED, strlen(STRING_COALESCED)) != 0) {
+		fireTransmissionFailedCallback(m->getMessageId());
+		return;
+	}
+
+	uint8_t * payload = bundle->getPayload();
+	int payloadLength = bundle->getPayloadLength() - 1;						// without its terminator
+	int index = strlen(STRING_COALESCED);
+	while (index < payloadLength) {
+		int recordLength = payload[index++];
+		if (recordLength <= COMPILED_MESSAGE_ORIGIN_NAME_POSITION || index + recordLength > payloadLength) { return; }
+		fireTransmissionFailedCallback(payload[index + MESSAGEID_POSITION] * 256 + payload[index + MESSAGEID_POSITION + 1]);
+		index += recordLength;
+	}
+}
+
+// Runs on the hop a bundle was addressed to.  The records are copied out first, as m may be the scratch message that
+// delivering a compressed record expands into
+void BleStar::unpackCoalescedMessage(Message * m) {
+	uint8_t payload[MAX_COALESCED_PAYLOAD_LENGTH];
+	int payloadLength = min((int)m->getPayloadLength() - 1, MAX_COALESCED_PAYLOAD_LENGTH);	// without its terminator
+	memcpy(payload, m->getPayload(), payloadLength);
+	char * fromHop = m->getFromHop();
+
+	int index = strlen(STRING_COALESCED);
+	while (index < payloadLength) {
+		int recordLength = payload[index++];
+		if (recordLength <= COMPILED_MESSAGE_ORIGIN_NAME_POSITION || index + recordLength > payloadLength) {
+			Log.e("Error: malformed record in coalesced message from %s; rest dropped", fromHop);
+			return;
+		}
+		Message * record = mTable.reserveSpaceForIncomingMessage(recordLength + 1, fromHop);
+		if (record == NULL) { return; }
+		memcpy(record->getStartOfCompiledMessage(), &payload[index], recordLength);
+		record->getMessageBuilder()->setLength(recordLength);
+		record->importMessage(record->getStartOfCompiledMessage(), record->getStartOfCompiledMessage(), fromHop);
+		deliverRoutedMessage(record);
+		index += recordLength;
+	}
+}
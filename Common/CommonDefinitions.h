@@ -28,17 +28,62 @@
 #endif
 
 
-#define MAX_BLE_CHUNK_LENGTH								20					// must send 20 byte chunks at most unf.
+#define MAX_BLE_CHUNK_LENGTH								20					// default ATT MTU (23) less the 3 byte ATT header; every link starts here
+#define BLE_ATT_HEADER_LENGTH								3					// ATT opcode + handle, not available for payload
+#define MAX_BLE_MTU											247					// largest ATT MTU we ask for; fits a 251 byte DLE link layer packet
+#define MAX_NEGOTIATED_BLE_CHUNK_LENGTH						(MAX_BLE_MTU - BLE_ATT_HEADER_LENGTH)
 #define DEFAULT_MAX_SEND_ATTEMPTS							3
 #define DEFAULT_MAX_HOP_ATTEMPTS							5
 #define DEFAULT_EXPECTED_MESSAGE_LENGTH						250					// if messageTable needs to allocate space for an incoming message of unknown length, pick this
 #define MAX_COMPILED_MESSAGE_LENGTH							4000				// enough for most messages
 #define MAX_UNFORMED_MESSAGE_LENGTH							255					// packet loss will mean trying for more unlikely to work
-#define MAX_BLE_CHUNKS										(MAX_COMPILED_MESSAGE_LENGTH) / (MAX_BLE_CHUNK_LENGTH - 1) + 1
+#define MAX_BLE_CHUNKS										(MAX_COMPILED_MESSAGE_LENGTH) / (MAX_BLE_CHUNK_LENGTH - DATA_CHUNK_HEADER_LENGTH) + 1		// worst case, i.e. a link that never negotiated a larger MTU
 #define DEFAULT_MAX_SEND_ATTEMPTS							3
 #define MAX_BLE_DEVICE_NAME_LENGTH							20
 
-#define MAX_MESSAGE_BUFFER_PREAMBLE_LENGTH					(MAX_BLE_DEVICE_NAME_LENGTH + 1) * 2 + 8 + 1		// max size of origins, destinations etc and preamble of routed message
+// Framing between adjacent devices.  The markers are all below ' ', so none can be mistaken for an unformed message
+// or for the '#' that starts chunk 0
+#define DATA_CHUNK_MARKER									0x18				// first byte of every chunk, with the channel in the low bits; then the chunk number and payload length
+#define FIRST_CHUNK_MARKER									0x14				// chunk 0 instead: marker | channel, the chunk length the whole message is sent in, payload length
+#define DATA_CHUNK_MARKER_MASK								0xFC
+#define DATA_CHUNK_CHANNEL_MASK								0x03
+#define DATA_CHUNK_HEADER_LENGTH							3
+#define DATA_CHUNK_PAYLOAD_LENGTH_POSITION					2					// every chunk and parity chunk says how long it is, so any of them can be skipped whole
+#define DATA_CHUNK_PAYLOAD_LENGTH(chunkLength)				((chunkLength) - DATA_CHUNK_HEADER_LENGTH)
+#define PARITY_CHUNK_MARKER									0x1C				// XOR of a group of chunks: marker | channel, first chunk covered, chunks covered, payload length
+#define PARITY_CHUNK_HEADER_LENGTH							4
+#define PARITY_CHUNK_PAYLOAD_LENGTH_POSITION				3
+#define LINK_CONTROL_FRAME_MARKER							0x10				// first byte of a binary control frame: marker, opcode, body length, body
+#define LINK_CONTROL_FRAME_HEADER_LENGTH					3
+#define LINK_CONTROL_SACK									0x01				// selective ACK: channel, message crc16 (2), first missing chunk, chunks covered, bitmap (1 = missing)
+#define SACK_BODY_HEADER_LENGTH								5
+#define LINK_CONTROL_CAPABILITIES							0x02				// what this end understands and will send: capability flags, parity group size
+#define CAPABILITIES_BODY_LENGTH							2
+#define LINK_CONTROL_ACK									0x03				// whole message received: channel, message crc16 (2)
+#define ACK_BODY_LENGTH										3
+#define LINK_CONTROL_NACK									0x04				// whole message discarded, resend from chunk 0: channel
+#define NACK_BODY_LENGTH									1
+#define LINK_CONTROL_CHUNK_CHECK_REQUEST					0x05				// crc16 failed; send chunk checks for: channel, message crc16 (2), first chunk, chunks covered
+#define CHUNK_CHECK_REQUEST_BODY_LENGTH						5
+#define LINK_CONTROL_CHUNK_CHECKS							0x06				// as the request, then chunks per check and a CRC8 for each group of chunks
+#define CHUNK_CHECKS_BODY_HEADER_LENGTH						6
+#define CHUNK_CHECKS_PER_FRAME								(MAX_BLE_CHUNK_LENGTH - LINK_CONTROL_FRAME_HEADER_LENGTH - CHUNK_CHECKS_BODY_HEADER_LENGTH)
+#define LINK_CONTROL_SACK_REQUEST							0x07				// congestion window full; SACK this channel now: channel
+#define SACK_REQUEST_BODY_LENGTH							1
+#define LINK_CONTROL_RECEIVE_OVERFLOW						0x08				// no room for the message starting on this channel: channel
+#define RECEIVE_OVERFLOW_BODY_LENGTH						1
+#define LINK_CONTROL_RESUME									0x09				// carry on with a message cut off by a disconnect: channel, crc16, messageId
+#define RESUME_BODY_LENGTH									5
+#define LINK_CONTROL_HEARTBEAT								0x0A				// probes a link nothing has been heard on lately: HEARTBEAT_REQUEST or _REPLY
+#define HEARTBEAT_BODY_LENGTH								1
+#define HEARTBEAT_REQUEST									0
+#define HEARTBEAT_REPLY										1
+#define LINK_CAPABILITY_PARITY_CHUNKS						0x01				// can rebuild a lost chunk from a parity chunk
+#define LINK_CAPABILITY_CHUNK_CHECKS						0x02				// answers LINK_CONTROL_CHUNK_CHECK_REQUEST
+#define LINK_CAPABILITY_RESUMABLE_TRANSFERS					0x04				// answers LINK_CONTROL_RESUME
+#define LINK_CAPABILITY_HEARTBEAT							0x08				// answers LINK_CONTROL_HEARTBEAT
+
+#define MAX_MESSAGE_BUFFER_PREAMBLE_LENGTH					(MAX_BLE_DEVICE_NAME_LENGTH + 1) * 2 + 9 + 1		// max size of origins, destinations etc and preamble of routed message
 
 #define CHUNK_FLAG_TABLE_CAPACITY							(MAX_BLE_CHUNKS) / 8 + 1
 
@@ -55,10 +100,27 @@ const uint8_t bitResetArray[8] = { 0xFE, 0xFD, 0xFB, 0xF7, 0xEF, 0xDF, 0xBF, 0x7
 #define MESSAGE_TYPE_INCOMING				2
 #define MESSAGE_TYPE_HOP					3
 #define MESSAGE_TYPE_SUCCESS				4
+#define MESSAGE_TYPE_HOP_SENDING			5
+#define MESSAGE_TYPE_HOP_LINGERING			6					// a small HOP held back for a while, so it can be coalesced with others to the same hop
+
+#define MESSAGE_PRIORITY_NORMAL				0
+#define MESSAGE_PRIORITY_URGENT				1					// sent ahead of normal messages on every hop, interrupting them between chunks
+#define MESSAGE_PRIORITY_BULK				2					// logs and other large transfers; gets the link's spare capacity
+#define MESSAGE_PRIORITY_HIGH				3					// weighted well ahead of normal, but doesn't interrupt anything
+#define MESSAGE_PRIORITY_CLASSES			4
+#define MESSAGE_CLASS_SYSTEM				MESSAGE_PRIORITY_CLASSES	// system messages are scheduled as a class of their own, whatever their priority
+#define MESSAGE_QOS_0						0x10				// OR with a MESSAGE_PRIORITY_... in send(): no ACKs or resends; dropped if anything is lost
+
+#define SCAN_MODE_AUTOMATIC					-1				// setScanMode: choose from state
+#define SCAN_MODE_OFF						0
+#define SCAN_MODE_BACKGROUND				1
+#define SCAN_MODE_AGGRESSIVE				2
+#define SCAN_MODES							3
+
+const uint8_t MESSAGE_PRIORITY_WEIGHTS[MESSAGE_PRIORITY_CLASSES] = { 4, 0, 1, 16 };	// share of a hop's channels for each weighted class; urgent is strict
 
 #define STRING_ROUTES						"$ROUTES:"
-#define STRING_ACK							"$ACK"
-#define STRING_NACK							"$NACK"
-#define STRING_RESEND						"$RS:"
+#define STRING_KEYFRAME_REQUEST				"$KEYFRAME:"			// followed by the messageId of the delta stream whose base was lost
+#define STRING_COALESCED					"$BUNDLE:"				// followed by [length][compiled message] records for the next hop to unpack
 
 #endif
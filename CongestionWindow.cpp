@@ -0,0 +1,102 @@
+#include "BleStar.h"
+
+/*
+	Each link limits how many chunks can be outstanding on it at once: sent, but not yet known to have arrived.  The
+	pacer in BleLinkWriter only stops this device overrunning its own TX FIFO; the congestion window stops it overrunning
+	the peer, whose UART FIFO and messageTable are shared with every other link it has.
+
+	The window is additive increase, multiplicative decrease.  Every congestionWindow chunks ACKed (or passed by a SACK)
+	without a resend grow it by one chunk.  It halves, at most once a round trip, when a SACK reports holes, on a NACK
+	and on an ACK timeout; and at once when the peer reports it had no room for a message:
+
+		LINK_CONTROL_RECEIVE_OVERFLOW	[channel]	no messageTable space for the message starting on this channel
+
+	The sender then stops sending that message and starts it again from chunk 0 after the ACK timeout.
+
+	Receivers SACK on their own only every SACK_EVERY_N_CHUNKS chunks per channel, which a small window spread over
+	several channels may never reach.  So when the window is full, the sender asks each of its channels for one, at
+	most once a smoothed round trip:
+
+		LINK_CONTROL_SACK_REQUEST		[channel]
+
+	QoS 0 messages are never acknowledged, so they aren't counted and aren't held back.
+*/
+
+int BleStar::getChunksInFlight(BleDeviceTable * bleDevice) {
+	int chunksInFlight = 0;
+	for (int i = 0; i < BLE_LINK_CHANNELS; i++) {
+		BleSendChannel * channel = &bleDevice->sendChannel[i];
+		if (channel->messageBeingSent == NULL || channel->messageBeingSent->getIsQos0()) { continue; }
+		chunksInFlight += max(0, channel->sendChunkInProgress - channel->sendChunksAcknowledged);
+	}
+	return chunksInFlight;
+}
+
+boolean BleStar::getIsCongestionWindowOpen(BleDeviceTable * bleDevice) {
+	if (getChunksInFlight(bleDevice) < bleDevice->congestionWindow) { return true; }
+	if (millis() - bleDevice->lastSackRequestTime <= bleDevice->rtt.getSrtt()) { return false; }
+
+	bleDevice->lastSackRequestTime = millis();
+	for (int i = 0; i < BLE_LINK_CHANNELS; i++) {
+		BleSendChannel * channel = &bleDevice->sendChannel[i];
+		if (channel->messageBeingSent == NULL || channel->messageBeingSent->getIsQos0()) { continue; }
+		if (channel->sendChunkInProgress <= channel->sendChunksAcknowledged) { continue; }
+		uint8_t frame[LINK_CONTROL_FRAME_HEADER_LENGTH + SACK_REQUEST_BODY_LENGTH] = {
+			LINK_CONTROL_FRAME_MARKER,
+			LINK_CONTROL_SACK_REQUEST,
+			SACK_REQUEST_BODY_LENGTH,
+			(uint8_t)channel->channel
+		};
+		sendRawToBleDevice(frame, sizeof(frame), bleDevice->index);
+	}
+	return false;
+}
+
+void BleStar::growCongestionWindow(BleDeviceTable * bleDevice, int chunksAcknowledged) {
+	bleDevice->congestionWindowCredit += chunksAcknowledged;
+	while (bleDevice->congestionWindowCredit >= bleDevice->congestionWindow && bleDevice->congestionWindow < CONGESTION_WINDOW_MAX) {
+		bleDevice->congestionWindowCredit -= bleDevice->congestionWindow;
+		bleDevice->congestionWindow++;
+	}
+	if (bleDevice->congestionWindow >= CONGESTION_WINDOW_MAX) { bleDevice->congestionWindowCredit = 0; }
+}
+
+// isForced skips the once a round trip limit, which otherwise stops one burst of losses halving the window repeatedly
+void BleStar::shrinkCongestionWindow(BleDeviceTable * bleDevice, boolean isForced) {
+	if (!isForced && millis() - bleDevice->lastCongestionWindowDecreaseTime <= bleDevice->rtt.getSrtt()) { return; }
+	bleDevice->congestionWindow = max(CONGESTION_WINDOW_MIN, bleDevice->congestionWindow / 2);
+	bleDevice->congestionWindowCredit = 0;
+	bleDevice->lastCongestionWindowDecreaseTime = millis();
+	Log.v("Congestion window for %s now %d chunks", bleDevice->peerName, bleDevice->congestionWindow);
+}
+
+void BleStar::processSackRequest(BleDeviceTable * bleDevice, uint8_t * body, int bodyLength) {
+	if (bodyLength < SACK_REQUEST_BODY_LENGTH || body[0] >= BLE_LINK_CHANNELS) { return; }
+	BleReceiveChannel * channel = &bleDevice->receiveChannel[body[0]];
+	if (channel->messageBeingReceived == NULL || channel->isCheckingChunks) { return; }
+	sendSelectiveAck(bleDevice, channel, channel->receiveChunkInProgress);
+}
+
+void BleStar::sendReceiveOverflow(BleDeviceTable * bleDevice, BleReceiveChannel * channel) {
+	uint8_t frame[LINK_CONTROL_FRAME_HEADER_LENGTH + RECEIVE_OVERFLOW_BODY_LENGTH] = {
+		LINK_CONTROL_FRAME_MARKER,
+		LINK_CONTROL_RECEIVE_OVERFLOW,
+		RECEIVE_OVERFLOW_BODY_LENGTH,
+		(uint8_t)channel->channel
+	};
+	sendRawToBleDevice(frame, sizeof(frame), bleDevice->index);
+}
+
+void BleStar::processReceiveOverflow(BleDeviceTable * bleDevice, uint8_t * body, int bodyLength) {
+	if (bodyLength < RECEIVE_OVERFLOW_BODY_LENGTH || body[0] >= BLE_LINK_CHANNELS) { return; }
+	BleSendChannel * channel = &bleDevice->sendChannel[body[0]];
+	if (channel->messageBeingSent == NULL) { return; }
+	shrinkCongestionWindow(bleDevice, true);
+	if (channel->messageBeingSent->getIsQos0()) { return; }
+
+	// the rest of its chunks would only be thrown away, so wait out the ACK timeout and start again from chunk 0
+	if (channel->indexWithinSendChunk == 0) { channel->sendChunkInProgress = channel->sendChunksExpected; }
+	channel->sendChunkResendRequested = false;
+	channel->sendHasRetransmitted = true;
+	channel->lastSendTime = millis();
+}
@@ -0,0 +1,174 @@
+#include "BleStar.h"
+
+/*
+	Delta encoding, for the regular, mostly unchanged sends of a device reporting its state.  sendDelta(payload, ...)
+	keeps the last payload of each (destination, messageId) stream whose first hop ACKed it, and if the new payload is
+	the same length it sends a Delta encoding against that base instead:
+
+		[crc16 of the base payload, 2 bytes][Delta encoding]		with COMPILED_MESSAGE_DELTA_BIT set in the flags
+
+	Otherwise the payload goes whole with COMPILED_MESSAGE_KEYFRAME_BIT set, and the destination keeps it as its base.
+	The destination rebuilds each delta against its base before fireRoutedMessageReceivedCallback, and the rebuilt
+	payload becomes its new base.  Intermediate hops see nothing but a (much shorter) payload.
+
+	The crc16 makes sure both ends have the same base.  If the destination has lost it (a hop ACKed a message that
+	then went missing further on, or the destination restarted), it drops the delta and sends a STRING_KEYFRAME_REQUEST
+	system message back to the origin, whose next send for that stream is then a keyframe.  A keyframe also goes out
+	every DELTA_KEYFRAME_INTERVAL sends, and whenever the previous payload of the stream is still in flight.
+*/
+
+boolean BleStar::sendDelta(uint8_t * payload, int payloadLength, char * destination, uint16_t messageId) {
+	if (payloadLength > MAX_DELTA_PAYLOAD_LENGTH) { return (send(payload, payloadLength, destination, messageId, false)); }
+
+	DeltaSendStream * stream = getDeltaSendStream(rTable.getNamePointerFromName(destination), messageId);
+	uint8_t deltaPayload[DELTA_HEADER_LENGTH + MAX_DELTA_PAYLOAD_LENGTH];
+	int deltaLength = -1;
+	if (stream->baseLength == payloadLength
+			&& payloadLength > DELTA_HEADER_LENGTH
+			&& stream->pendingLength == 0
+			&& !stream->isKeyframeRequested
+			&& stream->deltasSinceKeyframe < DELTA_KEYFRAME_INTERVAL) {
+		uint16_t baseCrc16 = CRC::getCrc16(stream->base, stream->baseLength);
+		deltaPayload[0] = (uint8_t)(baseCrc16 / 256);
+		deltaPayload[1] = (uint8_t)(baseCrc16 & 0xFF);
+		deltaLength = Delta::encode(stream->base, payload, payloadLength,	// only worth it if it's shorter than the payload
+						&deltaPayload[DELTA_HEADER_LENGTH], payloadLength - DELTA_HEADER_LENGTH - 1);
+	}
+
+	boolean isDelta = (deltaLength >= 0);
+	Message * m = mTable.addNewMessageToSend(
+		(isDelta ? deltaPayload : payload),
+		(isDelta ? DELTA_HEADER_LENGTH + deltaLength : payloadLength),
+		_thisDeviceName,
+		stream->destination,
+		messageId,
+		false,
+		MESSAGE_PRIORITY_NORMAL | (isDelta ? COMPILED_MESSAGE_DELTA_BIT : COMPILED_MESSAGE_KEYFRAME_BIT)
+	);
+	if (m == NULL) { return false; }
+
+	memcpy(stream->pending, payload, payloadLength);
+	stream->pendingLength = payloadLength;
+	stream->pendingCrc16 = m->getStoredMessageCrc16();
+	stream->deltasSinceKeyframe = (isDelta ? stream->deltasSinceKeyframe + 1 : 0);
+	if (!isDelta) { stream->isKeyframeRequested = false; }
+	Log.v("Message %d to %s sent as %s, %d bytes", messageId, stream->destination, (isDelta ? "delta" : "keyframe"), m->getPayloadLength());
+	return true;
+}
+
+DeltaSendStream * BleStar::getDeltaSendStream(char * destination, uint16_t messageId) {
+	for (int i = 0; i < MAX_DELTA_STREAMS; i++) {
+		if (deltaSendStream[i].destination == destination && deltaSendStream[i].messageId == messageId) { return &deltaSendStream[i]; }
+	}
+	DeltaSendStream * stream = &deltaSendStream[_nextDeltaSendStream];
+	_nextDeltaSendStream = (_nextDeltaSendStream + 1) % MAX_DELTA_STREAMS;
+	stream->destination = destination;
+	stream->messageId = messageId;
+	stream->baseLength = 0;
+	stream->pendingLength = 0;
+	stream->deltasSinceKeyframe = 0;
+	stream->isKeyframeRequested = false;
+	return stream;
+}
+
+// Called when any hop of a message is ACKed; only the origin's first hop matters here
+void BleStar::deltaMessageDelivered(Message * m) {
+	if ((m->getFlags() & (COMPILED_MESSAGE_DELTA_BIT | COMPILED_MESSAGE_KEYFRAME_BIT)) == 0) { return; }
+	if (strcmp(m->getOrigin(), _thisDeviceName) != 0) { return; }
+	for (int i = 0; i < MAX_DELTA_STREAMS; i++) {
+		DeltaSendStream * stream = &deltaSendStream[i];
+		if (stream->pendingLength == 0 || stream->messageId != m->getMessageId() || stream->pendingCrc16 != m->getStoredMessageCrc16()) { continue; }
+		memcpy(stream->base, stream->pending, stream->pendingLength);
+		stream->baseLength = stream->pendingLength;
+		stream->pendingLength = 0;
+	}
+}
+
+// The base stays as it was, as the failed payload never got past the first hop
+void BleStar::deltaMessageFailed(Message * m) {
+	if ((m->getFlags() & (COMPILED_MESSAGE_DELTA_BIT | COMPILED_MESSAGE_KEYFRAME_BIT)) == 0) { return; }
+	for (int i = 0; i < MAX_DELTA_STREAMS; i++) {
+		DeltaSendStream * stream = &deltaSendStream[i];
+		if (stream->messageId == m->getMessageId() && stream->pendingCrc16 == m->getStoredMessageCrc16()) { stream->pendingLength = 0; }
+	}
+}
+
+void BleStar::processKeyframeRequest(Message * m) {
+	uint16_t messageId = (uint16_t)atoi(&((char *)m->getPayload())[strlen(STRING_KEYFRAME_REQUEST)]);
+	char * requester = m->getOrigin();
+	for (int i = 0; i < MAX_DELTA_STREAMS; i++) {
+		DeltaSendStream * stream = &deltaSendStream[i];
+		if (stream->destination == NULL || stream->messageId != messageId) { continue; }
+		if (strcmp(stream->destination, requester) == 0 || stream->destination[0] == '/' || stream->destination[0] == '*') {
+			stream->isKeyframeRequested = true;
+			Log.i("Keyframe requested by %s for message %d", requester, messageId);
+		}
+	}
+}
+
+
+// Returns m itself unless it's a delta, in which case it returns the rebuilt message (only good until the next call),
+// or NULL if this device doesn't have the base it was encoded against
+Message * BleStar::getDeltaDecodedMessage(Message * m) {
+	uint8_t flags = m->getFlags();
+	if ((flags & (COMPILED_MESSAGE_DELTA_BIT | COMPILED_MESSAGE_KEYFRAME_BIT)) == 0) { return m; }
+
+	DeltaReceiveStream * stream = getDeltaReceiveStream(rTable.getNamePointerFromName(m->getOrigin()), m->getMessageId());
+	uint8_t * payload = m->getPayload();
+	int payloadLength = m->getPayloadLength() - 1;								// without its terminator
+
+	if ((flags & COMPILED_MESSAGE_KEYFRAME_BIT) != 0) {
+		stream->baseLength = (payloadLength <= MAX_DELTA_PAYLOAD_LENGTH ? payloadLength : 0);
+		memcpy(stream->base, payload, stream->baseLength);
+		return m;
+	}
+
+	uint16_t baseCrc16 = (uint16_t)(256 * payload[0] + payload[1]);
+	if (payloadLength < DELTA_HEADER_LENGTH || stream->baseLength == 0 || CRC::getCrc16(stream->base, stream->baseLength) != baseCrc16) {
+		Log.w("Delta message %d from %s dropped; its base is missing", m->getMessageId(), m->getOrigin());
+		stream->baseLength = 0;
+		requestKeyframe(stream);
+		return NULL;
+	}
+	if (!Delta::decode(stream->base, stream->baseLength, &payload[DELTA_HEADER_LENGTH], payloadLength - DELTA_HEADER_LENGTH, stream->base)) {
+		Log.e("Delta message %d from %s is malformed; dropped", m->getMessageId(), m->getOrigin());
+		stream->baseLength = 0;													// it may be half applied
+		requestKeyframe(stream);
+		return NULL;
+	}
+
+	Message * rebuilt = getScratchMessage();
+	if (!rebuilt->rebuildFrom(m, stream->base, stream->baseLength)) { return NULL; }
+	return rebuilt;
+}
+
+DeltaReceiveStream * BleStar::getDeltaReceiveStream(char * origin, uint16_t messageId) {
+	for (int i = 0; i < MAX_DELTA_STREAMS; i++) {
+		if (deltaReceiveStream[i].origin == origin && deltaReceiveStream[i].messageId == messageId) { return &deltaReceiveStream[i]; }
+	}
+	DeltaReceiveStream * stream = &deltaReceiveStream[_nextDeltaReceiveStream];
+	_nextDeltaReceiveStream = (_nextDeltaReceiveStream + 1) % MAX_DELTA_STREAMS;
+	stream->origin = origin;
+	stream->messageId = messageId;
+	stream->baseLength = 0;
+	stream->lastKeyframeRequestTime = 0;
+	return stream;
+}
+
+void BleStar::requestKeyframe(DeltaReceiveStream * stream) {
+	if (stream->lastKeyframeRequestTime != 0 && millis() - stream->lastKeyframeRequestTime < DELTA_KEYFRAME_REQUEST_INTERVAL_MILLIS) { return; }
+	stream->lastKeyframeRequestTime = millis();
+
+	MessageBuilder mb(MAX_BLE_CHUNK_LENGTH);
+	mb.append(STRING_KEYFRAME_REQUEST);
+	mb.append("%d", stream->messageId);
+	mTable.addNewMessageToSend(
+		(uint8_t *)mb.getBuffer(),
+		mb.getLength(),
+		_thisDeviceName,
+		stream->origin,
+		0,																		// messageId
+		true,																	// isSystemMessage
+		MESSAGE_PRIORITY_NORMAL
+	);
+}
@@ -0,0 +1,105 @@
+#include "BleStar.h"
+
+/*
+	Noticing a dead link, and getting its messages onto another one.  Without this a link that stops answering is only
+	noticed when the SoftDevice's supervision timeout fires the disconnect callback, which can take seconds.  With
+	setLinkFailureDetection(detectionMillis), a link nothing has been heard on for detectionMillis / HEARTBEAT_PROBES_
+	PER_DETECTION is probed, and one nothing has been heard on for detectionMillis is disconnected:
+
+		LINK_CONTROL_HEARTBEAT	[HEARTBEAT_REQUEST or HEARTBEAT_REPLY]
+
+	Any bytes at all from the peer count as hearing from it, so a busy link is never probed.  Only peers announcing
+	LINK_CAPABILITY_HEARTBEAT are probed, as one that doesn't would never answer.
+
+	However the link goes down, the messages waiting for it (MESSAGE_TYPE_HOP, and any being sent but not parked to
+	resume) go back to be routed again, so pollRoutingMessages sends them over a new parent or another path rather than
+	failing them.  Only messages for one destination can be: a subscription or broadcast message's other hops have
+	copies of their own, so its hop to the lost link is dropped.
+
+	BleLinkStatistics measures each failover: lastDetectionMillis from the last bytes heard to the link being found dead
+	(by the heartbeat, or else by the disconnect itself), and lastFailoverMillis from its messages going back to be
+	routed to the first of them taking a send channel on another link.  Each requeued message keeps the link it came
+	from, so assignMessageToSendChannel can tell; until one gets that far lastFailoverMillis is 0.
+*/
+
+void BleStar::setLinkFailureDetection(uint32_t detectionMillis) {
+	_linkFailureDetectionMillis = detectionMillis;
+}
+
+// Called every pass for each connected link
+void BleStar::pollLinkHeartbeat(BleDeviceTable * bleDevice) {
+	if (_linkFailureDetectionMillis == 0 || bleDevice->isLinkFailed) { return; }
+	if ((bleDevice->peerCapabilities & LINK_CAPABILITY_HEARTBEAT) == 0) { return; }
+
+	uint32_t quietMillis = millis() - bleDevice->lastreceivedTime;
+	if (quietMillis > _linkFailureDetectionMillis) {
+		Log.w("Nothing heard from %s for %lu ms; disconnecting", bleDevice->peerName, (unsigned long)quietMillis);
+		bleDevice->isLinkFailed = true;											// the disconnect callback routes its messages again
+		bleDevice->linkFailedTime = millis();
+		Bluefruit.disconnect(bleDevice->connectionHandle);
+		return;
+	}
+
+	uint32_t probeIntervalMillis = _linkFailureDetectionMillis / HEARTBEAT_PROBES_PER_DETECTION;
+	if (quietMillis <= probeIntervalMillis || millis() - bleDevice->lastHeartbeatTime <= probeIntervalMillis) { return; }
+	bleDevice->lastHeartbeatTime = millis();
+	sendHeartbeat(bleDevice, HEARTBEAT_REQUEST);
+}
+
+void BleStar::sendHeartbeat(BleDeviceTable * bleDevice, uint8_t heartbeatType) {
+	uint8_t frame[LINK_CONTROL_FRAME_HEADER_LENGTH + HEARTBEAT_BODY_LENGTH] = {
+		LINK_CONTROL_FRAME_MARKER,
+		LINK_CONTROL_HEARTBEAT,
+		HEARTBEAT_BODY_LENGTH,
+		heartbeatType
+	};
+	sendRawToBleDevice(frame, sizeof(frame), bleDevice->index);
+}
+
+// Arriving at all has already refreshed lastreceivedTime, so only a request needs anything more
+void BleStar::processHeartbeat(BleDeviceTable * bleDevice, uint8_t * body, int bodyLength) {
+	if (bodyLength < HEARTBEAT_BODY_LENGTH) { return; }
+	if (body[0] == HEARTBEAT_REQUEST) { sendHeartbeat(bleDevice, HEARTBEAT_REPLY); }
+}
+
+// Called from the disconnect callbacks, after transfers have been parked to resume and before whatever is left is failed
+void BleStar::requeueMessagesForLink(BleDeviceTable * bleDevice) {
+	if (bleDevice->peerName == NULL) { return; }
+	if (!bleDevice->isLinkFailed) { bleDevice->linkFailedTime = millis(); }	// the supervision timeout found it first
+	bleDevice->linkFailures++;
+	bleDevice->lastDetectionMillis = bleDevice->linkFailedTime - bleDevice->lastreceivedTime;
+
+	int messagesRequeued = 0;
+	for (int i = 0; i < BLE_LINK_CHANNELS; i++) {
+		BleSendChannel * channel = &bleDevice->sendChannel[i];
+		Message * m = channel->messageBeingSent;
+		if (m == NULL || m->getIsQos0() || channel->sendAttempts > DEFAULT_MAX_HOP_ATTEMPTS) { continue; }
+		if (getBytesAvailableToForward(channel->sendBuffer->getBuffer(), channel->sendBuffer->getLength()) < channel->sendBuffer->getLength()) {
+			continue;															// still arriving cut through, so it can't be routed again
+		}
+		if (!mTable.requeueMessage(m, bleDevice->peerName, bleDevice->index)) { continue; }
+		channel->messageBeingSent = NULL;										// it's the router's again
+		resetSendChannel(channel);
+		messagesRequeued++;
+	}
+	messagesRequeued += mTable.requeueMessagesForHop(bleDevice->peerName, bleDevice->index);
+	bleDevice->lastFailoverMillis = 0;
+	bleDevice->isFailoverPending = (messagesRequeued > 0);
+
+	if (messagesRequeued > 0) {
+		Log.i("Link to %s lost; %d messages for it will be routed again", bleDevice->peerName, messagesRequeued);
+	}
+}
+
+// Called as m takes a send channel on bleDevice.  The first of a lost link's requeued messages to get onto another link
+// ends that link's failover
+void BleStar::updateFailoverTime(Message * m, BleDeviceTable * bleDevice) {
+	int lostLinkIndex = m->getRequeuedFromLink();
+	m->setRequeuedFromLink(-1);
+	if (lostLinkIndex < 0 || lostLinkIndex == bleDevice->index) { return; }	// never requeued, or the lost link came back for it
+	BleDeviceTable * lostLink = &bleDeviceTable[lostLinkIndex];
+	if (!lostLink->isFailoverPending) { return; }
+	lostLink->isFailoverPending = false;
+	lostLink->lastFailoverMillis = millis() - m->getRequeuedTimestamp();
+	Log.i("Failover to %s took %lu ms", bleDevice->peerName, (unsigned long)lostLink->lastFailoverMillis);
+}
@@ -7,15 +7,20 @@
 
 	An example transmission format is below (this is called a compiledMessage)
 
-	#12345678#originNodeNamedestinationNodePatternHello, this is the message
+	#123456789originNodeNamedestinationNodePatternHello, this is the message
 
 	# = first character of transmission, always a hash
 	1 = CRC8 placeholder for bytes 2-N of the first chunk to be sent (usually each chunk is 20 bytes, so CRC8 on bytes 2-19)
 		This checks that the first chunk gets through ok and if the CRC checks out and the hashes are in the right place,
 		this denotes the start of a transmission.
 	2,3 = CRC16 placeholder for the whole transmission from one byte after the second hash
-	4,5 = length of encapsulated message (limit is 4096 in fact, please make buffers large enough for this if you need it)
+	4,5 = length of encapsulated message (limit is 4096 in fact, please make buffers large enough for this if you need it).  The top
+		two bits of byte 4 are flags: 0x80 = system message, 0x40 = the payload is compressed (see below)
 	6,7 = MessageId if provided by sender.  When an ACK or NACK is received by the originating node, it fires a callback with this MessageId
+	8 = flags.  The low bits are the message's priority (MESSAGE_PRIORITY_...), which every hop keeps, then the delta and
+		keyframe bits (COMPILED_MESSAGE_DELTA_BIT etc.), which only the origin and destination look at, and the QoS 0 bit:
+		a hop neither ACKs nor resends such a message, and drops it if any of it is lost, and the conflate bit: a hop
+		frees the message if a newer one from the same origin to the same destination arrives before it's sent on
 	[originNodeName] = always this node's name.  up to 20 bytes
 	\0 = char array terminator
 	[destinationNodePattern] = a pattern of up to 40 bytes.  This doesn't have to match a single node's name, as wildcards are allowed.  See MessageRouting.cpp
@@ -58,9 +63,15 @@
 
 	Other messages that go back to the sending device would include "ACK\" - basically everything was received OK
 
+	Compression.  Payloads of MIN_COMPRESSIBLE_PAYLOAD_LENGTH or more are run through Lzss when they're compiled, and if
+	that saves anything the payload becomes the expanded length (2 bytes, MSB first) followed by the LZSS stream, and the
+	compressed bit is set.  Intermediate hops forward it as it is; only a destination expands it, with expandFrom()
+
 
 */
 
+boolean Message::_isCompressionEnabled = DEFAULT_PAYLOAD_COMPRESSION;
+
 void Message::initialize() {
 	if (Serial) { Log.initialize(&Serial, "Message:"); }
 	_messagesHaveBeenChanged = true;
@@ -74,6 +85,7 @@ void Message::compileMessage(
 	char * destination,
 	uint16_t messageId,
 	boolean isSystemMessage,
+	uint8_t flags,
 	int messageType
 
 ) {
@@ -81,6 +93,9 @@ void Message::compileMessage(
 	_messageType = messageType;
 	_maxSendAttempts = DEFAULT_MAX_SEND_ATTEMPTS;
 	_sendAttempts = 0;
+	_firstSendAttemptTimestamp = 0;
+	_lastSendAttemptTimestamp = 0;
+	_requeuedFromLink = -1;
 
 	_messageBuilder->initialize(getStartOfCompiledMessage(), getEndOfCompiledMessageReservedSpace() - getStartOfCompiledMessage());
 
@@ -91,6 +106,7 @@ void Message::compileMessage(
 	_messageBuilder->append("45");												// placeholder for length of message sent by client (total compiled message length = )
 	_messageBuilder->append((uint8_t)((messageId / 256) & 0xFF));																	// MesssageId MSB
 	_messageBuilder->append((uint8_t) ((messageId) & 0xFF));					// MessageId LSB
+	_messageBuilder->append(flags);												// flags
 
 	setFromHop(origin);
 	_origin = (char *)&_startOfCompiledMessage[_messageBuilder->getLength()];
@@ -103,19 +119,55 @@ void Message::compileMessage(
 	_messageBuilder->append('\0');
 
 	_messagePayload = &_startOfCompiledMessage[_messageBuilder->getLength()];
-	_messageBuilder->append(payload, payloadLength);
+	int compressedLength = 0;
+	if (_isCompressionEnabled && payloadLength >= MIN_COMPRESSIBLE_PAYLOAD_LENGTH
+			&& _messageBuilder->getLength() + payloadLength + 1 <= MAX_EXPANDED_MESSAGE_LENGTH) {
+		compressedLength = Lzss::compress(payload, payloadLength,			// only worth it if it saves at least one byte
+						&_messagePayload[COMPRESSED_PAYLOAD_HEADER_LENGTH], payloadLength - COMPRESSED_PAYLOAD_HEADER_LENGTH - 1);
+	}
+	if (compressedLength > 0) {
+		_messagePayload[0] = (uint8_t)((payloadLength / 256) & 0xFF);
+		_messagePayload[1] = (uint8_t)(payloadLength & 0xFF);
+		_messageBuilder->setLength(_messageBuilder->getLength() + COMPRESSED_PAYLOAD_HEADER_LENGTH + compressedLength);
+	} else {
+		_messageBuilder->append(payload, payloadLength);
+	}
 	_messageBuilder->append('\0');
 
 	clearMessageLength();
 	setStoredMessageLength(_messageBuilder->getLength());
 	setIsSystemMessage(isSystemMessage);
+	setIsCompressed(compressedLength > 0);
 
-	setStoredMessageCrc8(getCalculatedMessageCrc8());
 	setStoredMessageCrc16(getCalculatedMessageCrc16());
+	setStoredMessageCrc8(getCalculatedMessageCrc8());						// last, as it covers the crc16
 
 	_requiresRouting = true;
 }
 
+// Every messageTable entry gets its own MessageBuilder the first time it is used; after that it is just pointed at
+// whatever space the entry has reserved in messageBuffer
+void Message::initializeMessageBuilder() {
+	if (_messageBuilder == NULL) {
+		_messageBuilder = new MessageBuilder(_startOfCompiledMessage, getCapacity());
+	} else {
+		_messageBuilder->initialize(_startOfCompiledMessage, getCapacity());
+	}
+}
+
+// The compiled message's bytes have been moved to newStart, so every pointer into them moves the same distance
+void Message::relocateCompiledMessage(uint8_t * newStart) {
+	uint8_t * oldStart = _startOfCompiledMessage;
+	uint8_t * oldEnd = _endOfCompiledMessageReservedSpace;
+	if (_messageBuilder != NULL && _messageBuilder->getBuffer() == oldStart) { _messageBuilder->setBuffer(newStart); }	// hops share one
+	_startOfCompiledMessage = newStart;
+	_endOfCompiledMessageReservedSpace = newStart + (oldEnd - oldStart);
+	if ((uint8_t *)_origin >= oldStart && (uint8_t *)_origin <= oldEnd) { _origin = (char *)newStart + ((uint8_t *)_origin - oldStart); }
+	if ((uint8_t *)_destination >= oldStart && (uint8_t *)_destination <= oldEnd) { _destination = (char *)newStart + ((uint8_t *)_destination - oldStart); }
+	if (_messagePayload >= oldStart && _messagePayload <= oldEnd) { _messagePayload = newStart + (_messagePayload - oldStart); }
+	if ((uint8_t *)_fromHop >= oldStart && (uint8_t *)_fromHop <= oldEnd) { _fromHop = (char *)newStart + ((uint8_t *)_fromHop - oldStart); }	// the origin, if compiled here
+}
+
 void Message::copy(Message * m) {
 
 	_messageBuilder = m->getMessageBuilder();
@@ -126,6 +178,8 @@ void Message::copy(Message * m) {
 
 	_firstSendAttemptTimestamp = m->getFirstSendAttemptTimestamp();
 	_lastSendAttemptTimestamp = m->getLastSendAttemptTimestamp();
+	_requeuedFromLink = m->getRequeuedFromLink();
+	_requeuedTimestamp = m->getRequeuedTimestamp();
 
 	_startOfCompiledMessage = m->getStartOfCompiledMessage();
 	_endOfCompiledMessageReservedSpace = m->getEndOfCompiledMessageReservedSpace();
@@ -154,6 +208,7 @@ void Message::importMessage(uint8_t * messageBufferPointer, uint8_t * messageToI
 	_toHop = NULL;
 	_firstSendAttemptTimestamp = 0;
 	_lastSendAttemptTimestamp = 0;
+	_requeuedFromLink = -1;
 	_requiresRouting = true;
 
 
@@ -170,20 +225,76 @@ void Message::importMessage(uint8_t * messageBufferPointer, uint8_t * messageToI
 		uint8_t u = messageToImport[i];
 		if (u == 0) {
 			zerosFound++;
-			if (zerosFound == 1) { _destination = (char *)&messageBufferPointer[i]; }
-			else if (zerosFound == 2) { _messagePayload = &messageBufferPointer[i]; }
+			if (zerosFound == 1) { _destination = (char *)&messageBufferPointer[i + 1]; }
+			else if (zerosFound == 2) { _messagePayload = &messageBufferPointer[i + 1]; }
 		}
 		_startOfCompiledMessage[i] = u;
 	}
 }
 
 
+// Makes this message an uncompressed copy of m, which must have the compressed bit set.  This message's reserved space
+// must be able to hold the expanded payload
+boolean Message::expandFrom(Message * m) {
+	uint8_t * source = m->getStartOfCompiledMessage();
+	uint8_t * compressedPayload = m->getPayload();
+	int headerLength = (int)(compressedPayload - source);
+	int compressedLength = (int)m->getStoredMessageLength() - headerLength - COMPRESSED_PAYLOAD_HEADER_LENGTH - 1;
+	int expandedLength = 256 * compressedPayload[0] + compressedPayload[1];
+
+	if (compressedLength <= 0 || headerLength + expandedLength + 1 > getCapacity()) {
+		Log.e("Cannot expand message from %s: %d byte payload won't fit", m->getOrigin(), expandedLength);
+		return false;
+	}
+
+	for (int i = 0; i < headerLength; i++) { _startOfCompiledMessage[i] = source[i]; }
+	int length = Lzss::decompress(&compressedPayload[COMPRESSED_PAYLOAD_HEADER_LENGTH], compressedLength,
+						&_startOfCompiledMessage[headerLength], getCapacity() - headerLength - 1);
+	if (length != expandedLength) {
+		Log.e("Cannot expand message from %s: payload is corrupt", m->getOrigin());
+		return false;
+	}
+	return (finishRebuild(headerLength, length, m->getFromHop()));
+}
+
+// Makes this message a copy of m's header with the given payload in place of m's.  m may be this message
+boolean Message::rebuildFrom(Message * m, uint8_t * payload, int payloadLength) {
+	uint8_t * source = m->getStartOfCompiledMessage();
+	int headerLength = (int)(m->getPayload() - source);
+	if (headerLength + payloadLength + 1 > getCapacity()) {
+		Log.e("Cannot rebuild message from %s: %d byte payload won't fit", m->getOrigin(), payloadLength);
+		return false;
+	}
+	if (source != _startOfCompiledMessage) { memcpy(_startOfCompiledMessage, source, headerLength); }
+	memcpy(&_startOfCompiledMessage[headerLength], payload, payloadLength);
+	return (finishRebuild(headerLength, payloadLength, m->getFromHop()));
+}
+
+// The header and payload are in place; this terminates the payload and sets the length and pointers to match.  A rebuilt
+// message is only ever read, so its payload encodings are cleared and it never goes to the router
+boolean Message::finishRebuild(int headerLength, int payloadLength, char * fromHop) {
+	_startOfCompiledMessage[headerLength + payloadLength] = '\0';
+	_startOfCompiledMessage[COMPILED_MESSAGE_FLAGS_POSITION] &= ~(COMPILED_MESSAGE_DELTA_BIT | COMPILED_MESSAGE_KEYFRAME_BIT);
+	setIsCompressed(false);
+	setStoredMessageLength(headerLength + payloadLength + 1);
+
+	uint8_t * endOfReservedSpace = _endOfCompiledMessageReservedSpace;
+	importMessage(_startOfCompiledMessage, _startOfCompiledMessage, fromHop);
+	_endOfCompiledMessageReservedSpace = endOfReservedSpace;					// importMessage trims it to this message
+	_requiresRouting = false;
+	_messageBuilder->reset();
+	_messageBuilder->setLength(headerLength + payloadLength + 1);
+	return true;
+}
+
+
 uint16_t Message::getPayloadLength() { return (uint16_t)(_messageBuilder->getLength() - (_messagePayload - _startOfCompiledMessage)); }
 uint16_t Message::getCompiledMessageLength() { return ((uint16_t)(_messageBuilder->getLength())); }
 
-uint16_t Message::getStoredMessageLength() {
-	return (_startOfCompiledMessage[COMPILED_MESSAGE_LENGTH_POSITION] * 256
-			+ _startOfCompiledMessage[COMPILED_MESSAGE_LENGTH_POSITION + 1]);
+uint16_t Message::getStoredMessageLength() { return (getStoredMessageLength(_startOfCompiledMessage)); }
+uint16_t Message::getStoredMessageLength(uint8_t * compiledMessage) {
+	return ((compiledMessage[COMPILED_MESSAGE_LENGTH_POSITION] & COMPILED_MESSAGE_LENGTH_MSB_MASK) * 256
+			+ compiledMessage[COMPILED_MESSAGE_LENGTH_POSITION + 1]);
 }
 
 void Message::clearMessageLength() {
@@ -192,19 +303,39 @@ void Message::clearMessageLength() {
 }
 
 void Message::setStoredMessageLength(uint16_t u) {
-	uint8_t systemMessageBit = _startOfCompiledMessage[COMPILED_MESSAGE_LENGTH_POSITION] & 0x80;
-	_startOfCompiledMessage[COMPILED_MESSAGE_LENGTH_POSITION] = (uint8_t)((u / 256 & 0xFF) + systemMessageBit);
+	uint8_t flagBits = _startOfCompiledMessage[COMPILED_MESSAGE_LENGTH_POSITION] & ~COMPILED_MESSAGE_LENGTH_MSB_MASK;
+	_startOfCompiledMessage[COMPILED_MESSAGE_LENGTH_POSITION] = (uint8_t)((u / 256 & COMPILED_MESSAGE_LENGTH_MSB_MASK) + flagBits);
 	_startOfCompiledMessage[COMPILED_MESSAGE_LENGTH_POSITION + 1] = (uint8_t)(u & 0xFF);
 }
 
 boolean Message::getIsSystemMessage() {
-	return ((_startOfCompiledMessage[COMPILED_MESSAGE_LENGTH_POSITION] & 0x80) > 0);
+	return ((_startOfCompiledMessage[COMPILED_MESSAGE_LENGTH_POSITION] & COMPILED_MESSAGE_SYSTEM_MESSAGE_BIT) > 0);
 }
 
 void Message::setIsSystemMessage(boolean b) {
 	_startOfCompiledMessage[COMPILED_MESSAGE_LENGTH_POSITION] =
-				(_startOfCompiledMessage[COMPILED_MESSAGE_LENGTH_POSITION] & 0x7F)
-			+	(b ? 0x80 : 0x00);
+				(_startOfCompiledMessage[COMPILED_MESSAGE_LENGTH_POSITION] & ~COMPILED_MESSAGE_SYSTEM_MESSAGE_BIT)
+			+	(b ? COMPILED_MESSAGE_SYSTEM_MESSAGE_BIT : 0x00);
+}
+
+boolean Message::getIsCompressed() {
+	return ((_startOfCompiledMessage[COMPILED_MESSAGE_LENGTH_POSITION] & COMPILED_MESSAGE_COMPRESSED_BIT) > 0);
+}
+
+void Message::setIsCompressed(boolean b) {
+	_startOfCompiledMessage[COMPILED_MESSAGE_LENGTH_POSITION] =
+				(_startOfCompiledMessage[COMPILED_MESSAGE_LENGTH_POSITION] & ~COMPILED_MESSAGE_COMPRESSED_BIT)
+			+	(b ? COMPILED_MESSAGE_COMPRESSED_BIT : 0x00);
+}
+
+uint8_t Message::getPriority() {
+	return (_startOfCompiledMessage[COMPILED_MESSAGE_FLAGS_POSITION] & COMPILED_MESSAGE_PRIORITY_MASK);
+}
+
+void Message::setPriority(uint8_t priority) {
+	_startOfCompiledMessage[COMPILED_MESSAGE_FLAGS_POSITION] =
+				(_startOfCompiledMessage[COMPILED_MESSAGE_FLAGS_POSITION] & ~COMPILED_MESSAGE_PRIORITY_MASK)
+			+	(priority & COMPILED_MESSAGE_PRIORITY_MASK);
 }
 
 uint16_t Message::getMessageId() {
@@ -217,21 +348,24 @@ void Message::setMessageId(uint16_t u) {
 
 uint8_t Message::getStoredMessageCrc8() { return (_startOfCompiledMessage[COMPILED_MESSAGE_CRC8_POSITION]); }
 void Message::setStoredMessageCrc8(uint8_t u) { _startOfCompiledMessage[COMPILED_MESSAGE_CRC8_POSITION] = u; }
-uint8_t Message::getCalculatedMessageCrc8() {
+uint8_t Message::getCalculatedMessageCrc8() { return (getCalculatedMessageCrc8(_startOfCompiledMessage)); }
+uint8_t Message::getCalculatedMessageCrc8(uint8_t * compiledMessage) {
 	return (
 		(uint8_t)CRC::getCrc8(
-					&_startOfCompiledMessage[COMPILED_MESSAGE_CRC8_POSITION + 1],
-					min(MAX_BLE_CHUNK_LENGTH, getStoredMessageLength()) - (COMPILED_MESSAGE_CRC8_POSITION + 1) )
+					&compiledMessage[COMPILED_MESSAGE_CRC8_POSITION + 1],
+					min(DATA_CHUNK_PAYLOAD_LENGTH(MAX_BLE_CHUNK_LENGTH), (int)getStoredMessageLength(compiledMessage)) - (COMPILED_MESSAGE_CRC8_POSITION + 1) )
 	);
 }
-boolean Message::getIsMessageCrc8Valid() {
-	uint8_t calculatedCrc8 = getCalculatedMessageCrc8();
-	if (getStoredMessageCrc8() == calculatedCrc8) { return true; }
-	Log.w("Crc8 Checksum error!  Expected %02X calculated %02X in message", getStoredMessageCrc8(), calculatedCrc8);
+boolean Message::getIsMessageCrc8Valid() { return (getIsMessageCrc8Valid(_startOfCompiledMessage)); }
+boolean Message::getIsMessageCrc8Valid(uint8_t * compiledMessage) {
+	uint8_t calculatedCrc8 = getCalculatedMessageCrc8(compiledMessage);
+	if (compiledMessage[COMPILED_MESSAGE_CRC8_POSITION] == calculatedCrc8) { return true; }
+	Log.w("Crc8 Checksum error!  Expected %02X calculated %02X in message", compiledMessage[COMPILED_MESSAGE_CRC8_POSITION], calculatedCrc8);
 	return false;
 }
 
-uint16_t Message::getStoredMessageCrc16() { return (256 * _startOfCompiledMessage[COMPILED_MESSAGE_CRC16_POSITION] + _startOfCompiledMessage[COMPILED_MESSAGE_CRC16_POSITION + 1]); }
+// stored LSB first, unlike the length and messageId
+uint16_t Message::getStoredMessageCrc16() { return (_startOfCompiledMessage[COMPILED_MESSAGE_CRC16_POSITION] + 256 * _startOfCompiledMessage[COMPILED_MESSAGE_CRC16_POSITION + 1]); }
 void Message::setStoredMessageCrc16(uint16_t u) {
 	_startOfCompiledMessage[COMPILED_MESSAGE_CRC16_POSITION + 1] = (uint8_t)((u / 256) & 0xFF);
 	_startOfCompiledMessage[COMPILED_MESSAGE_CRC16_POSITION] = (uint8_t)((u) & 0xFF);
@@ -242,8 +376,9 @@ uint16_t Message::getCalculatedMessageCrc16() {
 			getStoredMessageLength() - (COMPILED_MESSAGE_ORIGIN_NAME_POSITION))  & 0xFFFF)
 		);
 }
-boolean Message::getIsMessageCrc16Valid() {
-	uint16_t calculatedCrc16 = getCalculatedMessageCrc16();
+boolean Message::getIsMessageCrc16Valid() { return (getIsMessageCrc16Valid(getCalculatedMessageCrc16())); }
+// for a crc16 already worked out, e.g. as the message arrived
+boolean Message::getIsMessageCrc16Valid(uint16_t calculatedCrc16) {
 	if (getStoredMessageCrc16() == calculatedCrc16) { return true; }
 	Log.w("Crc16 Checksum error!  Expected %04X calculated %04X in message", getStoredMessageCrc16(), calculatedCrc16);
 	return false;
@@ -6,6 +6,7 @@
 #include "Utility/CRC.h"
 #include "Utility/Logger.h"
 #include "Utility/MessageBuilder.h"
+#include "Utility/Lzss.h"
 
 #define CRC_START_MODBUS			0xFFFF
 #define	CRC_POLY_16					0xA001
@@ -16,7 +17,21 @@
 #define COMPILED_MESSAGE_CRC16_POSITION						2
 #define COMPILED_MESSAGE_LENGTH_POSITION					4
 #define MESSAGEID_POSITION									6
-#define COMPILED_MESSAGE_ORIGIN_NAME_POSITION				8
+#define COMPILED_MESSAGE_FLAGS_POSITION						8
+#define COMPILED_MESSAGE_ORIGIN_NAME_POSITION				9
+
+#define COMPILED_MESSAGE_SYSTEM_MESSAGE_BIT					0x80				// top bit of the length MSB
+#define COMPILED_MESSAGE_COMPRESSED_BIT						0x40				// payload is LZSS compressed; only the destination expands it
+#define COMPILED_MESSAGE_LENGTH_MSB_MASK					0x3F
+#define COMPRESSED_PAYLOAD_HEADER_LENGTH					2					// expanded payload length, ahead of the LZSS stream
+#define MIN_COMPRESSIBLE_PAYLOAD_LENGTH						32					// shorter payloads rarely shrink enough to pay for the header
+#define DEFAULT_PAYLOAD_COMPRESSION							true
+#define MAX_EXPANDED_MESSAGE_LENGTH							MAX_COMPILED_MESSAGE_LENGTH		// destinations expand into a buffer this size, so longer messages go uncompressed
+#define COMPILED_MESSAGE_PRIORITY_MASK						0x03				// low bits of the flags byte
+#define COMPILED_MESSAGE_DELTA_BIT							0x04				// payload is a Delta encoding against the last keyframe's; see DeltaEncoding.cpp
+#define COMPILED_MESSAGE_KEYFRAME_BIT						0x08				// payload is whole, and is the base for the deltas that follow it
+#define COMPILED_MESSAGE_QOS0_BIT							MESSAGE_QOS_0		// fire and forget on every hop
+#define COMPILED_MESSAGE_CONFLATE_BIT						0x20				// a newer message from the same origin to the same destination replaces it
 
 
 
@@ -34,6 +49,7 @@ public:
 		char * destination,
 		uint16_t messageId,
 		boolean isSystemMessage,
+		uint8_t flags,
 		int messageType
 
 	);
@@ -45,6 +61,8 @@ public:
 	// getter setters left in header
 
 	MessageBuilder * getMessageBuilder() { return _messageBuilder; }
+	void setMessageBuilder(MessageBuilder * mb) { _messageBuilder = mb; }
+	void initializeMessageBuilder();
 
 	int getMessageType() { return _messageType; }
 	void setMessageType(int mt) { _messageType = mt; }
@@ -64,6 +82,12 @@ public:
 	unsigned long getLastSendAttemptTimestamp() { return _lastSendAttemptTimestamp; }
 	void setLastSendAttemptTimestamp(unsigned long ul) { _lastSendAttemptTimestamp = ul; }
 
+	int getRequeuedFromLink() { return _requeuedFromLink; }
+	void setRequeuedFromLink(int link) { _requeuedFromLink = link; }
+
+	unsigned long getRequeuedTimestamp() { return _requeuedTimestamp; }
+	void setRequeuedTimestamp(unsigned long ul) { _requeuedTimestamp = ul; }
+
 	uint8_t * getStartOfCompiledMessage() { return _startOfCompiledMessage; }
 	void setStartOfCompiledMessage(uint8_t * u) { _startOfCompiledMessage = u; }
 
@@ -72,11 +96,22 @@ public:
 
 	boolean getIsSystemMessage();
 	void setIsSystemMessage(boolean b);
+	uint8_t getPriority();
+	void setPriority(uint8_t priority);
+	int getSchedulingClass() { return (getIsSystemMessage() ? MESSAGE_CLASS_SYSTEM : getPriority()); }
+	boolean getIsQos0() { return ((getFlags() & COMPILED_MESSAGE_QOS0_BIT) != 0); }
+	boolean getIsCompressed();
+	void setIsCompressed(boolean b);
+	boolean expandFrom(Message * m);
+	boolean rebuildFrom(Message * m, uint8_t * payload, int payloadLength);
+	uint8_t getFlags() { return _startOfCompiledMessage[COMPILED_MESSAGE_FLAGS_POSITION]; }
+	static void setIsCompressionEnabled(boolean b) { _isCompressionEnabled = b; }
 	void clearMessageLength();
 
 	uint16_t getCapacity() { return (uint16_t)(_endOfCompiledMessageReservedSpace - _startOfCompiledMessage); }
 
-	void reset() { setMessageType(MESSAGE_TYPE_NONE); }
+	void reset() { setMessageType(MESSAGE_TYPE_NONE); _requiresRouting = false; _toHop = NULL; }		// entries are reused once reclaimed
+	void relocateCompiledMessage(uint8_t * newStart);
 
 	uint8_t * getPayload() { return _messagePayload; }
 	void setMessagePayload(uint8_t * u) { _messagePayload = u; }
@@ -99,17 +134,21 @@ public:
 
 	uint16_t getCompiledMessageLength();
 	uint16_t getStoredMessageLength();
+	static uint16_t getStoredMessageLength(uint8_t * compiledMessage);		// for a header that isn't in messageTable yet (e.g. a receive buffer)
 	void setStoredMessageLength(uint16_t u);
 
 	uint8_t getStoredMessageCrc8();
 	void setStoredMessageCrc8(uint8_t u);
 	uint8_t getCalculatedMessageCrc8();
+	static uint8_t getCalculatedMessageCrc8(uint8_t * compiledMessage);
 	boolean getIsMessageCrc8Valid();
+	static boolean getIsMessageCrc8Valid(uint8_t * compiledMessage);
 
 	uint16_t getStoredMessageCrc16();
 	void setStoredMessageCrc16(uint16_t u);
 	uint16_t getCalculatedMessageCrc16();
 	boolean getIsMessageCrc16Valid();
+	boolean getIsMessageCrc16Valid(uint16_t calculatedCrc16);
 
 	void invalidateMessage();
 	static boolean getMessagesHaveBeenChanged();
@@ -117,7 +156,7 @@ public:
 private:
 	static Logger Log;
 
-	MessageBuilder * _messageBuilder;
+	MessageBuilder * _messageBuilder = NULL;
 
 	int _messageType = 0;
 	boolean _requiresRouting = false;
@@ -126,6 +165,8 @@ private:
 
 	unsigned long _firstSendAttemptTimestamp = 0;
 	unsigned long _lastSendAttemptTimestamp = 0;
+	int _requeuedFromLink = -1;												// bleDeviceTable index of the lost link it was routed again from; -1 = none
+	unsigned long _requeuedTimestamp = 0;
 
 	uint8_t * _startOfCompiledMessage;
 	uint8_t * _endOfCompiledMessageReservedSpace;
@@ -138,6 +179,7 @@ private:
 	char * _toHop;
 
 	static boolean _messagesHaveBeenChanged;
+	static boolean _isCompressionEnabled;
 
 	uint8_t getMessageCrc8(uint8_t * cm, uint16_t length);
 	void setMessageCrc8(uint8_t * cm, uint8_t crc8);
@@ -145,6 +187,8 @@ private:
 	uint16_t getMessageCrc16(uint8_t * cm, uint16_t length);
 	void setMessageCrc16(uint8_t * cm, uint16_t crc16);
 
+	boolean finishRebuild(int headerLength, int payloadLength, char * fromHop);
+
 
 
 
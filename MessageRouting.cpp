@@ -126,6 +126,130 @@
 */
 
 
+// Called once a compiled message has been completely received from a connected device.  The message already sits in
+// its messageTable entry, so it only needs its origin/destination/payload pointers set up before it's handed over to
+// pollRoutingMessages (and/or the user callback if this device is a destination)
+void BleStar::processRoutedMessage(BleDeviceTable * bleDevice, BleReceiveChannel * channel) {
+	Message * m = channel->messageBeingReceived;
+	channel->messageBeingReceived = NULL;										// the entry now belongs to the router, not to this link
+
+	if (!channel->isCutThrough) {												// else it was imported and routed from its first chunks
+		m->importMessage(m->getStartOfCompiledMessage(), m->getStartOfCompiledMessage(), bleDevice->peerName);
+	}
+	deliverRoutedMessage(m);
+}
+
+// Hands an imported message to this device's system message handler or the user callback, if it's for this device.
+// Anything else is left for pollRoutingMessages, once any older queued message it conflates with has been freed
+void BleStar::deliverRoutedMessage(Message * m) {
+	if ((m->getFlags() & COMPILED_MESSAGE_CONFLATE_BIT) != 0) { mTable.supersedeMessages(m); }
+
+	if (m->getIsSystemMessage()) {
+		Message * expanded = getExpandedMessage(m);
+		if (strcmp(m->getDestination(), _thisDeviceName) == 0) { m->invalidateMessage(); }	// first, as processing it may add entries and move m
+		if (expanded != NULL) { processRoutedSystemMessage(expanded); }
+		return;
+	}
+
+	char * destination = m->getDestination();
+	boolean isForThisDeviceOnly = (strcmp(destination, _thisDeviceName) == 0);
+	if (isForThisDeviceOnly
+			|| destination[0] == '*'
+			|| (destination[0] == '/' && rTable.getDoesRouteExist(rTable.getIndexFromName(destination), BLE_THIS_DEVICE_INDEX))) {
+		Message * expanded = getExpandedMessage(m);								// hops onward still get the compressed original
+		if (expanded != NULL) { expanded = getDeltaDecodedMessage(expanded); }
+		if (expanded != NULL) { fireRoutedMessageReceivedCallback(expanded); }
+	}
+	if (isForThisDeviceOnly) { m->invalidateMessage(); }
+}
+
+// Returns m itself unless its payload is compressed, in which case it returns an expanded copy that is only good until
+// the next call.  NULL if it can't be expanded
+Message * BleStar::getExpandedMessage(Message * m) {
+	if (!m->getIsCompressed()) { return m; }
+
+	Message * expanded = getScratchMessage();
+	if (!expanded->expandFrom(m)) { return NULL; }
+	return expanded;
+}
+
+// The one message outside messageTable, which expanded and delta decoded messages are rebuilt into for delivery
+Message * BleStar::getScratchMessage() {
+	if (_expandedMessage.getMessageBuilder() == NULL) {
+		_expandedMessage.setStartOfCompiledMessage(_expandedMessageBuffer);
+		_expandedMessage.setEndOfCompiledMessageReservedSpace(&_expandedMessageBuffer[MAX_EXPANDED_MESSAGE_LENGTH]);
+		_expandedMessage.initializeMessageBuilder();
+	}
+	return &_expandedMessage;
+}
+
+void BleStar::setPayloadCompression(boolean enabled) { Message::setIsCompressionEnabled(enabled); }
+
+
+/*
+	Cut through forwarding.  With setCutThroughForwarding(true), a message passing through this device is imported and
+	routed as soon as the contiguous chunks received hold its origin and destination, rather than once it's complete.
+	Its hops are then picked up by send channels straight away, and writeNextChunk only sends a chunk once every byte
+	of it has arrived from upstream (getBytesAvailableToForward), so each hop forwards chunks as they come in and a
+	multi-hop transfer costs little more than a single one.
+
+	The message's CRC16 is still checked on every hop when the last chunk arrives, and at the destination, which
+	never cuts through.  If it fails, or the message is given up on upstream, every hop already forwarding it is
+	stopped at its next chunk boundary and the downstream receivers time out.
+*/
+
+void BleStar::setCutThroughForwarding(boolean enabled) { _isCutThroughForwarding = enabled; }
+
+void BleStar::startCutThroughIfReady(BleDeviceTable * bleDevice, BleReceiveChannel * channel) {
+	if (!_isCutThroughForwarding || channel->isCutThrough || channel->messageBeingReceived == NULL) { return; }
+
+	Message * m = channel->messageBeingReceived;
+	uint8_t * compiledMessage = m->getStartOfCompiledMessage();
+	int bytesAvailable = getBytesAvailableToForward(compiledMessage, channel->receiveMessageLength);
+
+	int zerosFound = 0;															// origin and destination are each null terminated
+	int destinationPosition = 0;
+	for (int i = COMPILED_MESSAGE_ORIGIN_NAME_POSITION; i < bytesAvailable && zerosFound < 2; i++) {
+		if (compiledMessage[i] != 0) { continue; }
+		if (++zerosFound == 1) { destinationPosition = i + 1; }
+	}
+	if (zerosFound < 2) { return; }
+	if (strcmp((char *)&compiledMessage[destinationPosition], _thisDeviceName) == 0) { return; }	// nothing to forward
+
+	m->importMessage(compiledMessage, compiledMessage, bleDevice->peerName);	// both terminators have arrived, so its pointers are right
+	channel->isCutThrough = true;
+	Log.v("Cut through: message from %s routed after %d of %d bytes", bleDevice->peerName, bytesAvailable, channel->receiveMessageLength);
+}
+
+// Stops every hop of a cut through message.  A send channel part way through a chunk finishes it first, so the link
+// stays in frame
+void BleStar::cancelCutThrough(BleReceiveChannel * channel) {
+	uint8_t * compiledMessage = channel->messageBeingReceived->getStartOfCompiledMessage();
+	for (int i = BLE_PERIPHERAL_INDEX; i < MAX_CENTRAL_CONNECTIONS + 2; i++) {
+		for (int j = 0; j < BLE_LINK_CHANNELS; j++) {
+			BleSendChannel * sendChannel = &bleDeviceTable[i].sendChannel[j];
+			if (sendChannel->messageBeingSent != NULL && sendChannel->messageBeingSent->getStartOfCompiledMessage() == compiledMessage) {
+				sendChannel->sendAttempts = DEFAULT_MAX_HOP_ATTEMPTS + 1;		// updateSendChannel fails it at the next chunk boundary
+			}
+		}
+	}
+	mTable.invalidateMessagesUsingBuffer(compiledMessage);						// hops not yet picked up by a send channel
+}
+
+// How much of a compiled message can be sent on: all of it, unless it's still arriving on one of this device's links
+int BleStar::getBytesAvailableToForward(uint8_t * compiledMessage, int messageLength) {
+	for (int i = BLE_PERIPHERAL_INDEX; i < MAX_CENTRAL_CONNECTIONS + 2; i++) {
+		for (int j = 0; j < BLE_LINK_CHANNELS; j++) {
+			BleReceiveChannel * channel = &bleDeviceTable[i].receiveChannel[j];
+			if (channel->messageBeingReceived != NULL && channel->messageBeingReceived->getStartOfCompiledMessage() == compiledMessage) {
+				return (min(messageLength, getMessageBuilderIndexForChunkNumber(channel->receiveChunksContiguous, channel->chunkLength)));
+			}
+		}
+	}
+	return (messageLength);
+}
+
+
 // check for "stuck" messages also in here.....
 
 /*! \brief Brief description.
@@ -176,7 +300,7 @@ void BleStar::pollRoutingMessages() {
 
 			if (m->getMessageType() == MESSAGE_TYPE_INCOMING) { newMessageTableEntriesRequired--; }
 			if (mTable.getCapacity() - mTable.getSize() - newMessageTableEntriesRequired < _numberOfBleConnections +2) {
-				mTable.defragmentMessages();
+				mTable.trimMessageTable();										// m is held, so entries can't move; loop() defragments
 			}
 			if (mTable.getCapacity() - mTable.getSize() - newMessageTableEntriesRequired < _numberOfBleConnections +2) {
 				Log.w("Warning:  MessageTables close to capacity (%d of %d slots used), cannot routes more messages", mTable.getSize(), mTable.getCapacity());
@@ -20,7 +20,8 @@ Message * MessageTable::addNewMessageToSend(									// used to add new messages
 	char * origin,
 	char * destination,
 	uint16_t messageId,
-	boolean isSystemMessage
+	boolean isSystemMessage,
+	uint8_t flags
 	) {
 
 		if (!isSystemMessage && !canAcceptMoreMessagesFromThisDevice(origin)) { return NULL; }
@@ -35,23 +36,29 @@ Message * MessageTable::addNewMessageToSend(									// used to add new messages
 			destination,
 			messageId,
 			isSystemMessage,
+			flags,
 			MESSAGE_TYPE_ORIGIN
 		);
 		_messageTableHasBeenChanged = true;
 		return message;
 }
 
-Message * MessageTable::getNewMessageTableEntry(int sizeOfBufferNeeded) {
+void MessageTable::setMessageCallbacks(MessageInUseCallback inUseCallback, MessageMovedCallback movedCallback) {
+	_messageInUseCallback = inUseCallback;
+	_messageMovedCallback = movedCallback;
+}
 
-	if (_messageTableSize + MAX_CENTRAL_CONNECTIONS + 2 > _messageTableCapacity) {
-		Log.e("Warning!  Not enough messageTable entries available!  capacity = %d, used = %d", _messageTableCapacity, _messageTableSize);
-		return NULL;
-	}
+Message * MessageTable::getNewMessageTableEntry(int sizeOfBufferNeeded) {
 
 	if ((_messageTableSize + MAX_CENTRAL_CONNECTIONS + 2 > _messageTableCapacity)
 			|| (_messageBufferCapacity - getMessageBufferSize() < sizeOfBufferNeeded)
 		) {
-		defragmentMessages();
+		trimMessageTable();														// callers hold Message *s, so nothing can move here
+	}
+
+	if (_messageTableSize + MAX_CENTRAL_CONNECTIONS + 2 > _messageTableCapacity) {
+		Log.e("Warning!  Not enough messageTable entries available!  capacity = %d, used = %d", _messageTableCapacity, _messageTableSize);
+		return NULL;
 	}
 
 	if (_messageBufferCapacity - getMessageBufferSize() < sizeOfBufferNeeded) {
@@ -61,11 +68,12 @@ Message * MessageTable::getNewMessageTableEntry(int sizeOfBufferNeeded) {
 		return NULL;
 	}
 
+	uint8_t * newMessageBuffer = &_messageBuffer[getMessageBufferSize()];		// before the new entry counts
 	Message * newMessage = &_messageTable[_messageTableSize++];
-	uint8_t * newMessageBuffer = &_messageBuffer[getMessageBufferSize()];
 	newMessage->reset();
 	newMessage->setStartOfCompiledMessage(newMessageBuffer);
 	newMessage->setEndOfCompiledMessageReservedSpace(&newMessageBuffer[sizeOfBufferNeeded]);
+	newMessage->initializeMessageBuilder();
 	return (newMessage);
 
 }
@@ -82,26 +90,91 @@ Message * MessageTable::reserveSpaceForIncomingMessage(int requiredBufferCapacit
 	return message;
 }
 
-Message * MessageTable::findNextAvailableMessageForHop(char * toHop) {
+Message * MessageTable::findNextAvailableMessageForHop(char * toHop, int schedulingClass) {
 	for (int i = 0; i < _messageTableSize; i++) {
-		if (_messageTable[i].getToHop() == toHop && _messageTable[i].getMessageType() == MESSAGE_TYPE_HOP) {
-			return (&_messageTable[i]);
-		}
+		if (_messageTable[i].getToHop() != toHop || _messageTable[i].getMessageType() != MESSAGE_TYPE_HOP) { continue; }
+		if (_messageTable[i].getSchedulingClass() == schedulingClass) { return (&_messageTable[i]); }
 	}
 	return NULL;
 }
 
 
 
+// Entries already handed to a send channel (MESSAGE_TYPE_HOP_SENDING) are left for the channel to clear
+void MessageTable::invalidateMessagesUsingBuffer(uint8_t * compiledMessage) {
+	for (int i = 0; i < _messageTableSize; i++) {
+		Message * m = &_messageTable[i];
+		if (m->getStartOfCompiledMessage() != compiledMessage || m->getMessageType() == MESSAGE_TYPE_HOP_SENDING) { continue; }
+		m->invalidateMessage();
+	}
+	_messageTableHasBeenChanged = true;
+}
+
+int MessageTable::supersedeMessages(Message * newer) {
+	int superseded = 0;
+	for (int i = 0; i < _messageTableSize; i++) {
+		Message * m = &_messageTable[i];
+		int messageType = m->getMessageType();
+		if (messageType != MESSAGE_TYPE_ORIGIN
+				&& messageType != MESSAGE_TYPE_INCOMING
+				&& messageType != MESSAGE_TYPE_HOP
+				&& messageType != MESSAGE_TYPE_HOP_LINGERING) { continue; }		// MESSAGE_TYPE_HOP_SENDING has started, so it finishes
+		if (m->getStartOfCompiledMessage() == newer->getStartOfCompiledMessage()) { continue; }
+		if ((m->getFlags() & COMPILED_MESSAGE_CONFLATE_BIT) == 0) { continue; }
+		if (strcmp(m->getOrigin(), newer->getOrigin()) != 0 || strcmp(m->getDestination(), newer->getDestination()) != 0) { continue; }
+		m->invalidateMessage();
+		superseded++;
+	}
+	if (superseded > 0) {
+		Log.v("Message %d from %s to %s superseded %d older entries", newer->getMessageId(), newer->getOrigin(), newer->getDestination(), superseded);
+		_messageTableHasBeenChanged = true;
+	}
+	return superseded;
+}
+
+boolean MessageTable::requeueMessage(Message * m, char * toHop, int fromLink) {
+	char * destination = m->getDestination();
+	if (destination[0] == '/' || destination[0] == '*' || strcmp(destination, toHop) == 0) { return false; }
+	m->setMessageType(MESSAGE_TYPE_INCOMING);
+	m->setToHop(NULL);
+	m->setRequiresRouting(true);
+	m->setRequeuedFromLink(fromLink);
+	m->setRequeuedTimestamp(millis());
+	_messageTableHasBeenChanged = true;
+	return true;
+}
+
+int MessageTable::requeueMessagesForHop(char * toHop, int fromLink) {
+	int requeued = 0;
+	for (int i = 0; i < _messageTableSize; i++) {
+		Message * m = &_messageTable[i];
+		if (m->getToHop() != toHop) { continue; }
+		if (m->getMessageType() != MESSAGE_TYPE_HOP && m->getMessageType() != MESSAGE_TYPE_HOP_LINGERING) { continue; }
+		if (requeueMessage(m, toHop, fromLink)) {
+			requeued++;
+		} else {
+			m->invalidateMessage();
+		}
+	}
+	_messageTableHasBeenChanged = true;
+	return requeued;
+}
+
 void MessageTable::makeSpaceForRouting(int originPosition, int numberOfMessageTableEntriesRequired) {
 	if (numberOfMessageTableEntriesRequired == 0 ) { return; }
+	for (int i = _messageTableSize; i < _messageTableSize + numberOfMessageTableEntriesRequired; i++) {
+		delete _messageTable[i].getMessageBuilder();							// a free entry's own (see releaseMessageBuilders); copied over below
+		_messageTable[i].setMessageBuilder(NULL);
+	}
 	for (int i = _messageTableSize + numberOfMessageTableEntriesRequired - 1;
 		 	i > originPosition + numberOfMessageTableEntriesRequired;
 			i--) {
 		Message * destination = &_messageTable[i];
 		Message * source = &_messageTable[i - numberOfMessageTableEntriesRequired];
 		destination->copy(source);
+		if (_messageMovedCallback != NULL) { _messageMovedCallback(source, destination); }
 	}
+	_messageTableSize += numberOfMessageTableEntriesRequired;
 }
 
 void MessageTable::cloneMessage(Message * sourceMessage, char * newFromHop, char * newToHop, int destinationMessageTableIndex) {
@@ -117,6 +190,7 @@ void MessageTable::setHopsInMessage(Message * message, char * newFromHop, char *
 
 	message->setFromHop(newFromHop);
 	message->setToHop(newToHop);
+	message->setRequiresRouting(false);
 
 	_messageTableHasBeenChanged  = true;
 }
@@ -128,35 +202,68 @@ void MessageTable::setHopsInMessage(Message * message, char * newFromHop, char *
 
 
 
-// fix this......
+// A NONE entry can go once no channel or suspended transfer points at it: entries being received are NONE until they
+// are complete, and a message whose last hop has gone is still being sent until its channel lets go
+boolean MessageTable::getIsReclaimable(Message * m) {
+	if (m->getMessageType() != MESSAGE_TYPE_NONE) { return false; }
+	return (_messageInUseCallback != NULL && !_messageInUseCallback(m));
+}
+
+// Entries from firstFreeIndex to lastIndex have been freed, and are kept above the table for reuse with their own
+// MessageBuilders.  One that shares its MessageBuilder with an entry below it (the hops of a message do) gives it up,
+// so reusing it can't clear a message that's still there
+void MessageTable::releaseMessageBuilders(int firstFreeIndex, int lastIndex) {
+	for (int i = firstFreeIndex; i <= lastIndex; i++) {
+		for (int j = 0; j < i; j++) {
+			if (_messageTable[j].getMessageBuilder() != _messageTable[i].getMessageBuilder()) { continue; }
+			_messageTable[i].setMessageBuilder(NULL);
+			break;
+		}
+	}
+}
+
+int MessageTable::trimMessageTable() {
+	int oldSize = _messageTableSize;
+	while (_messageTableSize > 0 && getIsReclaimable(&_messageTable[_messageTableSize - 1])) { _messageTableSize--; }
+	if (_messageTableSize == oldSize) { return 0; }
+	releaseMessageBuilders(_messageTableSize, oldSize - 1);
+	Log.v("trimmed %d entries from the top of messageTable\n", oldSize - _messageTableSize);
+	return (oldSize - _messageTableSize);
+}
+
 boolean MessageTable::defragmentMessageTable() {
 
-	int entriesToDelete = 0;
+	int oldSize = _messageTableSize;
 	int index = 0;
-	while (index + entriesToDelete < _messageTableSize) {
-		if (_messageTable[index].getMessageType() == MESSAGE_TYPE_SUCCESS && _messageTable[index].getLastSendAttemptTimestamp() + 5000 < millis()) {
-			entriesToDelete++;
-		}
-		if (entriesToDelete > 0) {
-			_messageTable[index] = _messageTable[index + entriesToDelete];
+	for (int i = 0; i < oldSize; i++) {
+		if (getIsReclaimable(&_messageTable[i])) { continue; }
+		if (i != index) {														// swapped, so freed entries keep their MessageBuilders
+			Message m = _messageTable[index];
+			_messageTable[index] = _messageTable[i];
+			_messageTable[i] = m;
+			if (_messageMovedCallback != NULL) { _messageMovedCallback(&_messageTable[i], &_messageTable[index]); }
 		}
 		index++;
 	}
-	if (entriesToDelete > 0) {
-		Log.v("defragmented messageTable and deleted %d entries\n", entriesToDelete);
-		_messageTableSize -= entriesToDelete;
-	}
-	return (entriesToDelete > 0);
+	if (index == oldSize) { return false; }
+
+	_messageTableSize = index;
+	releaseMessageBuilders(index, oldSize - 1);
+	Log.v("defragmented messageTable and deleted %d entries\n", oldSize - index);
+	_messageTableHasBeenChanged = true;
+	return true;
 }
 
+// Entries and their bytes move, so this is only called where no Message * is held but the channels', which
+// _messageMovedCallback keeps up to date: at the start of BleStar::loop
 void MessageTable::defragmentMessages() {
-	if (!defragmentMessageTable()) {
+	if (!getMessageBufferNeedsDefragmentation()) {
 		return;
 	}
-	sortMessageTable();
-	if (getMessageBufferNeedsDefragmentation()) {
-		defragmentMessageBuffer();
+	if (!defragmentMessageTable()) {
+		return;
 	}
+	defragmentMessageBuffer();
 }
 
 boolean MessageTable::canAcceptMoreMessagesFromThisDevice(char * device) {
@@ -167,52 +274,43 @@ boolean MessageTable::canAcceptMoreMessagesFromThisDevice(char * device) {
 	return true;
 }
 
+// New entries always go on the end, so the top of the buffer is the end of the last entry
 int MessageTable::getMessageBufferSize() {
 	return (_messageTableSize == 0 ?
 		0
 		:
-		_messageTable[_messageTableSize-1].getEndOfCompiledMessageReservedSpace() - _messageTable[0].getStartOfCompiledMessage()
+		_messageTable[_messageTableSize-1].getEndOfCompiledMessageReservedSpace() - _messageBuffer
 	);
 }
 
 boolean MessageTable::getMessageBufferNeedsDefragmentation() {
-	int sizeOfMessageBuffer = getMessageBufferSize();
-	int bytesUsedInMessageBuffer = 0;
-	uint8_t * tempMessageStart = 0;
-	int sharedMessageBufferEntries = 0;
-	for (int i = 0; i < _messageTableSize; i++) {
-		uint8_t * thisMessageStart = _messageTable[i].getStartOfCompiledMessage();
-		if (thisMessageStart != tempMessageStart) {								// there might be multiple messageTable entries pointing to the same messageBuffer entries, so discard duplicates
-			bytesUsedInMessageBuffer = _messageTable[i].getEndOfCompiledMessageReservedSpace() - _messageTable[i].getStartOfCompiledMessage();
-		} else {
-			sharedMessageBufferEntries++;
-		}
-	}
-	float utilization = (float)(100 * sizeOfMessageBuffer)/((float)_messageBufferCapacity);
-	float fragmentation = 100.0f - (float)(100 * bytesUsedInMessageBuffer)/((float)sizeOfMessageBuffer);
-
-	Log.v("BleStar:: MessageBuffer size = %d (%0.1f \%utilization), fragmentation = %0.1f\n", sizeOfMessageBuffer, utilization, fragmentation);
-	return (_messageBufferCapacity - sizeOfMessageBuffer < (MAX_COMPILED_MESSAGE_LENGTH + 5));
+	return (_messageTableSize * 2 > _messageTableCapacity || getMessageBufferSize() * 2 > _messageBufferCapacity);
 }
 
 
 void MessageTable::defragmentMessageBuffer() {
 	unsigned long t = millis();
-	uint8_t * moveTo = _messageTable[0].getEndOfCompiledMessageReservedSpace() + 1;
-
-	for (int i = 1; i < _messageTableSize; i++) {
-		if (moveTo == _messageTable[i].getStartOfCompiledMessage()) {	// only move memory if required
-			moveTo = _messageTable[i].getEndOfCompiledMessageReservedSpace() + 1;
-		} else {
-			uint8_t * moveFrom = _messageTable[i].getStartOfCompiledMessage();
-			uint8_t * stopWhen = _messageTable[i].getEndOfCompiledMessageReservedSpace();
-			while (moveFrom <= stopWhen) {
-				*moveTo++ = *moveFrom++;
-			}
+	uint8_t * moveTo = _messageBuffer;
+	int bytesMoved = 0;
+
+	int i = 0;
+	while (i < _messageTableSize) {
+		uint8_t * moveFrom = _messageTable[i].getStartOfCompiledMessage();
+		uint8_t * moveFromEnd = _messageTable[i].getEndOfCompiledMessageReservedSpace();
+		int sharingEntries = 1;													// the hops of a message share its bytes, and sit next to each other
+		while (i + sharingEntries < _messageTableSize && _messageTable[i + sharingEntries].getStartOfCompiledMessage() == moveFrom) {
+			moveFromEnd = max(moveFromEnd, _messageTable[i + sharingEntries].getEndOfCompiledMessageReservedSpace());
+			sharingEntries++;
 		}
-
+		if (moveFrom != moveTo) {												// only move memory if required
+			memmove(moveTo, moveFrom, moveFromEnd - moveFrom);
+			for (int j = i; j < i + sharingEntries; j++) { _messageTable[j].relocateCompiledMessage(moveTo); }
+			bytesMoved += moveFromEnd - moveFrom;
+		}
+		moveTo += moveFromEnd - moveFrom;
+		i += sharingEntries;
 	}
-	Log.w("BleStar:: Dragmented messageBuffer in %d millis\n", t);
+	Log.v("defragmented messageBuffer, moving %d bytes in %d millis\n", bytesMoved, millis() - t);
 }
 
 boolean MessageTable::getMessageTableHasBeenChanged() {
@@ -36,6 +36,12 @@
 class MessageTable {
 public:
 
+	/// Set by BleStar, whose send and receive channels point into messageTable.  An entry is only reclaimed once
+	/// MessageInUseCallback returns false for it, and MessageMovedCallback is told whenever one moves
+	typedef boolean (* MessageInUseCallback) (Message * m);
+	typedef void (* MessageMovedCallback) (Message * from, Message * to);
+	void setMessageCallbacks(MessageInUseCallback inUseCallback, MessageMovedCallback movedCallback);
+
 	/** Adds a new message into messageTable, and assigns it messageType "MESSAGE_TYPE_ORIGIN", which means that
 	the message will stay in the messageTable until an ACK or NACK has been received from the destination devices.
 
@@ -47,7 +53,8 @@ public:
 		char * originName,
 		char * destinationName,
 		uint16_t messageId,
-		boolean isSystemMessage			/**< boolean to indicate if is a system message, in which case a routed ACK/NACK does not need to be sent on receipt */
+		boolean isSystemMessage,		/**< boolean to indicate if is a system message, in which case a routed ACK/NACK does not need to be sent on receipt */
+		uint8_t flags					/**< the compiled message's flags byte: MESSAGE_PRIORITY_... plus any COMPILED_MESSAGE_..._BIT, carried so every hop honours it */
 	);
 
 	/// Initializes the messageTable and messageBuffer when the BleStar variable is declared in the main program (before setup)
@@ -82,8 +89,28 @@ public:
 
 	/// Used to find which message should next be sent to or through a connected device.  This is usually requested
 	/// once a message has been completely sent to a connected device, and now BleStar is looking for other messages
-	/// that need to take the same path
-	Message * findNextAvailableMessageForHop(char * toHop);
+	/// that need to take the same path.  Each scheduling class (MESSAGE_PRIORITY_... or MESSAGE_CLASS_SYSTEM) is its
+	/// own queue, oldest first; BleStar decides which class goes next
+	Message * findNextAvailableMessageForHop(char * toHop, int schedulingClass);
+
+	/// Invalidates every entry sharing a messageBuffer entry, e.g. all the hops of a cut through message whose
+	/// reception failed
+	void invalidateMessagesUsingBuffer(uint8_t * compiledMessage);
+
+	/// Frees every entry that hasn't started sending yet, has COMPILED_MESSAGE_CONFLATE_BIT set and has the same origin
+	/// and destination as newer, which has just been queued.  Returns how many were freed.  Like any MESSAGE_TYPE_NONE,
+	/// their entries and messageBuffer space are reclaimed by the next defragmentMessages
+	int supersedeMessages(Message * newer);
+
+	/// Puts a message that was to go to toHop, a link that has gone down, back to be routed again as
+	/// MESSAGE_TYPE_INCOMING.  Returns false, and leaves it alone, if it was for toHop itself or for more than one
+	/// destination (a subscription or broadcast, whose other hops have copies of their own).  fromLink is the
+	/// bleDeviceTable index of the lost link, kept with the message so the failover can be timed; -1 if there's none
+	boolean requeueMessage(Message * m, char * toHop, int fromLink);
+
+	/// Requeues every entry waiting for toHop that hasn't started sending yet, and invalidates those that can't be.
+	/// Returns how many were requeued
+	int requeueMessagesForHop(char * toHop, int fromLink);
 
 	/// The messageBuffer that stores all messages (BleStar generated preamble, origin, destination, payload.
 	/// a single large uint8_t array is used rather than creating and deleting uint8_t arrays to minimize the
@@ -99,9 +126,12 @@ public:
 	/// Checks whether more messages from the current device can be added to messageTable.  Currently the code only
 	/// allows a single message at any time, but this may change in future to allow queueing of multiple messages.
 	boolean canAcceptMoreMessagesFromThisDevice(char * deviceName);
-	/// Defragments both messageTable and messageBuffer if required.
-	///
+	/// Defragments both messageTable and messageBuffer once either is half used.  Entries move, so this must only be
+	/// called when nothing but the channels holds a Message * (BleStar calls it at the start of each loop)
 	void defragmentMessages();
+	/// Reclaims the free entries at the top of messageTable.  Nothing moves, so this is safe anywhere.  Returns how many
+	///
+	int trimMessageTable();
 
 	/** Defragments the messageTable.  The lifecycle of a message is based on its messageType, as follows:
 
@@ -109,9 +139,12 @@ public:
 		MESSAGE_TYPE_INCOMING --- the message was received by this device (or is in process)\n
 		MESSAGE_TYPE_HOP --- the message has been fanned/routed.  This "HOP" delineation lasts only as long as it takes
 		 					for the message to successfully make it to the next device it needs to get to\n
-		MESSAGE_TYPE_NONE --- once a message does not need to be stored any longer, it's given this type.\n\n
+		MESSAGE_TYPE_HOP_SENDING --- a HOP message that a link's send channel has picked up, so no other channel takes it\n
+		MESSAGE_TYPE_NONE --- once a message does not need to be stored any longer, it's given this type.  So is an
+							entry still being received\n\n
 
-		Defragmentation removes all the MESSAGE_TYPE_NONES and compresses the table, that's all.\n\n
+		Defragmentation removes the MESSAGE_TYPE_NONEs that MessageInUseCallback says nothing points at and compresses
+		the table, that's all.  Freed entries are kept above the table, to be reused with their MessageBuilders.\n\n
 
 		Example:\n
 		_messageTableSize = 10; entries 0-5 are NONE, and 6,7,8,9 are ORIGIN, HOP, HOP, INCOMING\n
@@ -119,15 +152,13 @@ public:
 
 	*/
 	boolean defragmentMessageTable();
-	/// Kept here for debugging.  In theory the table will never need to be sorted if "makeSpaceForRouting" works
-	///
-	void sortMessageTable();
-	/// TBD
+	/// True once messageTable or messageBuffer is half used
 	///
 	boolean getMessageBufferNeedsDefragmentation();
 	/// Defragments the messageBuffer.   Each message stores a messageStart and messageEnd pointer.  defragmentation
 	/// finds gaps in the table where no messageTable entry claims space, and moves the buffer data so that once done,
-	/// each contiguous message entry in messageTable also has contiguous entries in messageBuffer.
+	/// each contiguous message entry in messageTable also has contiguous entries in messageBuffer.  Messages are told
+	/// where their bytes went with relocateCompiledMessage
 	void defragmentMessageBuffer();
 
 	/// Boolean result for optimizing routing only.   Returns true (and then clears it to false) if the messageTable has
@@ -144,6 +175,11 @@ private:
 	int _messageTableCapacity;
 	int _messageTableIndex;														// used to index through messageTable to see what needs to be sent
 	boolean _messageTableHasBeenChanged;
+	MessageInUseCallback _messageInUseCallback = NULL;
+	MessageMovedCallback _messageMovedCallback = NULL;
+
+	boolean getIsReclaimable(Message * m);
+	void releaseMessageBuilders(int firstFreeIndex, int lastIndex);
 
 };
 
@@ -0,0 +1,127 @@
+#include "BleStar.h"
+
+/*
+	Optional forward error correction.  With setForwardErrorCorrection(K), a sender follows every K chunks of a message
+	(from chunk 1 on) with a parity chunk, the XOR of their payloads, on the same channel:
+
+		[0x1C|c][first chunk covered][chunks covered][L][XOR of those chunks' payloads, each zero padded to the first's L]
+
+	Chunks on a channel arrive in order, so by the time a group's parity chunk arrives the receiver knows which of that
+	group's chunks are missing.  If it's exactly one, it's rebuilt in place from the parity and the others, with no
+	SACK and no resend round trip.  Only if more than one is missing does the receiver fall back to a SACK.  Chunk 0 is
+	never covered: without it the receiver has no message to rebuild into.
+
+	Parity chunks are only ever sent the first time a group goes out; resends after a SACK are plain chunks.
+
+	It's negotiated per link.  Both ends send a LINK_CONTROL_CAPABILITIES frame once connected, and a sender only adds
+	parity chunks if the peer says it understands them.  The receiver holds back its gap SACKs only if the peer said it
+	will be sending them.  chunksRepairedByParity in BleLinkStatistics shows how often it's paying off.
+*/
+
+void BleStar::setForwardErrorCorrection(int groupSize) {
+	_fecGroupSize = max(0, min(MAX_FEC_GROUP_SIZE, groupSize));
+	for (int i = BLE_PERIPHERAL_INDEX; i < MAX_CENTRAL_CONNECTIONS + 2; i++) {
+		bleDeviceTable[i].capabilitiesSent = false;								// so every peer hears the new group size
+	}
+}
+
+int BleStar::getFecGroupSizeForLink(BleDeviceTable * bleDevice) {
+	if ((bleDevice->peerCapabilities & LINK_CAPABILITY_PARITY_CHUNKS) == 0) { return 0; }
+	return (_fecGroupSize);
+}
+
+int BleStar::writeParityChunk(BleDeviceTable * bleDevice, BleSendChannel * channel) {
+	int firstChunk = channel->sendParityFromChunk;
+	int payloadLength = min(channel->sendBuffer->getLength(), getMessageBuilderIndexForChunkNumber(firstChunk + 1, channel->chunkLength))
+			- getMessageBuilderIndexForChunkNumber(firstChunk, channel->chunkLength);
+	int frameLength = PARITY_CHUNK_HEADER_LENGTH + payloadLength;
+
+	if (channel->indexWithinSendChunk == 0) {
+		if (!bleDevice->writer.getCanStartChunk(frameLength)) { return CHUNK_WRITE_BLOCKED; }
+		uint8_t * compiledMessage = channel->sendBuffer->getBuffer();
+		memset(bleDevice->parityBuffer, 0, payloadLength);
+		for (int i = firstChunk; i < firstChunk + channel->sendParityChunkCount; i++) {
+			int chunkStart = getMessageBuilderIndexForChunkNumber(i, channel->chunkLength);
+			int chunkEnd = min(channel->sendBuffer->getLength(), getMessageBuilderIndexForChunkNumber(i + 1, channel->chunkLength));
+			for (int j = 0; j < chunkEnd - chunkStart; j++) { bleDevice->parityBuffer[j] ^= compiledMessage[chunkStart + j]; }
+		}
+	}
+
+	uint8_t header[PARITY_CHUNK_HEADER_LENGTH] = {
+		(uint8_t)(PARITY_CHUNK_MARKER | channel->channel),
+		(uint8_t)firstChunk,
+		(uint8_t)channel->sendParityChunkCount,
+		(uint8_t)payloadLength
+	};
+	channel->indexWithinSendChunk += bleDevice->writer.writeChunk(
+			header,
+			PARITY_CHUNK_HEADER_LENGTH,
+			bleDevice->parityBuffer,
+			payloadLength,
+			channel->indexWithinSendChunk
+		);
+
+	if (channel->indexWithinSendChunk < frameLength) {
+		bleDevice->channelMidChunk = channel->channel;
+		return CHUNK_WRITE_BLOCKED;
+	}
+	bleDevice->channelMidChunk = NO_CHANNEL;
+	channel->indexWithinSendChunk = 0;
+	channel->sendParityChunkCount = 0;
+	return CHUNK_WRITE_COMPLETE;
+}
+
+
+int BleStar::receiveParityChunk(BleDeviceTable * bleDevice, uint8_t * frame, int length) {
+	if (length < PARITY_CHUNK_HEADER_LENGTH) { return 0; }
+	int frameLength = PARITY_CHUNK_HEADER_LENGTH + frame[PARITY_CHUNK_PAYLOAD_LENGTH_POSITION];
+	if (length < frameLength) { return 0; }
+	BleReceiveChannel * channel = &bleDevice->receiveChannel[frame[0] & DATA_CHUNK_CHANNEL_MASK];
+	int firstChunk = frame[1];
+	int chunkCount = frame[2];
+
+	if (channel->messageBeingReceived == NULL || channel->isDiscarding) { return frameLength; }	// e.g. the group's last chunk completed the message
+	if (firstChunk == 0 || chunkCount == 0 || firstChunk + chunkCount > channel->receiveChunksExpected
+			|| frame[PARITY_CHUNK_PAYLOAD_LENGTH_POSITION] != getChunkPayloadLength(channel, firstChunk)) {
+		Log.w("Error: parity chunk for chunks %d-%d from %s doesn't fit the message on channel %d; skipped",
+				firstChunk, firstChunk + chunkCount - 1, bleDevice->peerName, channel->channel);
+		return frameLength;
+	}
+
+	int missingChunk = -1;
+	int chunksMissing = 0;
+	for (int i = firstChunk; i < firstChunk + chunkCount; i++) {
+		if (!getChunkReceived(channel, i)) { missingChunk = i; chunksMissing++; }
+	}
+	if (chunksMissing == 0) { return frameLength; }
+
+	if (chunksMissing > 1) {
+		if (millis() - channel->lastSackTime > bleDevice->rtt.getSrtt() && !channel->messageBeingReceived->getIsQos0()) {
+			sendSelectiveAck(bleDevice, channel, channel->receiveChunkInProgress);
+		}
+		return frameLength;
+	}
+
+	// XOR the parity with every other chunk in the group, leaving the missing chunk
+	uint8_t * messageBuffer = channel->receiveBuffer->getBuffer();
+	int missingStart = getMessageBuilderIndexForChunkNumber(missingChunk, channel->chunkLength);
+	int missingLength = getChunkPayloadLength(channel, missingChunk);
+	memcpy(&messageBuffer[missingStart], &frame[PARITY_CHUNK_HEADER_LENGTH], missingLength);
+	for (int i = firstChunk; i < firstChunk + chunkCount; i++) {
+		if (i == missingChunk) { continue; }
+		uint8_t * chunk = &messageBuffer[getMessageBuilderIndexForChunkNumber(i, channel->chunkLength)];
+		int xorLength = min(missingLength, getChunkPayloadLength(channel, i));
+		for (int j = 0; j < xorLength; j++) { messageBuffer[missingStart + j] ^= chunk[j]; }
+	}
+	setChunkReceived(channel, missingChunk);
+	bleDevice->chunksRepairedByParity++;
+	channel->receiveAttempts = 0;
+	Log.v("Chunk %d from %s rebuilt from parity", missingChunk, bleDevice->peerName);
+
+	if (getAllChunksReceived(channel)) {
+		completeReceivedMessage(bleDevice, channel);
+	} else {
+		startCutThroughIfReady(bleDevice, channel);
+	}
+	return frameLength;
+}
@@ -1,5 +1,32 @@
 #include "BleStar.h"
 
+/*
+	Incoming data is handled a chunk at a time rather than a byte at a time.  Each pass, whatever is waiting in a link's
+	UART FIFO is block read into that link's receiveStagingBuffer, and complete frames are then decoded from the front
+	of the staging buffer:
+
+		[0x14|c][L][p]'#'...	chunk 0 of a compiled message on channel c, sent in chunks of L bytes, with p bytes of
+							payload.  From the stored length, the message's chunk count is known; the CRC8 is checked,
+							space is reserved in messageTable for the whole message and the chunk is copied in
+		[0x18|c][n][p]...	chunk n of the compiled message being received on channel c.  The header is decoded once,
+							and the payload is copied straight to getMessageBuilderIndexForChunkNumber(n) with one
+							memcpy, so out of sequence chunks land in place with no extra state
+		[0x1C|c][n][k][p]...	a parity chunk covering chunks n to n+k-1 on channel c, see ParityChunks.cpp
+		[0x10][op][len]...	a binary link control frame (ACK, NACK, SACK...), see SystemMessages.cpp
+		anything >= ' '		an unformed (text) message, accumulated in tempReceiveBuffer until a byte < ' ' arrives
+
+	A frame that is not yet complete stays in the staging buffer until the rest of it arrives.  Every chunk says how long
+	it is, so one that fits no message on its channel (chunk 0 was lost or had no room, or it's a resend that arrived
+	after the message was complete) is skipped on its own, and nothing else on the link is lost.
+
+	Each of the link's BLE_LINK_CHANNELS receive channels reassembles its own message, so the sender can have several
+	messages in flight at once with their chunks interleaved.
+
+	Repair is selective repeat: while a message streams in, the receiver reports receivedChunkFlags to the sender as a
+	SACK every SACK_EVERY_N_CHUNKS chunks, as soon as it sees a gap, and whenever the channel goes quiet with chunks still
+	missing.  The sender resends only the holes, ahead of any new chunks, without stopping the stream.
+*/
+
 // this method must be called often to collect data from incoming BLE buffers else they will overflow
 void BleStar::pollReceivingMessages() {
 	for (int i = BLE_PERIPHERAL_INDEX; i < MAX_CENTRAL_CONNECTIONS + 2; i++) {
@@ -13,189 +40,263 @@ void BleStar::pollReceivingMessage(int bleDeviceIndex) {
 
 	if (bleDeviceIndex == BLE_THIS_DEVICE_INDEX || !bleDevice->isConnected) { return; }
 
-	if (bleDeviceIndex == BLE_PERIPHERAL_INDEX) {
-		while (thisDeviceAsPeripheralUart.available()) { parseAndReorderReceivedData(thisDeviceAsPeripheralUart.read(), bleDevice); }
-	} else {
-		BLEClientUart * bleCentralUart = &bleCentralConnectionTable[bleDeviceIndex - BLE_CENTRAL_INDEX_0].bleCentralUart;
-		while (bleCentralUart->available()) { parseAndReorderReceivedData(bleCentralUart->read(), bleDevice); }
-	}
-
-	if (millis() - bleDevice->lastreceivedTime > 30 && millis() - bleDevice->lastResendRequestTime > MIN_INTERVAL_BETWEEN_RESEND_REQUESTS) {
-		if (bleDevice->sendAttempts>DEFAULT_MAX_HOP_ATTEMPTS) {
+	int bytesRead;
+	do {
+		int stagingSpace = RECEIVE_STAGING_BUFFER_LENGTH - bleDevice->receiveStagingLength;
+		bytesRead = readFromBleDevice(bleDevice, &bleDevice->receiveStagingBuffer[bleDevice->receiveStagingLength], stagingSpace);
+		if (bytesRead > 0) {
+			bleDevice->receiveStagingLength += bytesRead;
+			bleDevice->lastreceivedTime = millis();
+			processReceiveStagingBuffer(bleDevice);
+		}
+	} while (bytesRead > 0);
+
+	for (int i = 0; i < BLE_LINK_CHANNELS; i++) {
+		BleReceiveChannel * channel = &bleDevice->receiveChannel[i];
+		if (channel->messageBeingReceived == NULL
+				|| millis() - channel->lastreceivedTime <= bleDevice->rtt.getRto()		// quiet for longer than any chunk should take
+				|| millis() - channel->lastSackTime <= bleDevice->rtt.getRto()) {		// and the last SACK has had time to be answered
+			continue;
+		}
+		if (channel->messageBeingReceived->getIsQos0()) {						// what's missing is never coming
+			failAndClearReceiveChannel(bleDevice, channel);
+			continue;
+		}
+		if (channel->isCheckingChunks) {										// chunk checks found nothing, or never came
+			sendNack(bleDevice, channel);
+			failAndClearReceiveChannel(bleDevice, channel);
+			continue;
+		}
+		if (channel->receiveAttempts > DEFAULT_MAX_HOP_ATTEMPTS) {
 			Log.w("Error: attempting to receive message %d from %s, but did not receive all missing chunks after %d attempts",
-					bleDevice->messageBeingReceived->getMessageId(),
+					channel->messageBeingReceived->getMessageId(),
 					bleDevice->peerName,
 					DEFAULT_MAX_HOP_ATTEMPTS
 				);
-			failAndClearAnyMessagesBeingReceived(bleDevice);
-			return;
+			failAndClearReceiveChannel(bleDevice, channel);
+			continue;
 		}
-		bleDevice->sendAttempts++;
-		sendResendRequestSequence(bleDevice, 0, bleDevice->sendChunksExpected);
+		channel->receiveAttempts++;
+		sendSelectiveAck(bleDevice, channel, channel->receiveChunksExpected);	// the tail may be lost too, so cover every chunk
 	}
 }
 
 
-void BleStar::parseAndReorderReceivedData(uint8_t u, BleDeviceTable * bleDevice) {
+int BleStar::readFromBleDevice(BleDeviceTable * bleDevice, uint8_t * buffer, int maxLength) {
+	if (maxLength <= 0) { return 0; }
+	if (bleDevice->index == BLE_PERIPHERAL_INDEX) {
+		return (thisDeviceAsPeripheralUart.available() ? thisDeviceAsPeripheralUart.read(buffer, maxLength) : 0);
+	}
+	BLEClientUart * bleCentralUart = &bleCentralConnectionTable[bleDevice->index - BLE_CENTRAL_INDEX_0].bleCentralUart;
+	return (bleCentralUart->available() ? bleCentralUart->read(buffer, maxLength) : 0);
+}
 
-	// Methods to be run before anything is written to buffers
-	bleDevice->lastreceivedTime = millis();
-	if (bleDevice->indexWithinReceiveChunk == 0) {
-		switch (bleDevice->receiveState) {
-			case AWAITING_NEW_MESSAGE:
-				if (u < ' ') { return; }										// reject characters until a # or something >= 0x20 arrives
-				bleDevice->receiveState = (u == '#' ? AWAITING_END_OF_FIRST_CHUNK: RECEIVING_UNFORMED_MESSAGE);
-				break;
-			case AWAITING_START_OF_IN_SEQUENCE_CHUNK: parseExpectedStartOfChunk(u, bleDevice, true); return;
-			case AWAITING_START_OF_OUT_OF_SEQUENCE_CHUNK: parseExpectedStartOfChunk(u, bleDevice, false); return;
-		}
+
+void BleStar::processReceiveStagingBuffer(BleDeviceTable * bleDevice) {
+	uint8_t * staging = bleDevice->receiveStagingBuffer;
+	int index = 0;
+
+	while (index < bleDevice->receiveStagingLength) {
+		int bytesUsed = decodeReceivedFrame(bleDevice, &staging[index], bleDevice->receiveStagingLength - index);
+		if (bytesUsed == 0) { break; }											// frame incomplete, wait for the rest of it
+		index += bytesUsed;
 	}
 
-	if (!bleDevice->receiveBuffer->append(u)) {
-		if (bleDevice->isUsingTempReceiveBuffer) {											// create messageTableEntry if > 20 bytes needed
-			bleDevice->messageBeingReceived = mTable.reserveSpaceForIncomingMessage(DEFAULT_EXPECTED_MESSAGE_LENGTH, bleDevice->peerName);
-			if (bleDevice->messageBeingReceived == NULL) {
-				Log.e("Critical error - insufficient buffer or table space to accept new incoming message from %s", bleDevice->peerName);
-				return;
-			}
-			bleDevice->receiveBuffer = bleDevice->messageBeingReceived->getMessageBuilder();
-			bleDevice->receiveBuffer->append(bleDevice->tempReceiveBuffer->getBuffer());
-			bleDevice->receiveBuffer->append(u);
-			bleDevice->isUsingTempReceiveBuffer = false;
-		} else {
-			Log.w("Error: messages received through device %s caused buffer over-run; resetting buffer", bleDevice->peerName);
-			failAndClearAnyMessagesBeingReceived(bleDevice);
-			return;
-		}
+	if (index == 0 && bleDevice->receiveStagingLength == RECEIVE_STAGING_BUFFER_LENGTH) {
+		Log.w("Error: receive staging buffer for %s full without a complete frame; discarding one byte", bleDevice->peerName);
+		index = 1;
 	}
-	bleDevice->indexWithinReceiveChunk++;
 
-	switch (bleDevice->receiveState) {
-		case RECEIVING_UNFORMED_MESSAGE: checkForDelimiterOnUnformedMessage(bleDevice, u); return;
-		case AWAITING_END_OF_FIRST_CHUNK: checkForFirstChunkComplete(bleDevice); return;
-		case AWAITING_END_OF_IN_SEQUENCE_CHUNK: checkForEndOfChunk(bleDevice); return;
-		case AWAITING_END_OF_OUT_OF_SEQUENCE_CHUNK: checkForEndOfChunk(bleDevice); return;
+	bleDevice->receiveStagingLength -= index;
+	if (index > 0 && bleDevice->receiveStagingLength > 0) {
+		memmove(staging, &staging[index], bleDevice->receiveStagingLength);
 	}
 }
 
-void BleStar::parseExpectedStartOfChunk(uint8_t u, BleDeviceTable * bleDevice, boolean isInSequence) {
+// Returns the number of bytes consumed from the front of frame, or 0 if more bytes are needed to decode it
+int BleStar::decodeReceivedFrame(BleDeviceTable * bleDevice, uint8_t * frame, int length) {
+	if ((frame[0] & DATA_CHUNK_MARKER_MASK) == DATA_CHUNK_MARKER) { return (receiveChunk(bleDevice, frame, length)); }
+	if ((frame[0] & DATA_CHUNK_MARKER_MASK) == FIRST_CHUNK_MARKER) { return (receiveChunk(bleDevice, frame, length)); }
+	if ((frame[0] & DATA_CHUNK_MARKER_MASK) == PARITY_CHUNK_MARKER) { return (receiveParityChunk(bleDevice, frame, length)); }
+	if (frame[0] == LINK_CONTROL_FRAME_MARKER) { return (receiveLinkControlFrame(bleDevice, frame, length)); }
+
+	if (bleDevice->receiveState == RECEIVING_UNFORMED_MESSAGE) { return (receiveUnformedBytes(bleDevice, frame, length)); }
+	if (frame[0] < ' ') { return 1; }											// reject characters until a marker or something >= 0x20 arrives
+
+	bleDevice->receiveState = RECEIVING_UNFORMED_MESSAGE;
+	return (receiveUnformedBytes(bleDevice, frame, length));
+}
+
 
-	if (isInSequence && u == bleDevice->receiveChunkInProgress) {
-		bleDevice->receiveState = (isInSequence ? AWAITING_END_OF_IN_SEQUENCE_CHUNK : AWAITING_END_OF_OUT_OF_SEQUENCE_CHUNK);
+// frame is the whole of chunk 0, its length already checked against the payload length it carries
+void BleStar::receiveFirstChunk(BleDeviceTable * bleDevice, BleReceiveChannel * channel, uint8_t * frame, int chunkLength) {
+	uint8_t * header = &frame[DATA_CHUNK_HEADER_LENGTH];						// the start of the compiled message
+	int payloadLength = frame[DATA_CHUNK_PAYLOAD_LENGTH_POSITION];
+
+	int messageLength = (payloadLength >= COMPILED_MESSAGE_ORIGIN_NAME_POSITION ? Message::getStoredMessageLength(header) : 0);
+	if (header[0] != '#' || messageLength < COMPILED_MESSAGE_ORIGIN_NAME_POSITION || messageLength > MAX_COMPILED_MESSAGE_LENGTH
+			|| chunkLength < MAX_BLE_CHUNK_LENGTH || chunkLength > MAX_NEGOTIATED_BLE_CHUNK_LENGTH
+			|| payloadLength != min(DATA_CHUNK_PAYLOAD_LENGTH(chunkLength), messageLength)) {
+		Log.w("Error: chunk 0 on channel %d from %s is not the start of a valid message; skipped", channel->channel, bleDevice->peerName);
 		return;
 	}
 
-	if (u > bleDevice->receiveChunksExpected) {
-		Log.w("Error! incoming chunk first byte > numberOfChunks in message");
-		sendNack(bleDevice);
-		failAndClearAnyMessagesBeingReceived(bleDevice);
-		return;
+	if (!Message::getIsMessageCrc8Valid(header)) {
+		Log.w("Message Crc8 invalid; chunk 0 on channel %d skipped", channel->channel);
+		return;																	// the sender hears nothing back, and resends it
 	}
 
-	if (isInSequence) {
-		sendResendRequestSequence(bleDevice, bleDevice->chunkResendIndex, (int)u);
-		bleDevice->chunkResendIndex = u;
+	if (channel->messageBeingReceived != NULL) {
+		if (memcmp(header, channel->messageBeingReceived->getStartOfCompiledMessage(), COMPILED_MESSAGE_ORIGIN_NAME_POSITION) == 0) {
+			if (getChunkReceived(channel, 0) || chunkLength != channel->chunkLength) { return; }	// resent after an ACK timeout; already have it
+			memcpy(channel->messageBeingReceived->getStartOfCompiledMessage(), header, payloadLength);	// chunk checks found it corrupt
+			channel->lastreceivedTime = millis();
+			setChunkReceived(channel, 0);
+			if (getAllChunksReceived(channel)) { completeReceivedMessage(bleDevice, channel); }
+			return;
+		}
+		failAndClearReceiveChannel(bleDevice, channel);						// sender gave up on the old message
 	}
-	bleDevice->receiveChunkInProgress = u;
-	bleDevice->receiveBuffer->setReadIndex(getMessageBuilderIndexForChunkNumber(u));
+	resetReceiveChannel(channel);
+	channel->chunkLength = chunkLength;
+	channel->receiveMessageLength = messageLength;
+	channel->receiveChunksExpected = getNumberOfChunksForMessageLength(messageLength, chunkLength);
+	channel->receiveChunkInProgress = 1;
+	channel->lastreceivedTime = millis();
+
+	Message * m = mTable.reserveSpaceForIncomingMessage(messageLength + 1, bleDevice->peerName);
+	if (m == NULL) {
+		Log.e("Critical error - insufficient buffer or table space to accept new incoming message from %s", bleDevice->peerName);
+		channel->isDiscarding = true;											// the rest of its chunks can still be framed and skipped
+		sendReceiveOverflow(bleDevice, channel);
+		return;																	// dropped; the sender backs off, times out and resends
+	}
+	memcpy(m->getStartOfCompiledMessage(), header, payloadLength);
 
-}
+	channel->messageBeingReceived = m;
+	channel->receiveBuffer = m->getMessageBuilder();
+	channel->receiveBuffer->setLength(messageLength);
+	channel->chunksSinceLastSack = 1;
+	setChunkReceived(channel, 0);
 
-void BleStar::checkForDelimiterOnUnformedMessage(BleDeviceTable * bleDevice, uint8_t u) {
-	if (u < 32) {
-		Log.i("Unformed Message received from %s: %s", bleDevice->peerName, bleDevice->receiveBuffer);
-		if (!isShortIncomingSystemMessage(bleDevice)) {
-			fireUnformedMessageReceivedCallback((char *)bleDevice->receiveBuffer->getBuffer(), bleDevice->index, bleDevice->peerName);
-		}
-		resetReceiveMessage(bleDevice);
+	if (channel->receiveChunksExpected == 1) {
+		completeReceivedMessage(bleDevice, channel);
+	} else {
+		startCutThroughIfReady(bleDevice, channel);
 	}
-	return;
 }
 
 
-void BleStar::checkForFirstChunkComplete(BleDeviceTable * bleDevice) {
-	if (bleDevice->indexWithinReceiveChunk < COMPILED_MESSAGE_ORIGIN_NAME_POSITION) {
-		return;																	// if we haven't even received enough bytes to read the stored message length, return
+int BleStar::receiveChunk(BleDeviceTable * bleDevice, uint8_t * frame, int length) {
+	if (length < DATA_CHUNK_HEADER_LENGTH) { return 0; }
+	int frameLength = DATA_CHUNK_HEADER_LENGTH + frame[DATA_CHUNK_PAYLOAD_LENGTH_POSITION];
+	if (length < frameLength) { return 0; }
+	BleReceiveChannel * channel = &bleDevice->receiveChannel[frame[0] & DATA_CHUNK_CHANNEL_MASK];
+	if ((frame[0] & DATA_CHUNK_MARKER_MASK) == FIRST_CHUNK_MARKER) {
+		receiveFirstChunk(bleDevice, channel, frame, frame[1]);
+		return frameLength;
 	}
+	int chunkNumber = frame[1];
 
-	uint16_t messageLength = bleDevice->messageBeingReceived->getStoredMessageLength();
+	// chunk 0 never arrived or had no room, or this is a resend of a message already complete.  The sender hears nothing
+	// back about it, and in the first two cases times out and starts again from chunk 0
+	if (channel->messageBeingReceived == NULL || channel->isDiscarding) { return frameLength; }
 
-	if (bleDevice->indexWithinReceiveChunk != MAX_BLE_CHUNK_LENGTH && bleDevice->receiveBuffer->getLength() < messageLength) {
-		return;																	// if we haven't finished the first chunk or reached end of message
+	if (chunkNumber == 0 || chunkNumber >= channel->receiveChunksExpected
+			|| frame[DATA_CHUNK_PAYLOAD_LENGTH_POSITION] != getChunkPayloadLength(channel, chunkNumber)) {
+		Log.w("Error: chunk %d from %s doesn't fit the message on channel %d; skipped", chunkNumber, bleDevice->peerName, channel->channel);
+		return frameLength;
 	}
 
-	if (!bleDevice->messageBeingReceived->getIsMessageCrc8Valid()) {
-		Log.w("Message Crc8 invalid:");
-		failAndClearAnyMessagesBeingReceived(bleDevice);
-		return;
-	}
+	int chunkStart = getMessageBuilderIndexForChunkNumber(chunkNumber, channel->chunkLength);
+	int chunkEnd = chunkStart + frame[DATA_CHUNK_PAYLOAD_LENGTH_POSITION];
 
-	if (bleDevice->messageBeingReceived->getStoredMessageLength() > MAX_BLE_CHUNK_LENGTH) {
-		bleDevice->receiveChunksExpected = getNumberOfChunksForMessageLength(messageLength);
-		setChunkReceived(bleDevice, 0);
-		bleDevice->receiveChunkInProgress = 1;
-		bleDevice->indexWithinReceiveChunk = 1;
-		bleDevice->receiveState = AWAITING_START_OF_IN_SEQUENCE_CHUNK;
-		return;
+	channel->lastreceivedTime = millis();
+	if (!getChunkReceived(channel, chunkNumber)) {
+		memcpy(&channel->receiveBuffer->getBuffer()[chunkStart], &frame[DATA_CHUNK_HEADER_LENGTH], chunkEnd - chunkStart);
+		setChunkReceived(channel, chunkNumber);
+		if (channel->rttTimedSackTime != 0 && chunkNumber == channel->rttTimedChunk) {
+			bleDevice->rtt.addSample(millis() - channel->rttTimedSackTime);		// holes are resent first, so this is SACK to retransmission
+			channel->rttTimedSackTime = 0;
+		}
+		channel->receiveAttempts = 0;											// still making progress
+		channel->chunksSinceLastSack++;
 	}
 
-	if (!bleDevice->messageBeingReceived->getIsMessageCrc16Valid()) {
-		Log.w("Message Crc16 invalid");
-		failAndClearAnyMessagesBeingReceived(bleDevice);
-		return;
+	if (channel->isCheckingChunks) { return frameLength; }						// a resend of a chunk already here; crc16 already failed
+	if (getAllChunksReceived(channel)) {
+		completeReceivedMessage(bleDevice, channel);
+		return frameLength;
 	}
-
-	Log.i("Message received from %s:", bleDevice->peerName);
-	if (Log.getLoggingLevel() >= Log.INFO) { bleDevice->receiveBuffer->printEntireMessage(); }
-	sendAck(bleDevice);
-	processRoutedMessage(bleDevice);
-	resetReceiveMessage(bleDevice);
+	startCutThroughIfReady(bleDevice, channel);
+
+	// Chunks on a channel arrive in order over BLE, so anything skipped below this chunk was lost rather than delayed.
+	// If the peer sends parity chunks, the gap is left for the group's parity chunk to repair or report
+	int gapStart = channel->receiveChunkInProgress;
+	boolean isGap = (chunkNumber > gapStart && bleDevice->peerFecGroupSize == 0);
+	channel->receiveChunkInProgress = max(channel->receiveChunkInProgress, chunkNumber + 1);
+	if (channel->messageBeingReceived->getIsQos0()) { return frameLength; }	// nothing is resent, so there's nothing to report
+	if ((isGap && millis() - channel->lastSackTime > bleDevice->rtt.getSrtt())
+			|| channel->chunksSinceLastSack >= SACK_EVERY_N_CHUNKS) {
+		int firstMissingChunk = sendSelectiveAck(bleDevice, channel, channel->receiveChunkInProgress);
+		if (isGap && firstMissingChunk == gapStart) {							// reported for the first time, so the resend can be timed
+			channel->rttTimedSackTime = channel->lastSackTime;
+			channel->rttTimedChunk = firstMissingChunk;
+		}
+	}
+	return frameLength;
 }
 
 
-void BleStar::checkForEndOfChunk(BleDeviceTable * bleDevice) {
-	uint16_t messageLengthPerHeaderPreamble = bleDevice->messageBeingReceived->getStoredMessageLength();
-	int currentMessageLength = bleDevice->receiveBuffer->getLength();
+int BleStar::getChunkPayloadLength(BleReceiveChannel * channel, int chunkNumber) {
+	return (min(channel->receiveMessageLength, getMessageBuilderIndexForChunkNumber(chunkNumber + 1, channel->chunkLength))
+			- getMessageBuilderIndexForChunkNumber(chunkNumber, channel->chunkLength));
+}
 
-	if (currentMessageLength < messageLengthPerHeaderPreamble) {				// message not yet complete
-		if (bleDevice->indexWithinReceiveChunk < MAX_BLE_CHUNK_LENGTH) { return; }
 
-		setChunkReceived(bleDevice, bleDevice->receiveChunkInProgress);
-		bleDevice->indexWithinReceiveChunk = 1;
-		bleDevice->receiveChunkInProgress += (bleDevice->receiveState == AWAITING_END_OF_IN_SEQUENCE_CHUNK ? 1 : 0);
-		bleDevice->receiveState = (bleDevice->receiveState == AWAITING_END_OF_IN_SEQUENCE_CHUNK ?
-			 		AWAITING_START_OF_IN_SEQUENCE_CHUNK
-					:
-					AWAITING_START_OF_OUT_OF_SEQUENCE_CHUNK
-				);
-		return;
+int BleStar::receiveUnformedBytes(BleDeviceTable * bleDevice, uint8_t * frame, int length) {
+	for (int i = 0; i < length; i++) {
+		if (frame[i] < ' ') {
+			bleDevice->tempReceiveBuffer->append(frame, i);
+			bleDevice->tempReceiveBuffer->nullTerminateBuffer();
+			Log.i("Unformed Message received from %s: %s", bleDevice->peerName, (char *)bleDevice->tempReceiveBuffer->getBuffer());
+			fireUnformedMessageReceivedCallback((char *)bleDevice->tempReceiveBuffer->getBuffer(), bleDevice->index, bleDevice->peerName);
+			resetUnformedMessage(bleDevice);
+			return (i + 1);
+		}
 	}
 
-	if (bleDevice->indexWithinReceiveChunk >= MAX_BLE_CHUNK_LENGTH
-			|| bleDevice->receiveBuffer->getWriteIndex() >= messageLengthPerHeaderPreamble) {
-
-		setChunkReceived(bleDevice, bleDevice->receiveChunkInProgress);
-
-		if (!getAllChunksReceived(bleDevice)) {
-			bleDevice->receiveState = AWAITING_START_OF_OUT_OF_SEQUENCE_CHUNK;
-			bleDevice->indexWithinReceiveChunk = 1;
-			return;
-		}
+	if (!bleDevice->tempReceiveBuffer->append(frame, length)) {
+		Log.w("Error: unformed message from %s longer than %d bytes; discarding", bleDevice->peerName, MAX_UNFORMED_MESSAGE_LENGTH);
+		resetUnformedMessage(bleDevice);
+	}
+	return length;
+}
 
-		if (bleDevice->messageBeingReceived->getIsMessageCrc16Valid()) {
-			Log.i("Complete Message received from %s", bleDevice->peerName);
-			if (Log.getLoggingLevel() >= Log.INFO) { bleDevice->receiveBuffer->printEntireMessage(); }
 
-			sendAck(bleDevice);
-			processRoutedMessage(bleDevice);									// Success
-			resetReceiveMessage(bleDevice);
+void BleStar::completeReceivedMessage(BleDeviceTable * bleDevice, BleReceiveChannel * channel) {
+	uint16_t crc16 = CRC::updateCrc16(channel->runningCrc16,						// normally none of it is left to do
+			&channel->receiveBuffer->getBuffer()[channel->runningCrc16Length], channel->receiveMessageLength - channel->runningCrc16Length);
+	if (channel->messageBeingReceived->getIsMessageCrc16Valid(crc16)) {
+		Log.i("Complete Message received from %s on channel %d", bleDevice->peerName, channel->channel);
+		if (Log.getLoggingLevel() >= Log.INFO) { channel->receiveBuffer->printEntireMessage(); }
 
+		if (channel->messageBeingReceived->getIsQos0()) {
+			bleDevice->qos0MessagesReceived++;
 		} else {
-			Log.w("Crc16 failed in message from %s:", bleDevice->peerName);
-			if (Log.getLoggingLevel() >= Log.WARN) { bleDevice->receiveBuffer->printEntireMessage(); }
-			sendNack(bleDevice);
-			failAndClearAnyMessagesBeingReceived(bleDevice);
+			sendAck(bleDevice, channel);
 		}
+		processRoutedMessage(bleDevice, channel);								// Success
+		resetReceiveChannel(channel);
+
+	} else {
+		Log.w("Crc16 failed in message from %s:", bleDevice->peerName);
+		if (Log.getLoggingLevel() >= Log.WARN) { channel->receiveBuffer->printEntireMessage(); }
+		if (!channel->messageBeingReceived->getIsQos0()) {
+			if (startChunkCheckRepair(bleDevice, channel)) { return; }			// kept, to find and replace just the bad chunks
+			sendNack(bleDevice, channel);
+		}
+		failAndClearReceiveChannel(bleDevice, channel);
 	}
 }
 
@@ -203,9 +304,16 @@ void BleStar::checkForEndOfChunk(BleDeviceTable * bleDevice) {
 
 
 void BleStar::failAndClearAnyMessagesBeingReceived(BleDeviceTable * bleDevice) {
-	if (bleDevice->messageBeingReceived != NULL) {
+	for (int i = 0; i < BLE_LINK_CHANNELS; i++) { failAndClearReceiveChannel(bleDevice, &bleDevice->receiveChannel[i]); }
+	resetReceiveMessage(bleDevice);
+}
+
+void BleStar::failAndClearReceiveChannel(BleDeviceTable * bleDevice, BleReceiveChannel * channel) {
+	if (channel->messageBeingReceived != NULL) {
+		if (channel->messageBeingReceived->getIsQos0()) { bleDevice->qos0MessagesDropped++; }
 		Log.w("Message currently being received from device %s will be discarded:", bleDevice->peerName);
-		if (Log.getLoggingLevel() >= Log.WARN) { bleDevice->receiveBuffer->printEntireMessage(); }
+		if (Log.getLoggingLevel() >= Log.WARN) { channel->receiveBuffer->printEntireMessage(); }
+		if (channel->isCutThrough) { cancelCutThrough(channel); }
 	}
-	resetReceiveMessage(bleDevice);
+	resetReceiveChannel(channel);
 }
@@ -0,0 +1,184 @@
+#include "BleStar.h"
+
+/*
+	Resumable transfers.  When a link drops, a message part way across it would normally be failed at both ends, and
+	however much of it had gone would be sent again.  With setResumableTransfers(graceMillis), each end instead parks
+	its channel as it was (the message, and its sentChunkFlags or receivedChunkFlags) in suspendedTransfer, under the
+	peer's name, for up to graceMillis.
+
+	If the same peer connects again in that time, the sender puts each parked message back on an idle send channel,
+	sends nothing, and asks the receiver to pick it up:
+
+		LINK_CONTROL_RESUME		[channel][crc16 of message, 2 bytes][messageId, 2 bytes]
+
+	The receiver looks for a parked message from that peer with the same messageId and crc16 (which covers the origin
+	too), puts it on that channel, and answers with a SACK covering every chunk.  That tells the sender exactly which
+	chunks to send, and the transfer carries on from there like any other.  If the receiver has nothing parked it
+	NACKs, and the message starts again from chunk 0.  A RESUME that goes unanswered is sent again after the ACK timeout.
+
+	A peer that doesn't announce LINK_CAPABILITY_RESUMABLE_TRANSFERS gets the message again from chunk 0.  QoS 0
+	messages, and messages still being forwarded cut through, are failed at the disconnect as before.  A message still
+	parked when graceMillis is up is routed again if it can be (see LinkFailure.cpp), and otherwise failed then, so
+	transmissionFailedCallback fires late rather than not at all.
+*/
+
+void BleStar::setResumableTransfers(uint32_t graceMillis) {
+	_resumeGraceMillis = graceMillis;											// anything already parked goes at the next poll if 0
+}
+
+// Called from the disconnect callbacks, before whatever is left is failed
+void BleStar::suspendTransfers(BleDeviceTable * bleDevice) {
+	if (_resumeGraceMillis == 0 || bleDevice->peerName == NULL) { return; }
+
+	int transfersSuspended = 0;
+	for (int i = 0; i < BLE_LINK_CHANNELS; i++) {
+		BleSendChannel * channel = &bleDevice->sendChannel[i];
+		Message * m = channel->messageBeingSent;
+		if (m == NULL || m->getIsQos0() || channel->sendAttempts > DEFAULT_MAX_HOP_ATTEMPTS) { continue; }
+		if (getBytesAvailableToForward(channel->sendBuffer->getBuffer(), channel->sendBuffer->getLength()) < channel->sendBuffer->getLength()) {
+			continue;															// its upstream may fail while it's parked
+		}
+		SuspendedTransfer * transfer = getFreeSuspendedTransfer();
+		if (transfer == NULL) { break; }
+		transfer->peerName = bleDevice->peerName;
+		transfer->isSending = true;
+		transfer->suspendedTime = millis();
+		transfer->sendChannel = *channel;
+		transfer->sendChannel.indexWithinSendChunk = 0;							// a part written chunk is still flagged as needing to be sent
+		channel->messageBeingSent = NULL;										// stays MESSAGE_TYPE_HOP_SENDING, so no other link takes it meanwhile
+		resetSendChannel(channel);
+		transfersSuspended++;
+	}
+
+	for (int i = 0; i < BLE_LINK_CHANNELS; i++) {
+		BleReceiveChannel * channel = &bleDevice->receiveChannel[i];
+		Message * m = channel->messageBeingReceived;
+		if (m == NULL || m->getIsQos0() || channel->isCutThrough || channel->isCheckingChunks) { continue; }
+		SuspendedTransfer * transfer = getFreeSuspendedTransfer();
+		if (transfer == NULL) { break; }
+		transfer->peerName = bleDevice->peerName;
+		transfer->isSending = false;
+		transfer->suspendedTime = millis();
+		transfer->receiveChannel = *channel;
+		channel->messageBeingReceived = NULL;									// so resetting the channel leaves its messageTable entry alone
+		resetReceiveChannel(channel);
+		transfersSuspended++;
+	}
+
+	if (transfersSuspended > 0) {
+		Log.i("Keeping %d transfers with %s for %lu ms in case it reconnects", transfersSuspended, bleDevice->peerName, (unsigned long)_resumeGraceMillis);
+	}
+}
+
+SuspendedTransfer * BleStar::getFreeSuspendedTransfer() {
+	for (int i = 0; i < MAX_SUSPENDED_TRANSFERS; i++) {
+		if (suspendedTransfer[i].peerName == NULL) { return &suspendedTransfer[i]; }
+	}
+	return NULL;
+}
+
+// Fails whatever has been parked for longer than the grace period
+void BleStar::pollSuspendedTransfers() {
+	for (int i = 0; i < MAX_SUSPENDED_TRANSFERS; i++) {
+		SuspendedTransfer * transfer = &suspendedTransfer[i];
+		if (transfer->peerName == NULL || millis() - transfer->suspendedTime <= _resumeGraceMillis) { continue; }
+
+		Message * m = (transfer->isSending ? transfer->sendChannel.messageBeingSent : transfer->receiveChannel.messageBeingReceived);
+		Log.w("Transfer of message %d with %s was not resumed in time", m->getMessageId(), transfer->peerName);
+		transfer->peerName = NULL;
+		if (transfer->isSending) {
+			if (mTable.requeueMessage(m, m->getToHop(), -1)) { continue; }	// parked rather than requeued when the link went, so not part of its failover
+			deltaMessageFailed(m);
+			fireTransmissionFailedCallbacks(m);
+		} else {
+			m->getMessageBuilder()->reset();
+		}
+		m->setMessageType(MESSAGE_TYPE_NONE);
+	}
+}
+
+// Called once the peer's capabilities are known, before any new message takes a send channel
+void BleStar::resumeSuspendedTransfers(BleDeviceTable * bleDevice) {
+	for (int i = 0; i < MAX_SUSPENDED_TRANSFERS; i++) {
+		SuspendedTransfer * transfer = &suspendedTransfer[i];
+		if (transfer->peerName != bleDevice->peerName || !transfer->isSending) { continue; }
+
+		BleSendChannel * channel = NULL;
+		for (int j = 0; j < BLE_LINK_CHANNELS && channel == NULL; j++) {
+			if (bleDevice->sendChannel[j].messageBeingSent == NULL) { channel = &bleDevice->sendChannel[j]; }
+		}
+		if (channel == NULL) { return; }
+
+		Message * m = transfer->sendChannel.messageBeingSent;
+		if ((bleDevice->peerCapabilities & LINK_CAPABILITY_RESUMABLE_TRANSFERS) == 0 || getChunkNeedsToBeSent(&transfer->sendChannel, 0)) {
+			assignMessageToSendChannel(m, bleDevice, channel);					// nothing to resume, so it starts again from chunk 0
+		} else {
+			int channelNumber = channel->channel;
+			*channel = transfer->sendChannel;
+			channel->channel = channelNumber;
+			channel->sendChunkInProgress = channel->sendChunksExpected;			// nothing goes until the receiver says what it's missing
+			channel->sendChunkResendRequested = false;
+			channel->rttTimedSendTime = 0;
+			channel->sendHasRetransmitted = true;
+			channel->fecGroupSize = 0;											// the holes are all known, so no parity is needed
+			channel->sendParityChunkCount = 0;
+			channel->isResuming = true;
+			channel->lastSendTime = millis();
+			sendResume(bleDevice, channel);
+			Log.i("Resuming message %d to %s from chunk %d of %d", m->getMessageId(), bleDevice->peerName,
+					channel->sendChunksAcknowledged, channel->sendChunksExpected);
+		}
+		transfer->peerName = NULL;
+	}
+}
+
+void BleStar::sendResume(BleDeviceTable * bleDevice, BleSendChannel * channel) {
+	uint16_t crc16 = channel->messageBeingSent->getStoredMessageCrc16();
+	uint16_t messageId = channel->messageBeingSent->getMessageId();
+	uint8_t frame[LINK_CONTROL_FRAME_HEADER_LENGTH + RESUME_BODY_LENGTH] = {
+		LINK_CONTROL_FRAME_MARKER,
+		LINK_CONTROL_RESUME,
+		RESUME_BODY_LENGTH,
+		(uint8_t)channel->channel,
+		(uint8_t)(crc16 / 256),
+		(uint8_t)(crc16 & 0xFF),
+		(uint8_t)(messageId / 256),
+		(uint8_t)(messageId & 0xFF)
+	};
+	sendRawToBleDevice(frame, sizeof(frame), bleDevice->index);
+}
+
+void BleStar::processResume(BleDeviceTable * bleDevice, uint8_t * body, int bodyLength) {
+	if (bodyLength < RESUME_BODY_LENGTH || body[0] >= BLE_LINK_CHANNELS) { return; }
+	BleReceiveChannel * channel = &bleDevice->receiveChannel[body[0]];
+	uint16_t crc16 = body[1] * 256 + body[2];
+	uint16_t messageId = body[3] * 256 + body[4];
+
+	SuspendedTransfer * transfer = NULL;
+	for (int i = 0; i < MAX_SUSPENDED_TRANSFERS && transfer == NULL; i++) {
+		Message * m = suspendedTransfer[i].receiveChannel.messageBeingReceived;
+		if (suspendedTransfer[i].peerName == bleDevice->peerName && !suspendedTransfer[i].isSending
+				&& m->getMessageId() == messageId && m->getStoredMessageCrc16() == crc16) {
+			transfer = &suspendedTransfer[i];
+		}
+	}
+
+	failAndClearReceiveChannel(bleDevice, channel);								// the sender has finished with whatever was on it
+	if (transfer == NULL) {
+		Log.w("Error: %s asked to resume message %d, which isn't here; starting it again", bleDevice->peerName, messageId);
+		sendNack(bleDevice, channel);
+		return;
+	}
+
+	*channel = transfer->receiveChannel;
+	channel->channel = body[0];
+	channel->receiveAttempts = 0;
+	channel->lastreceivedTime = millis();
+	channel->chunksSinceLastSack = 0;
+	channel->rttTimedSackTime = 0;
+	transfer->peerName = NULL;
+	bleDevice->transfersResumed++;
+	Log.i("Resumed message %d from %s with %d of %d chunks already here", messageId, bleDevice->peerName,
+			channel->receiveChunksContiguous, channel->receiveChunksExpected);
+	sendSelectiveAck(bleDevice, channel, channel->receiveChunksExpected);
+}
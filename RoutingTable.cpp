@@ -21,7 +21,7 @@ void RoutingTable::initialize(int routingTableCapacity) {
 char * RoutingTable::getNamePointerFromName(char * destinationName) { return (getNamePointerFromName(destinationName, -1)); }
 char * RoutingTable::getNamePointerFromName(char * destinationName, int peerBleDeviceIndex) {
 	int routingTableIndex = getIndexFromName(destinationName, peerBleDeviceIndex);
-	return (index >=0 ? _routingTable[routingTableIndex].destinationName : NULL);
+	return (routingTableIndex >= 0 ? _routingTable[routingTableIndex].destinationName : NULL);
 }
 
 
@@ -3,115 +3,365 @@
 
 // "send" only adds a message to the routing table, the sending happens later, but we keep this nomenclature for user convenience
 boolean BleStar::send(uint8_t * payload, int payloadLength, char * destination, uint16_t messageId, boolean isSystemMessage) {
-	return (mTable.addNewMessageToSend(
+	return (addNewMessageToSend(payload, payloadLength, destination, messageId, isSystemMessage, MESSAGE_PRIORITY_NORMAL));
+}
+
+// priority is one of MESSAGE_PRIORITY_..., and is kept on every hop to the destination.  OR MESSAGE_QOS_0 in for
+// samples that the next one replaces anyway: every hop then writes the chunks once and forgets the message
+boolean BleStar::send(uint8_t * payload, int payloadLength, char * destination, uint16_t messageId, boolean isSystemMessage, uint8_t priority) {
+	return (addNewMessageToSend(payload, payloadLength, destination, messageId, isSystemMessage,
+				priority & (COMPILED_MESSAGE_PRIORITY_MASK | COMPILED_MESSAGE_QOS0_BIT)));
+}
+
+// For short, time critical messages.  On every hop these go out ahead of normal messages, and a normal message that's
+// part way through is suspended between chunks until they're done
+boolean BleStar::sendUrgent(uint8_t * payload, int payloadLength, char * destination, uint16_t messageId) {
+	return (addNewMessageToSend(payload, payloadLength, destination, messageId, false, MESSAGE_PRIORITY_URGENT));
+}
+
+boolean BleStar::addNewMessageToSend(uint8_t * payload, int payloadLength, char * destination, uint16_t messageId, boolean isSystemMessage, uint8_t flags) {
+	char * destinationName = rTable.getNamePointerFromName(destination);
+	if (!isSystemMessage && getIsConflated(destinationName)) { flags |= COMPILED_MESSAGE_CONFLATE_BIT; }
+
+	Message * m = mTable.addNewMessageToSend(
 		payload,
 		payloadLength,
 		_thisDeviceName,
-		rTable.getNamePointerFromName(destination),
+		destinationName,
 		messageId,
-		isSystemMessage
-		)
-		!= NULL
-	);
+		isSystemMessage,
+		flags
+		);
+	if (m == NULL) { return false; }
+	if ((flags & COMPILED_MESSAGE_CONFLATE_BIT) != 0) { mTable.supersedeMessages(m); }
+	return true;
+}
+
+// Latest value wins.  Messages this device sends to a conflated destination carry COMPILED_MESSAGE_CONFLATE_BIT, and
+// on every hop (this one included) a newer one frees any older one from the same origin that is still queued.  Meant
+// for topics whose samples each replace the last, so a congested link only ever holds the newest of them
+boolean BleStar::setConflation(char * destination, boolean enabled) {
+	char * destinationName = rTable.getNamePointerFromName(destination);
+	for (int i = 0; i < _numberOfConflatedDestinations; i++) {
+		if (conflatedDestinations[i] != destinationName) { continue; }
+		if (!enabled) { conflatedDestinations[i] = conflatedDestinations[--_numberOfConflatedDestinations]; }
+		return true;
+	}
+	if (!enabled) { return true; }
+	if (_numberOfConflatedDestinations >= MAX_CONFLATED_DESTINATIONS) {
+		Log.e("Cannot conflate %s; already conflating max # destinations (%d)", destination, MAX_CONFLATED_DESTINATIONS);
+		return false;
+	}
+	conflatedDestinations[_numberOfConflatedDestinations++] = destinationName;
+	return true;
+}
+
+boolean BleStar::getIsConflated(char * destinationName) {
+	for (int i = 0; i < _numberOfConflatedDestinations; i++) {
+		if (conflatedDestinations[i] == destinationName) { return true; }
+	}
+	return false;
 }
 
 
 void BleStar::pollSendingMessages() {
-	Bluefruit.Scanner.stop();
+	scheduleScanning(false);
+	pollSuspendedTransfers();
 
-	// First find if there are any bleDevices not currently sending a message, and if so, try to find a message that needs to be sent
+	// First fill any idle channels on each link with messages waiting for that hop, then write what each link can take.
+	// Only system and urgent messages take the last BLE_LINK_CHANNELS_KEPT_FOR_URGENT idle channels, so an urgent
+	// message always has a channel to start on straight away
 	for (int i = BLE_PERIPHERAL_INDEX; i < _numberOfBleCentralConnections + BLE_CENTRAL_INDEX_0; i++) {
 		BleDeviceTable * bleDevice = &bleDeviceTable[i];
-		if (bleDevice->isConnected && bleDevice->messageBeingSent == NULL) {
-			Message * m = mTable.findNextAvailableMessageForHop(bleDevice->peerName);
-			if (m != NULL) { assignMessageToBleDevice(m, bleDevice); }
+		if (!bleDevice->isConnected) { continue; }
+		bleDevice->writer.beginPass();
+		if (!bleDevice->capabilitiesSent) { bleDevice->capabilitiesSent = sendLinkCapabilities(bleDevice); }
+		if (bleDevice->hasPeerCapabilities) { resumeSuspendedTransfers(bleDevice); }
+		pollLinkHeartbeat(bleDevice);
+		if (_coalesceLingerMillis > 0) { coalesceMessagesForHop(bleDevice); }
+		int idleChannels = 0;
+		for (int j = 0; j < BLE_LINK_CHANNELS; j++) {
+			if (bleDevice->sendChannel[j].messageBeingSent == NULL) { idleChannels++; }
 		}
-		if (bleDevice->messageBeingSent != NULL) {
-			pollSendingMessage(bleDevice);
+		for (int j = 0; j < BLE_LINK_CHANNELS; j++) {
+			BleSendChannel * channel = &bleDevice->sendChannel[j];
+			if (channel->messageBeingSent != NULL) { continue; }
+			Message * m = getNextMessageForHop(bleDevice, idleChannels > BLE_LINK_CHANNELS_KEPT_FOR_URGENT);
+			if (m == NULL) { break; }
+			assignMessageToSendChannel(m, bleDevice, channel);
+			idleChannels--;
 		}
+		pollSendingMessage(bleDevice);
+	}
+}
+
+// System messages go first, then urgent ones, each strictly.  The other classes share what's left by smooth weighted
+// round robin (MESSAGE_PRIORITY_WEIGHTS): every class with something waiting gains its weight in credit, and the
+// richest goes and pays back the total, so no class waiting is ever starved
+Message * BleStar::getNextMessageForHop(BleDeviceTable * bleDevice, boolean isWeightedClassAllowed) {
+	Message * m = mTable.findNextAvailableMessageForHop(bleDevice->peerName, MESSAGE_CLASS_SYSTEM);
+	if (m == NULL) { m = mTable.findNextAvailableMessageForHop(bleDevice->peerName, MESSAGE_PRIORITY_URGENT); }
+	if (m != NULL || !isWeightedClassAllowed) { return m; }
+
+	Message * waiting[MESSAGE_PRIORITY_CLASSES];
+	int totalWeight = 0;
+	int chosenClass = -1;
+	for (int i = 0; i < MESSAGE_PRIORITY_CLASSES; i++) {
+		waiting[i] = (MESSAGE_PRIORITY_WEIGHTS[i] > 0 ? mTable.findNextAvailableMessageForHop(bleDevice->peerName, i) : NULL);
+		if (waiting[i] == NULL) { continue; }
+		bleDevice->classCredit[i] += MESSAGE_PRIORITY_WEIGHTS[i];
+		totalWeight += MESSAGE_PRIORITY_WEIGHTS[i];
+		if (chosenClass < 0 || bleDevice->classCredit[i] > bleDevice->classCredit[chosenClass]) { chosenClass = i; }
 	}
-	Bluefruit.Scanner.start(0);
+	if (chosenClass < 0) { return NULL; }
+	bleDevice->classCredit[chosenClass] -= totalWeight;
+	return waiting[chosenClass];
 }
 
-void BleStar::assignMessageToBleDevice(Message * m, BleDeviceTable * bleDevice) {
-	resetSendMessage(bleDevice);
-	bleDevice->messageBeingSent = m;
-	bleDevice->sendBuffer = m->getMessageBuilder();
-	bleDevice->sendBuffer->setReadIndex(0);
-	bleDevice->sendChunkInProgress = 0;
-	bleDevice->sendChunksExpected = getNumberOfChunksForMessageLength(bleDevice->sendBuffer->getLength());
-	bleDevice->indexWithinSendChunk = 0;
-	bleDevice->sendAttempts = 0;
-	bleDevice->lastSendTime = 0;
-	bleDevice->sendChunkResendRequested = false;
+void BleStar::assignMessageToSendChannel(Message * m, BleDeviceTable * bleDevice, BleSendChannel * channel) {
+	resetSendChannel(channel);
+	updateFailoverTime(m, bleDevice);
+	m->setMessageType(MESSAGE_TYPE_HOP_SENDING);								// so it isn't handed to another channel as well
+	channel->messageBeingSent = m;
+	channel->sendBuffer = m->getMessageBuilder();
+	channel->sendBuffer->setReadIndex(0);
+	updateChunkLength(bleDevice);												// chunk size only ever changes between messages
+	channel->chunkLength = getSendChunkLength(bleDevice);
+	channel->priority = (m->getPriority() == MESSAGE_PRIORITY_URGENT ? MESSAGE_PRIORITY_URGENT : MESSAGE_PRIORITY_NORMAL);	// only urgent interrupts between chunks
+	channel->fecGroupSize = getFecGroupSizeForLink(bleDevice);
+	channel->sendParityCoveredTo = 0;
+	channel->sendParityChunkCount = 0;
+	channel->sendChunksExpected = getNumberOfChunksForMessageLength(channel->sendBuffer->getLength(), channel->chunkLength);
+	channel->sendAttempts = 0;
+	channel->lastSendTime = 0;
+	channel->sendResendFromChunk = 0;
+	channel->sendChunksAcknowledged = 0;
+	channel->sendHasRetransmitted = false;
+	for (int i = 0; i < channel->sendChunksExpected; i++) { setChunkNotSent(channel, i); }
 }
 
 void BleStar::pollSendingMessage(BleDeviceTable * bleDevice) {
+	for (int i = 0; i < BLE_LINK_CHANNELS; i++) {
+		if (bleDevice->sendChannel[i].messageBeingSent != NULL) { updateSendChannel(bleDevice, &bleDevice->sendChannel[i]); }
+	}
+
+	// A chunk the TX FIFO only partly took must be finished before any other channel writes
+	if (bleDevice->channelMidChunk != NO_CHANNEL) {
+		if (writeNextChunk(bleDevice, &bleDevice->sendChannel[bleDevice->channelMidChunk]) != CHUNK_WRITE_COMPLETE) { return; }
+	}
+
+	// Urgent channels have the link to themselves until they've nothing left to write; normal channels, suspended at a
+	// chunk boundary meanwhile, then carry on from their own sendChunkInProgress
+	if (writeChunksRoundRobin(bleDevice, MESSAGE_PRIORITY_URGENT) == CHUNK_WRITE_BLOCKED) { return; }
+	writeChunksRoundRobin(bleDevice, MESSAGE_PRIORITY_NORMAL);
+}
 
-	setBleWriteDevice(bleDevice->index);
-
-	if (bleDevice->sendChunkInProgress == bleDevice->sendChunksExpected) {
-		if (bleDevice->sendChunkResendRequested) {
-			bleDevice->sendChunkInProgress = 0;
-			bleDevice->indexWithinSendChunk = 0;
-			bleDevice->sendChunkResendRequested = false;
-		} else {
-			// Check timeout
-			if ((millis() - bleDevice->lastSendTime > DELAY_FOR_ACK[bleDevice->sendAttempts]) || (bleDevice->lastSendTime > millis())) {
-				bleDevice->sendChunkInProgress = 0;
-				bleDevice->indexWithinSendChunk = 0;
-				if (bleDevice->sendAttempts++ > DEFAULT_MAX_HOP_ATTEMPTS) {
-					Log.w("Max send attempts for messageID %d hit, aborting", bleDevice->messageBeingSent->getMessageId());
-					failAndClearAnyMessagesBeingSent(bleDevice);
-					return;
-				}
-			}
+// A chunk at a time from each channel of this priority in turn, until the pacer or the FIFO says stop or nothing's left
+int BleStar::writeChunksRoundRobin(BleDeviceTable * bleDevice, uint8_t priority) {
+	int channelsWithNothingToSend = 0;
+	while (channelsWithNothingToSend < BLE_LINK_CHANNELS) {
+		BleSendChannel * channel = &bleDevice->sendChannel[bleDevice->nextSendChannel];
+		bleDevice->nextSendChannel = (bleDevice->nextSendChannel + 1) % BLE_LINK_CHANNELS;
+		int result = (channel->priority == priority ? writeNextChunk(bleDevice, channel) : CHUNK_WRITE_NOTHING_TO_SEND);
+		switch (result) {
+			case CHUNK_WRITE_BLOCKED: return CHUNK_WRITE_BLOCKED;
+			case CHUNK_WRITE_NOTHING_TO_SEND: channelsWithNothingToSend++; break;
+			default: channelsWithNothingToSend = 0; break;
 		}
 	}
+	return CHUNK_WRITE_NOTHING_TO_SEND;
+}
+
+// Completion, resend requests and ACK timeouts for one channel.  None of these act on a chunk that's part written
+void BleStar::updateSendChannel(BleDeviceTable * bleDevice, BleSendChannel * channel) {
+	if (channel->indexWithinSendChunk > 0) { return; }
+
+	if (channel->sendChunksAcknowledged == channel->sendChunksExpected) {
+		Log.i("Message %d delivered to %s", channel->messageBeingSent->getMessageId(), bleDevice->peerName);
+		deltaMessageDelivered(channel->messageBeingSent);
+		resetSendChannel(channel);
+		return;
+	}
 
-	while (bleDevice->sendChunkInProgress < bleDevice->sendChunksExpected) {
-		if (getChunkNeedsToBeSent(bleDevice, bleDevice->sendChunkInProgress)) {
-
-			int readIndex = (getMessageBuilderIndexForChunkNumber(bleDevice->sendChunkInProgress)
-							+ (bleDevice->indexWithinSendChunk > 0 ? bleDevice->indexWithinSendChunk - 1 : 0)
-						);
-			bleDevice->sendBuffer->setReadIndex(readIndex);
-
-			while(bleDevice->indexWithinSendChunk < MAX_BLE_CHUNK_LENGTH) {
-				if (writeToBleDevice(bleDevice->indexWithinSendChunk == 0 ? bleDevice->sendChunkInProgress : bleDevice->sendBuffer->read()) == 1) {
-					bleDevice->indexWithinSendChunk++;
-				} else {
-					// change rate limiter when i have one
-					break;
-				}
-			}
-
-			if (bleDevice->indexWithinSendChunk == MAX_BLE_CHUNK_LENGTH) {					// then entire chunk was sent
-				setChunkSent(bleDevice, bleDevice->sendChunkInProgress);
-				bleDevice->indexWithinSendChunk = 0;
-				bleDevice->sendChunkInProgress++;
-
-			} else {
-				// the send buffer is full
-				break;
-			}
-			bleDevice->lastSendTime = millis();
-		} else {
-			bleDevice->sendChunkInProgress++;
+	if (channel->messageBeingSent->getIsQos0()) {								// no ACK is coming, and nothing is resent
+		if (channel->sendChunkInProgress == channel->sendChunksExpected && channel->sendParityChunkCount == 0) {
+			bleDevice->qos0MessagesSent++;
+			resetSendChannel(channel);											// frees its messageTable entry
 		}
+		return;
 	}
 
-	if (bleDevice->sendChunkInProgress == bleDevice->sendChunksExpected) {
-		bleDevice->sendAttempts++;
+	if (channel->sendAttempts > DEFAULT_MAX_HOP_ATTEMPTS) {
+		Log.w("Max send attempts for messageID %d hit, aborting", channel->messageBeingSent->getMessageId());
+		failAndClearSendChannel(bleDevice, channel);
+		return;
+	}
+
+	// Holes reported by a SACK go out before any new chunk
+	if (channel->sendChunkResendRequested) {
+		channel->sendChunkInProgress = min(channel->sendChunkInProgress, channel->sendResendFromChunk);
+		channel->sendChunkResendRequested = false;
+	}
+
+	// Every chunk has gone out at least once, or the congestion window is shut with this channel's chunks in it.  Wait
+	// for the ACK (or a SACK naming holes), which the peer may hold for up to DELAYED_ACK_MILLIS for a chunk to carry
+	// it; if neither arrives, go back to the first chunk not known to have arrived.  A shut window alone needs this too:
+	// if chunk 0 was lost the receiver has no message on the channel to answer a SACK_REQUEST for
+	if (channel->sendChunkInProgress == channel->sendChunksExpected
+			|| (channel->sendChunkInProgress > channel->sendChunksAcknowledged && getChunksInFlight(bleDevice) >= bleDevice->congestionWindow)) {
+		if ((millis() - channel->lastSendTime <= bleDevice->rtt.getRto() + DELAYED_ACK_MILLIS) && (channel->lastSendTime <= millis())) { return; }
+		if (++channel->sendAttempts > DEFAULT_MAX_HOP_ATTEMPTS) { return; }	// fails on the next pass
+		if (channel->isResuming) {												// the RESUME or its answer was lost
+			sendResume(bleDevice, channel);
+			channel->lastSendTime = millis();
+			return;
+		}
+		bleDevice->rtt.backOff();
+		shrinkCongestionWindow(bleDevice, false);
+		channel->sendHasRetransmitted = true;
+		Log.v("ACK timeout from %s; RTO now %lu ms", bleDevice->peerName, (unsigned long)bleDevice->rtt.getRto());
+		for (int i = channel->sendChunksAcknowledged; i < channel->sendChunksExpected; i++) { setChunkNotSent(channel, i); }
+		channel->sendChunkInProgress = channel->sendChunksAcknowledged;
 	}
 }
 
+// Writes (or finishes writing) the next chunk this channel needs to send
+int BleStar::writeNextChunk(BleDeviceTable * bleDevice, BleSendChannel * channel) {
+	if (channel->messageBeingSent == NULL) { return CHUNK_WRITE_NOTHING_TO_SEND; }
+	if (channel->indexWithinSendChunk == 0 && channel->sendAttempts > DEFAULT_MAX_HOP_ATTEMPTS) { return CHUNK_WRITE_NOTHING_TO_SEND; }	// failed, and updateSendChannel clears it next
+	if (channel->sendParityChunkCount > 0) { return (writeParityChunk(bleDevice, channel)); }
 
-int BleStar::getNumberOfChunksForMessageLength(int messageLength) {
-	return (messageLength > MAX_BLE_CHUNK_LENGTH ? (messageLength - MAX_BLE_CHUNK_LENGTH) / (MAX_BLE_CHUNK_LENGTH - 1) + 1 : 1);
+	if (channel->indexWithinSendChunk == 0) {
+		while (channel->sendChunkInProgress < channel->sendChunksExpected && !getChunkNeedsToBeSent(channel, channel->sendChunkInProgress)) {
+			channel->sendChunkInProgress++;										// already sent, and not reported missing
+		}
+	}
+	if (channel->sendChunkInProgress >= channel->sendChunksExpected) { return CHUNK_WRITE_NOTHING_TO_SEND; }
+
+	uint8_t * compiledMessage = channel->sendBuffer->getBuffer();
+	int messageLength = channel->sendBuffer->getLength();
+	uint8_t chunkNumber = (uint8_t)channel->sendChunkInProgress;
+	int chunkStart = getMessageBuilderIndexForChunkNumber(chunkNumber, channel->chunkLength);
+	int chunkEnd = min(messageLength, getMessageBuilderIndexForChunkNumber(chunkNumber + 1, channel->chunkLength));
+	uint8_t header[DATA_CHUNK_HEADER_LENGTH] = { (uint8_t)(DATA_CHUNK_MARKER | channel->channel), chunkNumber, (uint8_t)(chunkEnd - chunkStart) };
+	if (chunkNumber == 0) {
+		header[0] = (uint8_t)(FIRST_CHUNK_MARKER | channel->channel);
+		header[1] = (uint8_t)channel->chunkLength;								// so the receiver finds the same chunk boundaries
+	}
+	int frameLength = DATA_CHUNK_HEADER_LENGTH + chunkEnd - chunkStart;
+
+	if (channel->indexWithinSendChunk == 0) {
+		if (chunkEnd > getBytesAvailableToForward(compiledMessage, messageLength)) {
+			return CHUNK_WRITE_NOTHING_TO_SEND;									// cut through, and this chunk hasn't arrived from upstream yet
+		}
+		if (!bleDevice->writer.getCanStartChunk(frameLength)) { return CHUNK_WRITE_BLOCKED; }	// paced out for this pass
+		if (!channel->messageBeingSent->getIsQos0() && !getIsCongestionWindowOpen(bleDevice)) { return CHUNK_WRITE_BLOCKED; }
+	}
+
+	channel->indexWithinSendChunk += bleDevice->writer.writeChunk(
+			header,
+			DATA_CHUNK_HEADER_LENGTH,
+			&compiledMessage[chunkStart],
+			chunkEnd - chunkStart,
+			channel->indexWithinSendChunk
+		);
+
+	if (channel->indexWithinSendChunk < frameLength) {
+		bleDevice->channelMidChunk = channel->channel;							// the send buffer is full; the rest of this chunk goes next pass
+		return CHUNK_WRITE_BLOCKED;
+	}
+
+	bleDevice->channelMidChunk = NO_CHANNEL;
+	setChunkSent(channel, channel->sendChunkInProgress);
+	updateChunkLossRate(bleDevice);
+	if (channel->fecGroupSize > 0 && chunkNumber > channel->sendParityCoveredTo
+			&& (chunkNumber % channel->fecGroupSize == 0 || chunkNumber == channel->sendChunksExpected - 1)) {
+		channel->sendParityFromChunk = channel->sendParityCoveredTo + 1;		// a group has gone out for the first time, so its parity is next
+		channel->sendParityChunkCount = chunkNumber - channel->sendParityCoveredTo;
+		channel->sendParityCoveredTo = chunkNumber;
+	}
+	channel->indexWithinSendChunk = 0;
+	channel->sendChunkInProgress++;
+	channel->lastSendTime = millis();
+	if (channel->sendChunkInProgress == channel->sendChunksExpected && !channel->sendHasRetransmitted) {
+		channel->rttTimedSendTime = channel->lastSendTime;						// the receiver ACKs as soon as the last chunk completes the message
+	}
+	return CHUNK_WRITE_COMPLETE;
 }
-int BleStar::getMessageBuilderIndexForChunkNumber(int chunkNumber) {
-	return (chunkNumber > 0 ? MAX_BLE_CHUNK_LENGTH + (chunkNumber - 1) * (MAX_BLE_CHUNK_LENGTH - 1) : 0 );
+
+
+// Every chunk is a DATA_CHUNK_MARKER (with the channel number in its low bits), a chunk number and the payload length,
+// followed by up to chunkLength - DATA_CHUNK_HEADER_LENGTH bytes of the message.  Chunk 0 has a FIRST_CHUNK_MARKER and
+// the chunk length in place of its number, and its payload starts with the message's own '#'
+int BleStar::getNumberOfChunksForMessageLength(int messageLength, int chunkLength) {
+	int chunkPayloadLength = DATA_CHUNK_PAYLOAD_LENGTH(chunkLength);
+	return ((messageLength + chunkPayloadLength - 1) / chunkPayloadLength);		// rounds up
+}
+int BleStar::getMessageBuilderIndexForChunkNumber(int chunkNumber, int chunkLength) {
+	return (chunkNumber * DATA_CHUNK_PAYLOAD_LENGTH(chunkLength));
+}
+
+// The ATT MTU is negotiated by the central shortly after connecting, so the chunk length is read again before each message
+// rather than once at connection time.  Both ends of a link see the same MTU, so they agree on the chunk boundaries
+int BleStar::getChunkLengthForConnection(uint16_t connectionHandle) {
+	if (connectionHandle == BLE_CONN_HANDLE_INVALID) { return MAX_BLE_CHUNK_LENGTH; }
+	BLEConnection * connection = Bluefruit.Connection(connectionHandle);
+	if (connection == NULL) { return MAX_BLE_CHUNK_LENGTH; }
+	int chunkLength = (int)connection->getMtu() - BLE_ATT_HEADER_LENGTH;
+	return (max(MAX_BLE_CHUNK_LENGTH, min(MAX_NEGOTIATED_BLE_CHUNK_LENGTH, chunkLength)));
+}
+
+// Small chunks lose less to each resend, and large ones less to headers, so the chunk length a link sends new messages
+// in follows how many of its chunks are being lost.  Never below MAX_BLE_CHUNK_LENGTH, as chunk 0 must hold all that
+// the message's CRC8 covers
+int BleStar::getSendChunkLength(BleDeviceTable * bleDevice) {
+	return (max(MAX_BLE_CHUNK_LENGTH, bleDevice->chunkLength >> bleDevice->chunkLengthTier));
+}
+
+// Called for every chunk sent.  Lost chunks are the ones SACKs and NACKs report, so the rate lags a little
+void BleStar::updateChunkLossRate(BleDeviceTable * bleDevice) {
+	if (++bleDevice->chunksSentInWindow < CHUNK_LOSS_WINDOW) { return; }
+	int windowPermille = min(1000, bleDevice->chunksLostInWindow * 1000 / bleDevice->chunksSentInWindow);
+	bleDevice->chunkLossPermille = (bleDevice->chunkLossPermille * 3 + windowPermille) / 4;
+	bleDevice->chunksSentInWindow = 0;
+	bleDevice->chunksLostInWindow = 0;
+
+	int tier = bleDevice->chunkLengthTier;
+	if (bleDevice->chunkLossPermille > CHUNK_LOSS_STEP_DOWN_PERMILLE && tier < CHUNK_LENGTH_TIERS - 1
+			&& getSendChunkLength(bleDevice) > MAX_BLE_CHUNK_LENGTH) {
+		tier++;
+	} else if (bleDevice->chunkLossPermille < CHUNK_LOSS_STEP_UP_PERMILLE && tier > 0) {
+		tier--;
+	}
+	if (tier != bleDevice->chunkLengthTier) {
+		bleDevice->chunkLengthTier = tier;
+		Log.v("Chunk loss to %s %d/1000; new messages go in %d byte chunks", bleDevice->peerName, bleDevice->chunkLossPermille,
+				getSendChunkLength(bleDevice));
+	}
+}
+
+// Until the writer has measured the link, assume it moves a full notification queue of default length chunks per
+// connection event
+uint32_t BleStar::getInitialDrainRateForConnection(uint16_t connectionHandle) {
+	uint32_t connectionIntervalMillis = getInitialRttForConnection(connectionHandle) / 2;
+	return ((uint32_t)MAX_BLE_CHUNK_LENGTH * CONNECTION_HVN_QUEUE_SIZE * 1000 / max((uint32_t)1, connectionIntervalMillis));
+}
+
+// Until a link has been measured, assume a chunk and its answer each take a connection event
+uint32_t BleStar::getInitialRttForConnection(uint16_t connectionHandle) {
+	if (connectionHandle == BLE_CONN_HANDLE_INVALID) { return RTT_DEFAULT_INITIAL_MILLIS; }
+	BLEConnection * connection = Bluefruit.Connection(connectionHandle);
+	if (connection == NULL || connection->getConnectionInterval() == 0) { return RTT_DEFAULT_INITIAL_MILLIS; }
+	return ((uint32_t)connection->getConnectionInterval() * 5 / 4 * 2);				// interval is in units of 1.25 ms
+}
+
+void BleStar::updateChunkLength(BleDeviceTable * bleDevice) {
+	int chunkLength = getChunkLengthForConnection(bleDevice->connectionHandle);
+	if (chunkLength != bleDevice->chunkLength) {
+		Log.i("Chunk length for %s changed from %d to %d bytes", bleDevice->peerName, bleDevice->chunkLength, chunkLength);
+		bleDevice->chunkLength = chunkLength;
+	}
+	bleDevice->writer.setNotificationLength(chunkLength);
 }
 
 boolean BleStar::sendRawToBleDevice(uint8_t * buffer, int bufferLength, char * destinationDevice) {
@@ -124,42 +374,27 @@ boolean BleStar::sendRawToBleDevice(uint8_t * buffer, int bufferLength, char * d
 	return (sendRawToBleDevice(buffer, bufferLength, bleDeviceIndex));
 }
 
+// Never waits: if the TX FIFO is full the frame is queued in the link's writer and goes out ahead of the next chunk
 boolean BleStar::sendRawToBleDevice(uint8_t * buffer, int bufferLength, int bleDeviceIndex) {
-	setBleWriteDevice(bleDeviceIndex);
-	Bluefruit.Scanner.stop();
-
-	for (int i = 0; i < bufferLength; i++) {
-		int sendFailures = 0;
-		while (writeToBleDevice(*buffer) == 0) {
-			delay(1);
-			if (sendFailures++ > 5) {
-				Bluefruit.Scanner.start(0);
-				return false;
-			}
-		}
-		buffer++;
+	if (!bleDeviceTable[bleDeviceIndex].writer.writeFrame(buffer, bufferLength)) {
+		Log.w("Error: control frame queue for %s full; frame dropped", bleDeviceTable[bleDeviceIndex].peerName);
+		return false;
 	}
-	Bluefruit.Scanner.start(0);
 	return (true);
 }
 
-
-void BleStar::setBleWriteDevice(int bleDeviceIndex) {
-	bleWriteDeviceIndex = bleDeviceIndex;
-	if (bleDeviceIndex > BLE_PERIPHERAL_INDEX) {
-		bcct = &bleCentralConnectionTable[bleDeviceIndex - BLE_CENTRAL_INDEX_0];
-	}
-}
-
-int BleStar::writeToBleDevice(uint8_t u) {
-	return (bleWriteDeviceIndex == BLE_PERIPHERAL_INDEX ? thisDeviceAsPeripheralUart.write(u) : bcct->bleCentralUart.write(u));
+void BleStar::failAndClearAnyMessagesBeingSent(BleDeviceTable * bleDevice) {
+	for (int i = 0; i < BLE_LINK_CHANNELS; i++) { failAndClearSendChannel(bleDevice, &bleDevice->sendChannel[i]); }
+	bleDevice->channelMidChunk = NO_CHANNEL;
 }
 
-void BleStar::failAndClearAnyMessagesBeingSent(BleDeviceTable * bleDevice) {
-	if (bleDevice->messageBeingSent != NULL) {
+void BleStar::failAndClearSendChannel(BleDeviceTable * bleDevice, BleSendChannel * channel) {
+	if (channel->messageBeingSent != NULL) {
+		if (channel->messageBeingSent->getIsQos0()) { bleDevice->qos0MessagesDropped++; }
 		Log.w("Message currently being sent by device %s will be discarded:", bleDevice->peerName);
-		if (Log.getLoggingLevel() >= Log.WARN) { bleDevice->sendBuffer->printEntireMessage(); }
-		fireTransmissionFailedCallback(bleDevice->messageBeingSent->getMessageId());
+		if (Log.getLoggingLevel() >= Log.WARN) { channel->sendBuffer->printEntireMessage(); }
+		deltaMessageFailed(channel->messageBeingSent);
+		fireTransmissionFailedCallbacks(channel->messageBeingSent);
 	}
-	resetSendMessage(bleDevice);
+	resetSendChannel(channel);
 }
@@ -7,77 +7,256 @@
 	They are usually short, and there is no guaranteed delivery or follow-up
 	Assured when they are sent
 
+	ACK and NACK are link control frames (see below), built on the stack and
+	dispatched on their opcode, so the ACK path never touches the heap and no
+	unformed text message can be mistaken for one
 */
 
-// Intercepts unformed messages and checks whether they are system messages
-// (ACK, NACK, RESEND......)
+void BleStar::sendAck(BleDeviceTable * bleDevice, BleReceiveChannel * channel) {
+	uint16_t crc16 = channel->messageBeingReceived->getStoredMessageCrc16();
+	uint8_t frame[LINK_CONTROL_FRAME_HEADER_LENGTH + ACK_BODY_LENGTH] = {
+		LINK_CONTROL_FRAME_MARKER,
+		LINK_CONTROL_ACK,
+		ACK_BODY_LENGTH,
+		(uint8_t)channel->channel,
+		(uint8_t)(crc16 / 256),
+		(uint8_t)(crc16 & 0xFF)
+	};
+	sendDeferrableToBleDevice(bleDevice, frame, sizeof(frame));
+}
+
+void BleStar::sendNack(BleDeviceTable * bleDevice, BleReceiveChannel * channel) {
+	uint8_t frame[LINK_CONTROL_FRAME_HEADER_LENGTH + NACK_BODY_LENGTH] = {
+		LINK_CONTROL_FRAME_MARKER,
+		LINK_CONTROL_NACK,
+		NACK_BODY_LENGTH,
+		(uint8_t)channel->channel
+	};
+	sendDeferrableToBleDevice(bleDevice, frame, sizeof(frame));
+}
 
-boolean BleStar::isShortIncomingSystemMessage(BleDeviceTable * bleDevice) {
-	if (strstr((char *)bleDevice->receiveBuffer->getBuffer(), STRING_ACK) != NULL) {
-		bleDevice->messageBeingReceived->setMessageType(MESSAGE_TYPE_NONE);
-		return true;
+void BleStar::processAck(BleDeviceTable * bleDevice, uint8_t * body, int bodyLength) {
+	if (bodyLength < ACK_BODY_LENGTH || body[0] >= BLE_LINK_CHANNELS) { return; }
+	BleSendChannel * channel = &bleDevice->sendChannel[body[0]];
+	if (channel->messageBeingSent == NULL) { return; }
+	if (body[1] * 256 + body[2] != channel->messageBeingSent->getStoredMessageCrc16()) { return; }	// late ACK for an earlier message
+
+	if (channel->rttTimedSendTime != 0 && !channel->sendHasRetransmitted) {	// updateSendChannel finishes the message off
+		bleDevice->rtt.addSample(millis() - channel->rttTimedSendTime);
 	}
+	if (!channel->sendHasRetransmitted) { growCongestionWindow(bleDevice, channel->sendChunksExpected - channel->sendChunksAcknowledged); }
+	channel->rttTimedSendTime = 0;
+	for (int i = 0; i < channel->sendChunksExpected; i++) { setChunkSent(channel, i); }
+	channel->sendChunksAcknowledged = channel->sendChunksExpected;
+	channel->sendChunkResendRequested = false;
+}
+
+// No crc16 in a NACK, as the receiver's copy of the header may be what was damaged
+void BleStar::processNack(BleDeviceTable * bleDevice, uint8_t * body, int bodyLength) {
+	if (bodyLength < NACK_BODY_LENGTH || body[0] >= BLE_LINK_CHANNELS) { return; }
+	BleSendChannel * channel = &bleDevice->sendChannel[body[0]];
+	if (channel->messageBeingSent == NULL) { return; }
 
-	if (strstr((char *)bleDevice->receiveBuffer->getBuffer(), STRING_NACK) != NULL) {
-		if (bleDevice->messageBeingSent->getSendAttempts() >= bleDevice->messageBeingSent->getMaxSendAttempts()) {
-			Log.w("Max send attempts for messageID %d hit, aborting", bleDevice->messageBeingSent->getMessageId());
-			fireTransmissionFailedCallback(bleDevice->messageBeingSent->getMessageId());
-			failAndClearAnyMessagesBeingSent(bleDevice);
-			return true;
+	channel->isResuming = false;
+	bleDevice->chunksLostInWindow++;											// at least one chunk arrived corrupt
+	shrinkCongestionWindow(bleDevice, false);
+	// the receiver threw the whole message away, so send it again from chunk 0.  updateSendChannel gives up once
+	// sendAttempts passes the limit, as this channel may be part way through writing a chunk right now
+	channel->sendAttempts++;
+	channel->sendHasRetransmitted = true;
+	for (int i = 0; i < channel->sendChunksExpected; i++) { setChunkNotSent(channel, i); }
+	channel->sendChunksAcknowledged = 0;
+	channel->sendResendFromChunk = 0;
+	channel->sendChunkResendRequested = true;
+}
+
+// Delayed ACK.  If this device has chunks waiting to go to the peer as well, the frame waits for the next of them, and
+// rides in the spare end of its notification rather than taking one of its own.  A chunk without room sends it
+// straight after itself, so it's never held up by more than one chunk, or DELAYED_ACK_MILLIS if no chunk comes.  If
+// every channel is idle or only waiting for its own ACK, or the congestion window is full, nothing is coming to carry
+// it, so it goes now
+void BleStar::setDelayedAck(boolean enabled) {
+	_isDelayedAck = enabled;
+}
+
+void BleStar::sendDeferrableToBleDevice(BleDeviceTable * bleDevice, uint8_t * buffer, int bufferLength) {
+	boolean isWindowOpen = (getChunksInFlight(bleDevice) < bleDevice->congestionWindow);
+	for (int i = 0; i < BLE_LINK_CHANNELS && _isDelayedAck && isWindowOpen; i++) {
+		BleSendChannel * channel = &bleDevice->sendChannel[i];
+		if (channel->messageBeingSent == NULL) { continue; }
+		if (channel->sendChunkInProgress < channel->sendChunksExpected || channel->sendChunkResendRequested) {
+			if (!bleDevice->writer.deferFrame(buffer, bufferLength, DELAYED_ACK_MILLIS)) {
+				Log.w("Error: control frame queue for %s full; frame dropped", bleDevice->peerName);
+			}
+			return;
 		}
-		// resend message
-	}
-	if (strstr((char *)bleDevice->receiveBuffer->getBuffer(), STRING_RESEND) != NULL) {
-		char * b = strstr((char *)bleDevice->receiveBuffer->getBuffer(), ":") + 1;
-		while (* b >= 48) { setChunkNotSent(bleDevice, *b++ - 48); }
-		bleDevice->sendChunkResendRequested = true;
-		return true;
 	}
-	return false;
+	sendRawToBleDevice(buffer, bufferLength, bleDevice->index);
 }
 
-// Methods that send short, raw, unrouted messages between directly connected
-// devices (ACK, NACK, RESEND......)
 
-void BleStar::sendAck(BleDeviceTable * bleDevice) {
-	MessageBuilder mb(MAX_BLE_CHUNK_LENGTH);
-	mb.append(STRING_ACK);
-	sendRawToBleDevice(mb.getBuffer(), mb.getLength(), bleDevice->index);
-	return;
+// ---------------------------- Link control frames ----------------------------
+/*
+	Binary frames between adjacent devices: [LINK_CONTROL_FRAME_MARKER][opcode]
+	[body length][body].  The length is always in the header, so a frame can be
+	skipped even if its opcode isn't understood
+
+	LINK_CONTROL_ACK says a whole message arrived with a good crc16:
+		[channel][crc16 of message, 2 bytes]
+	LINK_CONTROL_NACK says it was thrown away, so the sender starts over:
+		[channel]
+
+	LINK_CONTROL_SACK reports receivedChunkFlags for the message being received
+	on one channel:
+		[channel][crc16 of message, 2 bytes][first missing chunk][chunks covered][bitmap]
+	Every chunk below the first missing chunk has arrived.  Bit i of the bitmap
+	(least significant bit first) is 1 if chunk (first missing chunk + i) is
+	still missing.  The crc16 ties the SACK to one message, so a late SACK can't
+	trigger resends of the next message
+
+	LINK_CONTROL_CAPABILITIES says what this end understands and what it will
+	send, so optional features can be switched on per link:
+		[LINK_CAPABILITY_... flags][parity group size this end sends with, 0 = none]
+	Each end sends it once the link is up.  The first time one arrives, ours is
+	sent again, in case the peer wasn't listening yet when it first went
+
+	LINK_CONTROL_CHUNK_CHECK_REQUEST and LINK_CONTROL_CHUNK_CHECKS find the
+	corrupt chunks of a message whose crc16 failed, see ChunkChecks.cpp
+
+	LINK_CONTROL_SACK_REQUEST and LINK_CONTROL_RECEIVE_OVERFLOW drive each
+	link's congestion window, see CongestionWindow.cpp
+
+	LINK_CONTROL_RESUME carries on with a message a disconnect cut off, see
+	ResumableTransfers.cpp
+
+	LINK_CONTROL_HEARTBEAT probes a link that has gone quiet, see
+	LinkFailure.cpp
+*/
+
+int BleStar::receiveLinkControlFrame(BleDeviceTable * bleDevice, uint8_t * frame, int length) {
+	if (length < LINK_CONTROL_FRAME_HEADER_LENGTH) { return 0; }
+	int bodyLength = frame[2];
+	int frameLength = LINK_CONTROL_FRAME_HEADER_LENGTH + bodyLength;
+	if (length < frameLength) { return 0; }
+
+	uint8_t * body = &frame[LINK_CONTROL_FRAME_HEADER_LENGTH];
+	switch (frame[1]) {
+		case LINK_CONTROL_ACK: processAck(bleDevice, body, bodyLength); break;
+		case LINK_CONTROL_NACK: processNack(bleDevice, body, bodyLength); break;
+		case LINK_CONTROL_SACK: processSelectiveAck(bleDevice, body, bodyLength); break;
+		case LINK_CONTROL_CAPABILITIES: processLinkCapabilities(bleDevice, body, bodyLength); break;
+		case LINK_CONTROL_CHUNK_CHECK_REQUEST: processChunkCheckRequest(bleDevice, body, bodyLength); break;
+		case LINK_CONTROL_CHUNK_CHECKS: processChunkChecks(bleDevice, body, bodyLength); break;
+		case LINK_CONTROL_SACK_REQUEST: processSackRequest(bleDevice, body, bodyLength); break;
+		case LINK_CONTROL_RECEIVE_OVERFLOW: processReceiveOverflow(bleDevice, body, bodyLength); break;
+		case LINK_CONTROL_RESUME: processResume(bleDevice, body, bodyLength); break;
+		case LINK_CONTROL_HEARTBEAT: processHeartbeat(bleDevice, body, bodyLength); break;
+		default: Log.w("Error: unknown link control frame %02X from %s; skipped", frame[1], bleDevice->peerName); break;
+	}
+	return frameLength;
 }
 
-void BleStar::sendNack(BleDeviceTable * bleDevice) {
-	MessageBuilder mb(MAX_BLE_CHUNK_LENGTH);
-	mb.append(STRING_NACK);
-	sendRawToBleDevice(mb.getBuffer(), mb.getLength(), bleDevice->index);
-	return;
+// Returns the first missing chunk reported
+int BleStar::sendSelectiveAck(BleDeviceTable * bleDevice, BleReceiveChannel * channel, int upToChunk) {
+	uint8_t frame[MAX_BLE_CHUNK_LENGTH];										// always fits a single notification, whatever the MTU
+	int bitmapCapacity = (MAX_BLE_CHUNK_LENGTH - LINK_CONTROL_FRAME_HEADER_LENGTH - SACK_BODY_HEADER_LENGTH) * 8;
+
+	int firstMissingChunk = 0;
+	while (firstMissingChunk < upToChunk && getChunkReceived(channel, firstMissingChunk)) { firstMissingChunk++; }
+	int chunksCovered = min(upToChunk - firstMissingChunk, bitmapCapacity);
+	int bitmapLength = (chunksCovered + 7) / 8;
+	uint16_t crc16 = channel->messageBeingReceived->getStoredMessageCrc16();
+
+	frame[0] = LINK_CONTROL_FRAME_MARKER;
+	frame[1] = LINK_CONTROL_SACK;
+	frame[2] = (uint8_t)(SACK_BODY_HEADER_LENGTH + bitmapLength);
+	frame[3] = (uint8_t)channel->channel;
+	frame[4] = (uint8_t)(crc16 / 256);
+	frame[5] = (uint8_t)(crc16 & 0xFF);
+	frame[6] = (uint8_t)firstMissingChunk;
+	frame[7] = (uint8_t)chunksCovered;
+
+	uint8_t * bitmap = &frame[LINK_CONTROL_FRAME_HEADER_LENGTH + SACK_BODY_HEADER_LENGTH];
+	memset(bitmap, 0, bitmapLength);
+	for (int i = 0; i < chunksCovered; i++) {
+		if (!getChunkReceived(channel, firstMissingChunk + i)) { bitmap[i / 8] |= bitSetArray[i % 8]; }
+	}
+
+	sendRawToBleDevice(frame, LINK_CONTROL_FRAME_HEADER_LENGTH + SACK_BODY_HEADER_LENGTH + bitmapLength, bleDevice->index);
+	channel->lastSackTime = millis();
+	channel->chunksSinceLastSack = 0;
+	channel->rttTimedSackTime = 0;											// anything still missing has now been asked for twice
+	return firstMissingChunk;
 }
 
-boolean BleStar::sendResendRequestSequence(BleDeviceTable * bleDevice, int fromChunk, int toChunkInclusive) {
-	int resendsRequested = 0;
-	MessageBuilder mb(MAX_BLE_CHUNK_LENGTH);
-	mb.append(STRING_RESEND);
-	for (uint8_t i = fromChunk; i < toChunkInclusive; i++) {
-		if (!getChunkReceived(bleDevice, i)) {
-			mb.append((uint8_t)(48+i));
-			bleDevice->lastResendRequestTime = millis();
-			resendsRequested++;
+void BleStar::processSelectiveAck(BleDeviceTable * bleDevice, uint8_t * body, int bodyLength) {
+	if (bodyLength < SACK_BODY_HEADER_LENGTH || body[0] >= BLE_LINK_CHANNELS) { return; }
+	BleSendChannel * channel = &bleDevice->sendChannel[body[0]];
+	if (channel->messageBeingSent == NULL) { return; }
+	if (body[1] * 256 + body[2] != channel->messageBeingSent->getStoredMessageCrc16()) { return; }	// late SACK for an earlier message
+
+	int firstMissingChunk = body[3];
+	int chunksCovered = min((int)body[4], (bodyLength - SACK_BODY_HEADER_LENGTH) * 8);
+	uint8_t * bitmap = &body[SACK_BODY_HEADER_LENGTH];
+	if (channel->isResuming) {													// the receiver had the message parked too
+		channel->isResuming = false;
+		bleDevice->transfersResumed++;
+	}
+
+	int chunksAcknowledged = 0;
+	if (firstMissingChunk > channel->sendChunksAcknowledged) {
+		chunksAcknowledged = min(firstMissingChunk, channel->sendChunksExpected) - channel->sendChunksAcknowledged;
+		channel->sendChunksAcknowledged += chunksAcknowledged;
+		channel->sendAttempts = 0;												// the receiver is making progress
+	}
+
+	boolean isLoss = false;
+	for (int i = 0; i < chunksCovered; i++) {
+		int chunkNumber = firstMissingChunk + i;
+		if (chunkNumber >= channel->sendChunksExpected) { break; }
+		if ((bitmap[i / 8] & bitSetArray[i % 8]) == 0) { continue; }
+		if (!channel->sendChunkResendRequested || chunkNumber < channel->sendResendFromChunk) {
+			channel->sendResendFromChunk = chunkNumber;
 		}
+		channel->sendChunkResendRequested = true;
+		if (!getChunkNeedsToBeSent(channel, chunkNumber)) {
+			channel->sendHasRetransmitted = true;
+			if (!getChunkCountedLost(channel, chunkNumber)) {						// SACKs repeat a hole until its resend arrives
+				setChunkCountedLost(channel, chunkNumber);
+				bleDevice->chunksLostInWindow++;
+				isLoss = true;
+			}
+		}
+		setChunkNotSent(channel, chunkNumber);
 	}
-	if (resendsRequested > 10) {
-		mb.reset();
-		mb.append(STRING_NACK);
+	if (isLoss) {
+		shrinkCongestionWindow(bleDevice, false);
+	} else if (!channel->sendHasRetransmitted) {
+		growCongestionWindow(bleDevice, chunksAcknowledged);
 	}
-	sendRawToBleDevice(mb.getBuffer(), mb.getLength(), bleDevice->index);
-	return (resendsRequested > 0);
 }
 
-void BleStar::sendResendRequest(BleDeviceTable * bleDevice, int chunkResendIndex) {
-	MessageBuilder mb(MAX_BLE_CHUNK_LENGTH);
-	mb.append(STRING_RESEND);
-	mb.append((uint8_t)(48+chunkResendIndex));
-	sendRawToBleDevice(mb.getBuffer(), mb.getLength(), bleDevice->index);
-	bleDevice->lastResendRequestTime = millis();
+
+
+boolean BleStar::sendLinkCapabilities(BleDeviceTable * bleDevice) {
+	uint8_t frame[LINK_CONTROL_FRAME_HEADER_LENGTH + CAPABILITIES_BODY_LENGTH] = {
+		LINK_CONTROL_FRAME_MARKER,
+		LINK_CONTROL_CAPABILITIES,
+		CAPABILITIES_BODY_LENGTH,
+		LINK_CAPABILITY_PARITY_CHUNKS | LINK_CAPABILITY_CHUNK_CHECKS | LINK_CAPABILITY_RESUMABLE_TRANSFERS | LINK_CAPABILITY_HEARTBEAT,
+		(uint8_t)getFecGroupSizeForLink(bleDevice)
+	};
+	return (sendRawToBleDevice(frame, sizeof(frame), bleDevice->index));
+}
+
+void BleStar::processLinkCapabilities(BleDeviceTable * bleDevice, uint8_t * body, int bodyLength) {
+	if (bodyLength < CAPABILITIES_BODY_LENGTH) { return; }
+	boolean isFirst = !bleDevice->hasPeerCapabilities;
+	bleDevice->hasPeerCapabilities = true;
+	bleDevice->peerCapabilities = body[0];
+	bleDevice->peerFecGroupSize = body[1];
+	Log.i("Link to %s: peer capabilities %02X, parity group size %d", bleDevice->peerName, body[0], body[1]);
+	if (isFirst && bleDevice->capabilitiesSent) { bleDevice->capabilitiesSent = sendLinkCapabilities(bleDevice); }
 }
 
 
@@ -107,6 +286,16 @@ void BleStar::processRoutedSystemMessage(Message * m) {
 		return;
 	}
 
+	if (strstr(payload, STRING_COALESCED) == payload) {
+		if (strcmp(m->getDestination(), _thisDeviceName) == 0) { unpackCoalescedMessage(m); }
+		return;
+	}
+
+	if (strstr(payload, STRING_KEYFRAME_REQUEST) == payload) {
+		if (strcmp(m->getDestination(), _thisDeviceName) == 0) { processKeyframeRequest(m); }
+		return;
+	}
+
 	Log.w("Error: routed system message found from %s, but not executed: %s", m->getOrigin(), (char *)m->getPayload());
 }
 
@@ -128,7 +317,8 @@ void BleStar::sendRoutingInformationUpstream(char * routingInformation) {
 		_thisDeviceName,
 		destination,															// null, so it just goes upstream
 		0,																		// messageId
-		true																	// isSystemMessage
+		true,																	// isSystemMessage
+		MESSAGE_PRIORITY_NORMAL
 	);
 	Log.i("New routing changes message: %s, added to message table", (char*)mb.getBuffer());
 }
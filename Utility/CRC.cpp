@@ -1,65 +1,91 @@
 #include "CRC.h"
 
 
-void CRC::initializeTables() {
-	initializeCrc8Table();
-	initializeCrc16Table();
-	crcTablesInitialized = true;
+// Compile time tables.  MakeCrcIndexes<256>::type is CrcIndexes<0, 1, ... 255>, which CrcTables expands into one
+// entry per index
+
+template <int... I> struct CrcIndexes {};
+template <int N, int... I> struct MakeCrcIndexes : MakeCrcIndexes<N - 1, N - 1, I...> {};
+template <int... I> struct MakeCrcIndexes<0, I...> { typedef CrcIndexes<I...> type; };
+
+constexpr uint8_t crc8Bits(uint8_t crc, int bits) {
+	return (bits == 0 ? crc : crc8Bits((uint8_t)((crc & 0x80) ? (crc << 1) ^ CRC_POLY_8 : crc << 1), bits - 1));
+}
+constexpr uint8_t crc8Entry(int slice, int i) {
+	return (slice == 0 ? crc8Bits((uint8_t)i, 8) : crc8Bits(crc8Entry(slice - 1, i), 8));
 }
 
-void CRC::initializeCrc8Table() {
-	const uint8_t generator = 0x1D;
-
-	for (int i = 0; i < 256; i++) {
-		uint8_t thisByte = (uint8_t) i;
-		for (uint8_t bit =0; bit < 8; bit++) {
-			if ((thisByte & 0x80) != 0) {
-				thisByte <<= 1;
-				thisByte ^= generator;
-			} else {
-				thisByte <<= 1;
-			}
-		}
-		crc8Table[i] = thisByte;
-	}
+constexpr uint16_t crc16Bits(uint16_t crc, int bits) {
+	return (bits == 0 ? crc : crc16Bits((uint16_t)((crc & 1) ? (crc >> 1) ^ CRC_POLY_16 : crc >> 1), bits - 1));
+}
+constexpr uint16_t crc16Entry(int slice, int i) {
+	return (slice == 0 ? crc16Bits((uint16_t)i, 8)
+			: (uint16_t)((crc16Entry(slice - 1, i) >> 8) ^ crc16Bits(crc16Entry(slice - 1, i) & 0xFF, 8)));
 }
 
-void CRC::initializeCrc16Table() {
-    uint16_t i;
-    uint16_t j;
-    uint16_t crc;
-    uint16_t c;
-    	for (i = 0; i < 256; i++) {
-    		crc = 0;
-    		c = i;
-    		for (j = 0; j < 8; j++) {
-    			if ( (crc ^ c) & 0x0001 ) {
-                    crc = ( crc >> 1 ) ^ CRC_POLY_16;
-                } else {
-                    crc =   crc >> 1;
-                }
-    			c = c >> 1;
-    		}
-    		crc16Table[i] = crc;
-    	}
+constexpr uint32_t crc32Bits(uint32_t crc, int bits) {
+	return (bits == 0 ? crc : crc32Bits((crc & 1) ? (crc >> 1) ^ CRC_POLY_32 : crc >> 1, bits - 1));
 }
+constexpr uint32_t crc32Entry(int slice, int i) {
+	return (slice == 0 ? crc32Bits((uint32_t)i, 8)
+			: (crc32Entry(slice - 1, i) >> 8) ^ crc32Bits(crc32Entry(slice - 1, i) & 0xFF, 8));
+}
+
+template <typename Indexes> struct CrcTables;
+template <int... I> struct CrcTables<CrcIndexes<I...>> {
+	static constexpr uint8_t crc8[CRC_SLICES][256] = {
+		{ crc8Entry(0, I)... }, { crc8Entry(1, I)... }, { crc8Entry(2, I)... }, { crc8Entry(3, I)... }
+	};
+	static constexpr uint16_t crc16[CRC_SLICES][256] = {
+		{ crc16Entry(0, I)... }, { crc16Entry(1, I)... }, { crc16Entry(2, I)... }, { crc16Entry(3, I)... }
+	};
+	static constexpr uint32_t crc32[CRC_SLICES][256] = {
+		{ crc32Entry(0, I)... }, { crc32Entry(1, I)... }, { crc32Entry(2, I)... }, { crc32Entry(3, I)... }
+	};
+};
+template <int... I> constexpr uint8_t CrcTables<CrcIndexes<I...>>::crc8[CRC_SLICES][256];
+template <int... I> constexpr uint16_t CrcTables<CrcIndexes<I...>>::crc16[CRC_SLICES][256];
+template <int... I> constexpr uint32_t CrcTables<CrcIndexes<I...>>::crc32[CRC_SLICES][256];
+
+typedef CrcTables<MakeCrcIndexes<256>::type> Tables;
+
 
 
 uint8_t CRC::getCrc8(uint8_t * messageToValidate, int messageLength) {
 	uint8_t crc8 = 0;
-	for (int i = 0; i < messageLength; i++) {
-		uint8_t data = (uint8_t)(messageToValidate[i] ^ crc8);
-		crc8 = (uint8_t)(crc8Table[data]);
+	uint8_t * data = messageToValidate;
+	for (; messageLength >= CRC_SLICES; messageLength -= CRC_SLICES, data += CRC_SLICES) {
+		crc8 = Tables::crc8[3][data[0] ^ crc8] ^ Tables::crc8[2][data[1]] ^ Tables::crc8[1][data[2]] ^ Tables::crc8[0][data[3]];
 	}
+	for (; messageLength > 0; messageLength--) { crc8 = Tables::crc8[0][*data++ ^ crc8]; }
 	return crc8;
 }
 
 
 uint16_t CRC::getCrc16(uint8_t * messageToValidate, int messageLength) {
-    uint16_t crc16 = CRC_START_MODBUS;
-    if (!crcTablesInitialized) { Serial.println("Checksum: Checksum table not initialized; getChecksum() called"); }
-    for (int i = 0; i < messageLength; i++) {
-		crc16 = (crc16 >> 8) ^ crc16Table[ (crc16 ^ (uint16_t) messageToValidate[i]) & 0x00FF ];
+	return (updateCrc16(CRC_START_MODBUS, messageToValidate, messageLength));
+}
+
+uint16_t CRC::updateCrc16(uint16_t crc16, uint8_t * data, int length) {
+	for (; length >= CRC_SLICES; length -= CRC_SLICES, data += CRC_SLICES) {
+		crc16 ^= (uint16_t)(data[0] | (data[1] << 8));
+		crc16 = Tables::crc16[3][crc16 & 0xFF] ^ Tables::crc16[2][crc16 >> 8] ^ Tables::crc16[1][data[2]] ^ Tables::crc16[0][data[3]];
+	}
+	for (; length > 0; length--) { crc16 = (crc16 >> 8) ^ Tables::crc16[0][(crc16 ^ *data++) & 0xFF]; }
+	return (crc16);
+}
+
+
+uint32_t CRC::getCrc32(uint8_t * messageToValidate, int messageLength) {
+	return (~updateCrc32(CRC_START_32, messageToValidate, messageLength));
+}
+
+uint32_t CRC::updateCrc32(uint32_t crc32, uint8_t * data, int length) {
+	for (; length >= CRC_SLICES; length -= CRC_SLICES, data += CRC_SLICES) {
+		crc32 ^= (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+		crc32 = Tables::crc32[3][crc32 & 0xFF] ^ Tables::crc32[2][(crc32 >> 8) & 0xFF]
+				^ Tables::crc32[1][(crc32 >> 16) & 0xFF] ^ Tables::crc32[0][crc32 >> 24];
 	}
-    return (crc16);
+	for (; length > 0; length--) { crc32 = (crc32 >> 8) ^ Tables::crc32[0][(crc32 ^ *data++) & 0xFF]; }
+	return (crc32);
 }
@@ -8,22 +8,29 @@
 #define CRC_START_MODBUS			0xFFFF
 #define	CRC_POLY_16					0xA001
 #define CRC_POLY_CCITT				0x1021
+#define CRC_POLY_8					0x1D
+#define CRC_START_32				0xFFFFFFFF
+#define CRC_POLY_32					0xEDB88320				// IEEE 802.3, reflected
+#define CRC_SLICES					4						// bytes each pass of the table loop takes in at once
 
 
+/*
+	Table driven CRCs.  The tables are generated by the compiler and are const, so they live in flash and need no
+	setup.  Each CRC has CRC_SLICES tables: table k gives the effect of a byte followed by k zero bytes, so a pass
+	takes CRC_SLICES bytes with independent lookups rather than a chain of dependent ones.
+
+	updateCrc16 and updateCrc32 continue a CRC over more bytes, so a message can be checked a piece at a time as it
+	arrives; start from CRC_START_MODBUS or CRC_START_32.  getCrc32 is only linked in if something uses it.
+*/
+
 class CRC {
 
 public:
-	static void initializeTables();
-	static void initializeCrc8Table();
-	static void initializeCrc16Table();
-
 	static uint8_t getCrc8(uint8_t * messageToCreateChecksum, int messageLength);
 	static uint16_t getCrc16(uint8_t * messageToCreateChecksum, int messageLength);
-
-private:
-	static boolean crcTablesInitialized;
-	static uint8_t crc8Table[256];
-	static uint16_t crc16Table[256];
+	static uint16_t updateCrc16(uint16_t crc16, uint8_t * data, int length);
+	static uint32_t getCrc32(uint8_t * messageToCreateChecksum, int messageLength);
+	static uint32_t updateCrc32(uint32_t crc32, uint8_t * data, int length);	// before the final inversion getCrc32 applies
 };
 
 #endif
@@ -0,0 +1,47 @@
+#include "Delta.h"
+
+
+int Delta::encode(uint8_t * base, uint8_t * input, int length, uint8_t * output, int outputCapacity) {
+	int inputIndex = 0;
+	int outputIndex = 0;
+
+	while (inputIndex < length) {
+		int unchanged = 0;
+		while (inputIndex + unchanged < length && unchanged < DELTA_MAX_RUN && input[inputIndex + unchanged] == base[inputIndex + unchanged]) {
+			unchanged++;
+		}
+		if (inputIndex + unchanged == length) { break; }						// the rest is unchanged
+
+		int changedStart = inputIndex + unchanged;
+		int changed = 0;
+		while (changedStart + changed < length && changed < DELTA_MAX_RUN) {
+			int i = changedStart + changed;
+			if (input[i] == base[i]) {											// a short unchanged run costs less than a new pair
+				if (i + 2 >= length || (input[i + 1] == base[i + 1] && input[i + 2] == base[i + 2])) { break; }
+			}
+			changed++;
+		}
+
+		if (outputIndex + 2 + changed > outputCapacity) { return -1; }
+		output[outputIndex++] = (uint8_t)unchanged;
+		output[outputIndex++] = (uint8_t)changed;
+		for (int i = changedStart; i < changedStart + changed; i++) { output[outputIndex++] = input[i] ^ base[i]; }
+		inputIndex = changedStart + changed;
+	}
+	return outputIndex;
+}
+
+boolean Delta::decode(uint8_t * base, int length, uint8_t * input, int inputLength, uint8_t * output) {
+	if (output != base) { memcpy(output, base, length); }
+
+	int inputIndex = 0;
+	int outputIndex = 0;
+	while (inputIndex < inputLength) {
+		if (inputIndex + 2 > inputLength) { return false; }
+		outputIndex += input[inputIndex++];
+		int changed = input[inputIndex++];
+		if (outputIndex + changed > length || inputIndex + changed > inputLength) { return false; }
+		while (changed-- > 0) { output[outputIndex++] ^= input[inputIndex++]; }
+	}
+	return true;
+}
@@ -0,0 +1,28 @@
+#ifndef Delta_h
+#define Delta_h
+
+#include "Arduino.h"
+
+#define DELTA_MAX_RUN							255					// each run length is a single byte
+
+
+/*
+	Delta codec for a payload against an earlier one of the same length.  The encoding is a list of pairs:
+
+		[bytes unchanged][bytes changed][changed bytes, each XORed with the earlier payload's]
+
+	Anything past the last pair is unchanged, so a payload identical to the earlier one encodes to nothing.
+	Unchanged runs shorter than a pair header are folded into the changed run around them.
+*/
+
+class Delta {
+
+public:
+	/// Returns the encoded length, or -1 if it would not fit in outputCapacity
+	static int encode(uint8_t * base, uint8_t * input, int length, uint8_t * output, int outputCapacity);
+
+	/// Rebuilds the payload into output (length bytes, as long as base).  Returns false if the encoding is malformed
+	static boolean decode(uint8_t * base, int length, uint8_t * input, int inputLength, uint8_t * output);
+};
+
+#endif
@@ -0,0 +1,74 @@
+#include "Lzss.h"
+
+uint16_t Lzss::hashHeads[LZSS_HASH_SIZE];
+
+
+int Lzss::compress(uint8_t * input, int inputLength, uint8_t * output, int outputCapacity) {
+	memset(hashHeads, 0, sizeof(hashHeads));
+
+	int inputIndex = 0;
+	int outputIndex = 0;
+	int flagIndex = 0;
+	int itemCount = 0;
+
+	while (inputIndex < inputLength) {
+		if (itemCount % 8 == 0) {
+			if (outputIndex >= outputCapacity) { return 0; }
+			flagIndex = outputIndex++;
+			output[flagIndex] = 0;
+		}
+
+		int matchLength = 0;
+		int matchOffset = 0;
+		if (inputIndex + LZSS_MIN_MATCH <= inputLength) {
+			uint8_t hash = getHash(&input[inputIndex]);
+			int candidate = hashHeads[hash] - 1;
+			hashHeads[hash] = (uint16_t)(inputIndex + 1);
+			if (candidate >= 0 && inputIndex - candidate <= LZSS_WINDOW_SIZE) {
+				int maxLength = min(LZSS_MAX_MATCH, inputLength - inputIndex);
+				while (matchLength < maxLength && input[candidate + matchLength] == input[inputIndex + matchLength]) { matchLength++; }
+				matchOffset = inputIndex - candidate;
+			}
+		}
+
+		if (matchLength >= LZSS_MIN_MATCH) {
+			if (outputIndex + 2 > outputCapacity) { return 0; }
+			output[outputIndex++] = (uint8_t)((matchOffset - 1) & 0xFF);
+			output[outputIndex++] = (uint8_t)((((matchOffset - 1) >> 8) << 4) | (matchLength - LZSS_MIN_MATCH));
+			output[flagIndex] |= (uint8_t)(1 << (itemCount % 8));
+			for (int i = 1; i < matchLength && inputIndex + i + LZSS_MIN_MATCH <= inputLength; i++) {
+				hashHeads[getHash(&input[inputIndex + i])] = (uint16_t)(inputIndex + i + 1);
+			}
+			inputIndex += matchLength;
+		} else {
+			if (outputIndex >= outputCapacity) { return 0; }
+			output[outputIndex++] = input[inputIndex++];
+		}
+		itemCount++;
+	}
+	return outputIndex;
+}
+
+
+int Lzss::decompress(uint8_t * input, int inputLength, uint8_t * output, int outputCapacity) {
+	int inputIndex = 0;
+	int outputIndex = 0;
+
+	while (inputIndex < inputLength) {
+		uint8_t flags = input[inputIndex++];
+		for (int bit = 0; bit < 8 && inputIndex < inputLength; bit++) {
+			if ((flags & (1 << bit)) == 0) {
+				if (outputIndex >= outputCapacity) { return -1; }
+				output[outputIndex++] = input[inputIndex++];
+				continue;
+			}
+			if (inputIndex + 2 > inputLength) { return -1; }
+			int matchOffset = (input[inputIndex] | ((input[inputIndex + 1] >> 4) << 8)) + 1;
+			int matchLength = (input[inputIndex + 1] & 0x0F) + LZSS_MIN_MATCH;
+			inputIndex += 2;
+			if (matchOffset > outputIndex || outputIndex + matchLength > outputCapacity) { return -1; }
+			for (int i = 0; i < matchLength; i++, outputIndex++) { output[outputIndex] = output[outputIndex - matchOffset]; }	// may overlap
+		}
+	}
+	return outputIndex;
+}
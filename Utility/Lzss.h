@@ -0,0 +1,35 @@
+#ifndef Lzss_h
+#define Lzss_h
+
+#include "Arduino.h"
+
+#define LZSS_MIN_MATCH							3
+#define LZSS_MAX_MATCH							18					// 4 bit length field
+#define LZSS_WINDOW_SIZE						4096				// 12 bit offset field
+#define LZSS_HASH_SIZE							256
+
+
+/*
+	Small LZSS codec for message payloads.  Each flag byte (least significant bit first) says whether each of the next
+	8 items is a literal byte (0) or a 2 byte back reference (1): 12 bits of offset - 1 and 4 bits of length - 3.
+
+	Both directions work straight out of the buffers they're given, so the only RAM used is a fixed table of
+	LZSS_HASH_SIZE positions for the compressor.  The compressor only tries the most recent position with the same
+	3 byte hash, which keeps it linear in the input length at some cost in ratio.
+*/
+
+class Lzss {
+
+public:
+	/// Returns the compressed length, or 0 if it would not fit in outputCapacity
+	static int compress(uint8_t * input, int inputLength, uint8_t * output, int outputCapacity);
+
+	/// Returns the expanded length, or -1 if the input is malformed or would not fit in outputCapacity
+	static int decompress(uint8_t * input, int inputLength, uint8_t * output, int outputCapacity);
+
+private:
+	static uint16_t hashHeads[LZSS_HASH_SIZE];									// position + 1 of the last input seen with each hash; 0 = none
+	static uint8_t getHash(uint8_t * input) { return ((uint8_t)((input[0] << 3) ^ (input[1] << 1) ^ input[2] ^ (input[0] >> 5))); }
+};
+
+#endif
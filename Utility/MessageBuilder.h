@@ -41,6 +41,7 @@ public:
 	void setWriteIndex(int i) { _writeIndex = max(0, min(_capacity, i)); }
 
 	uint8_t * getBuffer() { return buffer;}
+	void setBuffer(uint8_t * buf) { buffer = buf; }								// the contents have been moved here; lengths and indexes stay
 	boolean available();
 	uint8_t read();
 	uint8_t peek();
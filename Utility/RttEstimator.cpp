@@ -0,0 +1,32 @@
+#include "RttEstimator.h"
+
+
+void RttEstimator::reset(uint32_t initialRttMillis) {
+	_scaledSrtt = initialRttMillis << 3;
+	_scaledRttVar = initialRttMillis << 1;
+	_sampleCount = 0;
+	_backoffShift = 0;
+}
+
+void RttEstimator::addSample(uint32_t rttMillis) {
+	if (_sampleCount++ == 0) {													// first measurement replaces the seeded guess
+		_scaledSrtt = rttMillis << 3;
+		_scaledRttVar = rttMillis << 1;
+	} else {
+		int32_t error = (int32_t)rttMillis - (int32_t)(_scaledSrtt >> 3);
+		_scaledSrtt += error;													// SRTT += (R - SRTT) / 8
+		if (error < 0) { error = -error; }
+		_scaledRttVar += error - (int32_t)(_scaledRttVar >> 2);					// RTTVAR += (|R - SRTT| - RTTVAR) / 4
+	}
+	_backoffShift = 0;															// a fresh sample means the link is answering again
+}
+
+void RttEstimator::backOff() {
+	if (_backoffShift < RTT_MAX_BACKOFF_SHIFT) { _backoffShift++; }
+}
+
+uint32_t RttEstimator::getRto() {
+	uint32_t rto = getSrtt() + max((uint32_t)1, getRttVar() << 2);
+	rto = max((uint32_t)RTT_MIN_RTO_MILLIS, rto) << _backoffShift;
+	return (min((uint32_t)RTT_MAX_RTO_MILLIS, rto));
+}
@@ -0,0 +1,43 @@
+#ifndef RttEstimator_h
+#define RttEstimator_h
+
+#include "Arduino.h"
+
+/*
+	Smoothed round trip time and retransmission timeout for one link, as in RFC 6298: SRTT and RTTVAR
+	are updated from each valid sample with gains of 1/8 and 1/4, and RTO = SRTT + 4 * RTTVAR.  They are
+	held scaled by 8 and 4 so the integer arithmetic doesn't round small (fast link) samples away.
+
+	Callers apply Karn's rule themselves: only time a chunk or request that was sent once, and discard the
+	sample if anything it covers is retransmitted before the answer comes back.
+*/
+
+#define RTT_DEFAULT_INITIAL_MILLIS							50					// until the connection interval is known
+#define RTT_MIN_RTO_MILLIS									10
+#define RTT_MAX_RTO_MILLIS									2000
+#define RTT_MAX_BACKOFF_SHIFT								5					// RTO doubles on each timeout, at most 32x
+
+class RttEstimator
+
+{
+public:
+
+	void reset(uint32_t initialRttMillis);
+	void addSample(uint32_t rttMillis);
+	void backOff();
+
+	uint32_t getSrtt() { return (_scaledSrtt >> 3); }
+	uint32_t getRttVar() { return (_scaledRttVar >> 2); }
+	uint32_t getRto();
+	uint32_t getSampleCount() { return _sampleCount; }
+	int getBackoffShift() { return _backoffShift; }
+
+private:
+
+	uint32_t _scaledSrtt = RTT_DEFAULT_INITIAL_MILLIS << 3;
+	uint32_t _scaledRttVar = RTT_DEFAULT_INITIAL_MILLIS << 1;						// RTTVAR = initial / 2, scaled by 4
+	uint32_t _sampleCount = 0;
+	int _backoffShift = 0;
+};
+
+#endif
@@ -0,0 +1,31 @@
+#include "TokenBucket.h"
+
+
+void TokenBucket::reset(uint32_t bytesPerSecond, uint32_t capacityBytes) {
+	_bytesPerSecond = bytesPerSecond;
+	_capacityBytes = capacityBytes;
+	_milliTokens = (int32_t)capacityBytes * 1000;								// start full, so the first chunks go straight away
+	_lastRefillMillis = millis();
+}
+
+void TokenBucket::setCapacity(uint32_t capacityBytes) {
+	_capacityBytes = capacityBytes;
+	_milliTokens = min(_milliTokens, (int32_t)capacityBytes * 1000);
+}
+
+void TokenBucket::refill(uint32_t nowMillis) {
+	uint32_t elapsed = nowMillis - _lastRefillMillis;
+	_lastRefillMillis = nowMillis;
+	if (elapsed > 1000) { elapsed = 1000; }										// a full second refills any bucket, and keeps the product in range
+	_milliTokens = min((int32_t)(_capacityBytes * 1000), _milliTokens + (int32_t)(elapsed * _bytesPerSecond));
+}
+
+boolean TokenBucket::consume(int32_t bytes) {
+	if (_milliTokens < bytes * 1000) { return false; }
+	_milliTokens -= bytes * 1000;
+	return true;
+}
+
+void TokenBucket::forceConsume(int32_t bytes) {
+	_milliTokens = max((int32_t)0, _milliTokens - bytes * 1000);
+}
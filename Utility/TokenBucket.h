@@ -0,0 +1,36 @@
+#ifndef TokenBucket_h
+#define TokenBucket_h
+
+#include "Arduino.h"
+
+/*
+	Byte based token bucket.  Tokens build up at the configured rate to at most the capacity, and anything
+	that wants to write takes tokens first.  Tokens are held in thousandths of a byte so that a slow rate
+	still refills when it's polled every millisecond.
+*/
+
+class TokenBucket
+
+{
+public:
+
+	void reset(uint32_t bytesPerSecond, uint32_t capacityBytes);
+	void refill(uint32_t nowMillis);
+	void setRate(uint32_t bytesPerSecond) { _bytesPerSecond = bytesPerSecond; }
+	void setCapacity(uint32_t capacityBytes);
+
+	uint32_t getRate() { return _bytesPerSecond; }
+	uint32_t getCapacity() { return _capacityBytes; }
+	int32_t getTokens() { return (_milliTokens / 1000); }
+	boolean consume(int32_t bytes);												// false (and nothing taken) if there aren't enough tokens
+	void forceConsume(int32_t bytes);											// takes what's there, never going below 0
+
+private:
+
+	uint32_t _bytesPerSecond = 0;
+	uint32_t _capacityBytes = 0;
+	int32_t _milliTokens = 0;
+	uint32_t _lastRefillMillis = 0;
+};
+
+#endif
@@ -0,0 +1,139 @@
+#include "HostTest.h"
+#include <vector>
+
+// Sends a message over a link with large chunks, corrupting a byte of some of its chunks on their first trip, and checks
+// the receiver's chunk checks find those chunks and have them resent on their own, with one SACK, rather than NACKing
+// the whole message
+
+#define PAYLOAD_LENGTH			3000										// more chunks than a CHUNK_CHECKS frame has checks
+#define CORRUPT_OFFSET			100											// into a chunk's payload, past anything chunk 0's crc8 covers
+
+static char thisDeviceName[] = "dest";
+static char peerName[] = "peer";
+static BleDeviceTable * sender = &bleStar.bleDeviceTable[BLE_CENTRAL_INDEX_0];
+static BleDeviceTable * receiver = &bleStar.bleDeviceTable[BLE_PERIPHERAL_INDEX];
+static uint8_t payload[PAYLOAD_LENGTH];
+
+// One direction of the link.  The first time each of corruptChunks is written, a byte of its payload is flipped
+class CaptureUart : public Stream {
+public:
+	std::vector<uint8_t> bytes;
+	std::vector<int> corruptChunks;
+	size_t write(uint8_t c) { bytes.push_back(c); return 1; }
+	size_t write(const uint8_t * buffer, size_t size) {
+		size_t start = bytes.size();
+		bytes.insert(bytes.end(), buffer, buffer + size);
+		boolean isFirstChunk = ((buffer[0] & DATA_CHUNK_MARKER_MASK) == FIRST_CHUNK_MARKER);
+		boolean isDataChunk = ((buffer[0] & DATA_CHUNK_MARKER_MASK) == DATA_CHUNK_MARKER);
+		for (size_t i = 0; i < corruptChunks.size() && (isFirstChunk || isDataChunk); i++) {
+			if (corruptChunks[i] != (isFirstChunk ? 0 : buffer[1])) { continue; }
+			bytes[start + DATA_CHUNK_HEADER_LENGTH + CORRUPT_OFFSET] ^= 0x5A;
+			corruptChunks.erase(corruptChunks.begin() + i);
+			break;
+		}
+		return size;
+	}
+	int available() { return 0; }
+	int read() { return -1; }
+};
+static CaptureUart toReceiver;
+static CaptureUart toSender;
+
+static int messagesDelivered = 0;
+static int selectiveAcks = 0;
+static void messageDelivered(Message * m) {
+	messagesDelivered++;
+	CHECK(memcmp(m->getPayload(), payload, PAYLOAD_LENGTH) == 0);
+}
+
+// Hands everything written to uart to bleDevice, as much as its staging buffer takes at a time
+static void deliver(CaptureUart * uart, BleDeviceTable * bleDevice) {
+	size_t index = 0;
+	while (index < uart->bytes.size()) {
+		int length = min((int)(uart->bytes.size() - index), RECEIVE_STAGING_BUFFER_LENGTH - bleDevice->receiveStagingLength);
+		memcpy(&bleDevice->receiveStagingBuffer[bleDevice->receiveStagingLength], &uart->bytes[index], length);
+		bleDevice->receiveStagingLength += length;
+		index += length;
+		bleStar.processReceiveStagingBuffer(bleDevice);
+	}
+	uart->bytes.clear();
+}
+
+// Sends the message with each of corruptChunks corrupted once.  Returns the chunks the sender wrote
+static int sendMessage(std::vector<int> corruptChunks) {
+	for (int i = 0; i < bleStar.mTable.getSize(); i++) { bleStar.mTable.getMessage(i)->invalidateMessage(); }	// the last one's done with
+	bleStar.mTable.defragmentMessages();
+	uint32_t random = 1;
+	for (int i = 0; i < PAYLOAD_LENGTH; i++) {									// incompressible, so it's sent as is
+		random = random * 1103515245 + 12345;
+		payload[i] = (uint8_t)(random >> 16);
+	}
+	Message * m = bleStar.mTable.addNewMessageToSend(payload, PAYLOAD_LENGTH, peerName, thisDeviceName, 7, false, MESSAGE_PRIORITY_NORMAL);
+	BleSendChannel * channel = &sender->sendChannel[0];
+	bleStar.assignMessageToSendChannel(m, sender, channel);
+	CHECK(channel->chunkLength == MAX_NEGOTIATED_BLE_CHUNK_LENGTH);
+	CHECK(channel->sendChunksExpected > 4);
+	toReceiver.corruptChunks = corruptChunks;
+	messagesDelivered = 0;
+	selectiveAcks = 0;
+
+	int chunksWritten = 0;
+	uint32_t now = millis();
+	for (int pass = 0; pass < 1000 && channel->messageBeingSent != NULL; pass++) {
+		setHostMillis(now += 10);
+		sender->writer.beginPass();
+		receiver->writer.beginPass();
+		bleStar.pollSendingMessage(sender);
+		bleStar.pollSendingMessage(receiver);									// sends its deferred ACK once it's due
+		for (size_t i = 0; i < toReceiver.bytes.size(); i++) {					// every chunk is a whole write, so starts with its marker
+			uint8_t marker = toReceiver.bytes[i] & DATA_CHUNK_MARKER_MASK;
+			if (marker != FIRST_CHUNK_MARKER && marker != DATA_CHUNK_MARKER) { break; }
+			chunksWritten++;
+			i += DATA_CHUNK_HEADER_LENGTH + toReceiver.bytes[i + DATA_CHUNK_PAYLOAD_LENGTH_POSITION] - 1;
+		}
+		deliver(&toReceiver, receiver);
+		for (size_t i = 0; i + 2 < toSender.bytes.size(); i += LINK_CONTROL_FRAME_HEADER_LENGTH + toSender.bytes[i + 2]) {
+			selectiveAcks += (toSender.bytes[i + 1] == LINK_CONTROL_SACK ? 1 : 0);	// the receiver only ever sends control frames
+		}
+		deliver(&toSender, sender);
+	}
+	CHECK(channel->messageBeingSent == NULL);
+	return chunksWritten;
+}
+
+int main() {
+	bleStar._thisDeviceName = thisDeviceName;
+	bleStar.setRoutedMessageReceivedCallback(messageDelivered);
+	Bluefruit.connection.mtu = MAX_BLE_MTU;
+	sender->peerName = thisDeviceName;
+	sender->peerCapabilities = LINK_CAPABILITY_CHUNK_CHECKS;
+	sender->connectionHandle = 0;
+	sender->congestionWindow = MAX_BLE_CHUNKS;
+	sender->writer.attach(&toReceiver, 1000000);
+	receiver->peerName = peerName;
+	receiver->peerCapabilities = LINK_CAPABILITY_CHUNK_CHECKS;
+	receiver->writer.attach(&toSender, 1000000);
+
+	// nothing corrupted
+	int chunks = sendMessage({});
+	CHECK(messagesDelivered == 1);
+	CHECK(receiver->chunksRepairedByChecks == 0);
+	CHECK(chunks > CHUNK_CHECKS_PER_FRAME);
+
+	// a chunk in the middle, then chunk 0 past the part its crc8 covers: only that chunk goes again
+	CHECK(sendMessage({ 3 }) == chunks + 1);
+	CHECK(messagesDelivered == 1);
+	CHECK(receiver->chunksRepairedByChecks == 1);
+	CHECK(selectiveAcks == 1);
+	CHECK(sendMessage({ 0 }) == chunks + 1);
+	CHECK(messagesDelivered == 1);
+	CHECK(receiver->chunksRepairedByChecks == 2);
+
+	// chunks in two groups, each narrowed down by a request of its own: one SACK asks for both once both are answered
+	CHECK(sendMessage({ 3, chunks - 2 }) == chunks + 2);
+	CHECK(messagesDelivered == 1);
+	CHECK(receiver->chunksRepairedByChecks == 4);
+	CHECK(selectiveAcks == 1);
+
+	return (getTestResult("ChunkCheckTest"));
+}
@@ -0,0 +1,81 @@
+#include "HostTest.h"
+
+// Checks a bundle that fails on its hop reports each message packed into it as failed, by the messageId its sender
+// was given, whether or not the bundle's payload was compressed
+
+#define LINGER_MILLIS			50
+
+static char thisDeviceName[] = "node";
+static char peerName[] = "peer";
+static char destinationName[] = "dest";
+static BleDeviceTable * link = &bleStar.bleDeviceTable[BLE_CENTRAL_INDEX_0];
+
+static uint16_t failedMessageIds[8];
+static int failedMessages = 0;
+static void messageFailed(uint16_t messageId) {
+	if (failedMessages < 8) { failedMessageIds[failedMessages] = messageId; }
+	failedMessages++;
+}
+
+// Three small messages for the peer, packed into one bundle once they've lingered; returns the bundle
+static Message * coalesceThreeMessages(uint16_t firstMessageId, uint32_t now) {
+	uint8_t payload[] = "a reading small enough to share";
+	Message * messages[3];
+	for (int i = 0; i < 3; i++) {												// all added before any is routed, as the table refuses more from an origin with one on its way
+		messages[i] = bleStar.mTable.addNewMessageToSend(payload, sizeof(payload), thisDeviceName, destinationName, firstMessageId + i, false, MESSAGE_PRIORITY_NORMAL);
+	}
+	for (Message * m : messages) {
+		m->setMessageType(MESSAGE_TYPE_HOP);
+		m->setToHop(peerName);
+		m->setRequiresRouting(false);
+	}
+	setHostMillis(now);
+	bleStar.coalesceMessagesForHop(link);
+	setHostMillis(now + LINGER_MILLIS);
+	bleStar.coalesceMessagesForHop(link);
+
+	Message * bundle = NULL;
+	for (int i = 0; i < bleStar.mTable.getSize(); i++) {
+		Message * m = bleStar.mTable.getMessage(i);
+		if (m->getMessageType() != MESSAGE_TYPE_NONE && m->getIsSystemMessage() && m->getMessageId() == 0) { bundle = m; }
+	}
+	return bundle;
+}
+
+static void checkBundleFailsAsItsRecords(uint16_t firstMessageId, uint32_t now, boolean isCompressed) {
+	bleStar.setPayloadCompression(isCompressed);
+	Message * bundle = coalesceThreeMessages(firstMessageId, now);
+	CHECK(bundle != NULL);
+	if (bundle == NULL) { return; }
+	CHECK(bundle->getIsCompressed() == isCompressed);
+
+	BleSendChannel * channel = &link->sendChannel[0];
+	bleStar.assignMessageToSendChannel(bundle, link, channel);
+	failedMessages = 0;
+	bleStar.failAndClearSendChannel(link, channel);
+	CHECK(failedMessages == 3);
+	for (int i = 0; i < 3; i++) { CHECK(failedMessageIds[i] == firstMessageId + i); }
+	if (bleStar.mTable.defragmentMessageTable()) { bleStar.mTable.defragmentMessageBuffer(); }	// frees the origin for the next bundle
+}
+
+int main() {
+	bleStar._thisDeviceName = thisDeviceName;
+	bleStar.setTransmissionFailedCallback(messageFailed);
+	bleStar.setCoalescing(LINGER_MILLIS);
+	link->peerName = peerName;
+	link->isConnected = true;
+
+	checkBundleFailsAsItsRecords(101, 1000, false);
+	checkBundleFailsAsItsRecords(201, 2000, true);
+
+	// anything else still fails by its own messageId
+	uint8_t payload[] = "sent by itself";
+	Message * m = bleStar.mTable.addNewMessageToSend(payload, sizeof(payload), thisDeviceName, destinationName, 301, false, MESSAGE_PRIORITY_URGENT);
+	m->setToHop(peerName);
+	bleStar.assignMessageToSendChannel(m, link, &link->sendChannel[0]);
+	failedMessages = 0;
+	bleStar.failAndClearSendChannel(link, &link->sendChannel[0]);
+	CHECK(failedMessages == 1 && failedMessageIds[0] == 301);
+
+	return (getTestResult("CoalescingTest"));
+}
@@ -0,0 +1,45 @@
+#define HOST_TEST_MESSAGE_BUFFER_CAPACITY 12000									// two messages near MAX_COMPILED_MESSAGE_LENGTH
+#include "HostTest.h"
+
+// Checks payloads of every length a message can carry are compressed, and come back byte for byte when the destination
+// expands them into the scratch message, however long they are
+
+static char origin[] = "node";
+static char destination[] = "dest";
+static char fromHop[] = "peer";
+
+static void checkRoundTrip(int payloadLength) {
+	static uint8_t payload[MAX_COMPILED_MESSAGE_LENGTH];
+	for (int i = 0; i < payloadLength; i++) { payload[i] = (uint8_t)('a' + i % 17 + (i / 500) % 3); }
+	Message * m = bleStar.mTable.addNewMessageToSend(payload, payloadLength, origin, destination, 7, false, MESSAGE_PRIORITY_NORMAL);
+	CHECK(m != NULL);
+	if (m == NULL) { return; }
+	CHECK(m->getIsCompressed());
+	CHECK(m->getPayloadLength() <= payloadLength);								// expanded length, stream and terminator
+
+	Message * received = bleStar.mTable.reserveSpaceForIncomingMessage(m->getStoredMessageLength() + 1, fromHop);
+	CHECK(received != NULL);
+	if (received == NULL) { return; }
+	memcpy(received->getStartOfCompiledMessage(), m->getStartOfCompiledMessage(), m->getStoredMessageLength());
+	received->importMessage(received->getStartOfCompiledMessage(), received->getStartOfCompiledMessage(), fromHop);
+	Message * expanded = bleStar.getExpandedMessage(received);
+	CHECK(expanded != NULL && expanded != received);
+	if (expanded == NULL) { return; }
+	CHECK(!expanded->getIsCompressed());
+	CHECK(expanded->getPayloadLength() == payloadLength + 1);					// with its terminator
+	CHECK(memcmp(expanded->getPayload(), payload, payloadLength) == 0);
+	CHECK(strcmp(expanded->getOrigin(), origin) == 0 && expanded->getMessageId() == 7);
+
+	m->invalidateMessage();
+	received->invalidateMessage();
+	if (bleStar.mTable.defragmentMessageTable()) { bleStar.mTable.defragmentMessageBuffer(); }
+}
+
+int main() {
+	checkRoundTrip(MIN_COMPRESSIBLE_PAYLOAD_LENGTH);
+	checkRoundTrip(1000);
+	checkRoundTrip(1500);														// over the 1 KB the scratch message once held
+	checkRoundTrip(MAX_COMPILED_MESSAGE_LENGTH - 100);							// room for the header and names
+
+	return (getTestResult("CompressionTest"));
+}
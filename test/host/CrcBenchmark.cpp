@@ -0,0 +1,97 @@
+#include "HostTest.h"
+#include <chrono>
+
+// Checks the slice-by-4 CRCs in CRC.cpp against the byte-wise code they replaced, and against the standard check values
+// for "123456789", then reports MB/s for each over a 4 KB buffer
+
+// ------------ the byte-wise CRCs, with tables built at run time as CRC::initializeTables did ---------------------------
+
+static uint8_t crc8Table[256];
+static uint16_t crc16Table[256];
+static uint32_t crc32Table[256];
+
+static void initializeTables() {
+	for (int i = 0; i < 256; i++) {
+		uint8_t thisByte = (uint8_t)i;
+		for (int bit = 0; bit < 8; bit++) { thisByte = ((thisByte & 0x80) != 0 ? (uint8_t)((thisByte << 1) ^ 0x1D) : (uint8_t)(thisByte << 1)); }
+		crc8Table[i] = thisByte;
+
+		uint16_t crc = 0;
+		uint16_t c = (uint16_t)i;
+		for (int j = 0; j < 8; j++) {
+			crc = (((crc ^ c) & 0x0001) != 0 ? (uint16_t)((crc >> 1) ^ CRC_POLY_16) : (uint16_t)(crc >> 1));
+			c = c >> 1;
+		}
+		crc16Table[i] = crc;
+
+		uint32_t crc32 = (uint32_t)i;
+		for (int j = 0; j < 8; j++) { crc32 = ((crc32 & 1) != 0 ? (crc32 >> 1) ^ 0xEDB88320 : crc32 >> 1); }
+		crc32Table[i] = crc32;
+	}
+}
+
+static uint8_t getBytewiseCrc8(uint8_t * data, int length) {
+	uint8_t crc8 = 0;
+	for (int i = 0; i < length; i++) { crc8 = crc8Table[data[i] ^ crc8]; }
+	return crc8;
+}
+static uint16_t getBytewiseCrc16(uint8_t * data, int length) {
+	uint16_t crc16 = CRC_START_MODBUS;
+	for (int i = 0; i < length; i++) { crc16 = (crc16 >> 8) ^ crc16Table[(crc16 ^ data[i]) & 0xFF]; }
+	return crc16;
+}
+static uint32_t getBytewiseCrc32(uint8_t * data, int length) {
+	uint32_t crc32 = 0xFFFFFFFF;
+	for (int i = 0; i < length; i++) { crc32 = (crc32 >> 8) ^ crc32Table[(crc32 ^ data[i]) & 0xFF]; }
+	return ~crc32;
+}
+
+
+// ------------ checks and timings ------------------------------------------------------------------------------------
+
+#define BENCHMARK_BUFFER_LENGTH		4096
+#define BENCHMARK_PASSES			20000
+
+template<class CrcFunction> double getMegabytesPerSecond(CrcFunction crcFunction) {
+	static uint8_t buffer[BENCHMARK_BUFFER_LENGTH];
+	for (int i = 0; i < BENCHMARK_BUFFER_LENGTH; i++) { buffer[i] = (uint8_t)rand(); }
+	volatile uint32_t sum = 0;													// so the calls aren't optimized away
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < BENCHMARK_PASSES; i++) { sum += crcFunction(buffer, BENCHMARK_BUFFER_LENGTH); }
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return ((double)BENCHMARK_BUFFER_LENGTH * BENCHMARK_PASSES / seconds / 1e6);
+}
+
+int main() {
+	initializeTables();
+
+	uint8_t check[] = "123456789";
+	CHECK(CRC::getCrc8(check, 9) == 0x37);										// CRC-8/GSM-A
+	CHECK(CRC::getCrc16(check, 9) == 0x4B37);									// CRC-16/MODBUS
+	CHECK(CRC::getCrc32(check, 9) == 0xCBF43926);								// CRC-32/ISO-HDLC
+	printf("check values for \"123456789\": crc8 %02X  crc16 %04X  crc32 %08X\n",
+			CRC::getCrc8(check, 9), CRC::getCrc16(check, 9), (unsigned int)CRC::getCrc32(check, 9));
+
+	uint8_t data[1000];
+	for (int pass = 0; pass < 2000; pass++) {									// every length, so each slice and tail is covered
+		int length = rand() % (int)sizeof(data);
+		for (int i = 0; i < length; i++) { data[i] = (uint8_t)rand(); }
+		CHECK(CRC::getCrc8(data, length) == getBytewiseCrc8(data, length));
+		CHECK(CRC::getCrc16(data, length) == getBytewiseCrc16(data, length));
+		CHECK(CRC::getCrc32(data, length) == getBytewiseCrc32(data, length));
+
+		int split = (length > 0 ? rand() % length : 0);							// as setChunkReceived keeps the running crc16
+		CHECK(CRC::updateCrc16(CRC::updateCrc16(CRC_START_MODBUS, data, split), &data[split], length - split) == getBytewiseCrc16(data, length));
+		if (failures > 0) { break; }
+	}
+	if (failures > 0) {
+		printf("CrcBenchmark FAILED\n");
+		return 1;
+	}
+
+	printf("crc8   byte-wise %5.0f MB/s   slice-by-4 %5.0f MB/s\n", getMegabytesPerSecond(getBytewiseCrc8), getMegabytesPerSecond(CRC::getCrc8));
+	printf("crc16  byte-wise %5.0f MB/s   slice-by-4 %5.0f MB/s\n", getMegabytesPerSecond(getBytewiseCrc16), getMegabytesPerSecond(CRC::getCrc16));
+	printf("crc32  byte-wise %5.0f MB/s   slice-by-4 %5.0f MB/s\n", getMegabytesPerSecond(getBytewiseCrc32), getMegabytesPerSecond(CRC::getCrc32));
+	return 0;
+}
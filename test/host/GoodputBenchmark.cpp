@@ -0,0 +1,159 @@
+#define HOST_TEST_MESSAGE_BUFFER_CAPACITY 40000									// three messages in flight each way, and their copies as they arrive
+#include "HostTest.h"
+#include <vector>
+
+// Payload bytes per second each way over a link busy in both directions, with every ACK and NACK sent by itself and
+// with delayed ACKs riding along with the chunks going the other way.  The link is simulated: the two directions share
+// a fixed number of notifications per connection event, as they share the airtime of a real one, and what's written
+// during an event arrives at the next.  A frame sent by itself takes a notification a chunk could have used, so the
+// difference shows most when the link is short of airtime and its messages are small
+
+#define CONNECTION_INTERVAL_MILLIS		8											// 7.5ms, the shortest a BLE link allows, rounded up
+#define SIMULATED_MILLIS				20000
+#define CHANNELS_KEPT_BUSY				(BLE_LINK_CHANNELS - BLE_LINK_CHANNELS_KEPT_FOR_URGENT)
+
+static char thisDeviceName[] = "dest";
+static char peerName[] = "peer";
+static char * origins[2][CHANNELS_KEPT_BUSY] = { { (char *)"a0", (char *)"a1", (char *)"a2" }, { (char *)"b0", (char *)"b1", (char *)"b2" } };
+static BleDeviceTable * devices[2] = { &bleStar.bleDeviceTable[BLE_CENTRAL_INDEX_0], &bleStar.bleDeviceTable[BLE_PERIPHERAL_INDEX] };
+static uint8_t payload[MAX_COMPILED_MESSAGE_LENGTH];
+static uint16_t nextMessageId = 1;
+
+static int notificationLength = MAX_BLE_CHUNK_LENGTH;
+static int notificationsLeft = 0;													// in this connection event, both ways
+
+// One direction of the link.  A write takes as many notifications as it spans, and only what fits in those left
+class SimulatedUart : public Stream {
+public:
+	std::vector<uint8_t> sending;													// written during this connection event
+	std::vector<uint8_t> arriving;													// written during the last one
+	size_t write(uint8_t c) { return (write(&c, 1)); }
+	size_t write(const uint8_t * buffer, size_t size) {
+		int notificationsTaken = min((int)(size + notificationLength - 1) / notificationLength, notificationsLeft);
+		size_t bytesTaken = min(size, (size_t)(notificationsTaken * notificationLength));
+		notificationsLeft -= notificationsTaken;
+		sending.insert(sending.end(), buffer, buffer + bytesTaken);
+		return bytesTaken;
+	}
+	int available() { return 0; }
+	int read() { return -1; }
+};
+static SimulatedUart uarts[2];
+
+static uint32_t payloadBytesDelivered[2];
+static int messagesFailed = 0;
+static void messageDelivered(Message * m) {
+	payloadBytesDelivered[m->getOrigin()[0] == 'a' ? 0 : 1] += m->getPayloadLength();
+}
+static void messageFailed(uint16_t messageId) {
+	messagesFailed++;
+}
+
+// Hands everything that arrived on uart to bleDevice, as much as its staging buffer takes at a time
+static void deliver(SimulatedUart * uart, BleDeviceTable * bleDevice) {
+	size_t index = 0;
+	while (index < uart->arriving.size()) {
+		int length = min((int)(uart->arriving.size() - index), RECEIVE_STAGING_BUFFER_LENGTH - bleDevice->receiveStagingLength);
+		memcpy(&bleDevice->receiveStagingBuffer[bleDevice->receiveStagingLength], &uart->arriving[index], length);
+		bleDevice->receiveStagingLength += length;
+		index += length;
+		bleStar.processReceiveStagingBuffer(bleDevice);
+	}
+	uart->arriving.clear();
+}
+
+// A new message on each of the channels left idle, each from an origin of its own so the messageTable takes it
+static void keepChannelsBusy(int side, int payloadLength) {
+	BleDeviceTable * bleDevice = devices[side];
+	for (int i = 0; i < CHANNELS_KEPT_BUSY; i++) {
+		BleSendChannel * channel = &bleDevice->sendChannel[i];
+		if (channel->messageBeingSent != NULL) { continue; }
+		Message * m = bleStar.mTable.addNewMessageToSend(payload, payloadLength, origins[side][i], thisDeviceName, nextMessageId++, false, MESSAGE_PRIORITY_NORMAL);
+		if (m == NULL) { return; }
+		m->setToHop(bleDevice->peerName);
+		bleStar.assignMessageToSendChannel(m, bleDevice, channel);
+	}
+}
+
+static void resetLink(int side, int notificationsPerEvent) {
+	BleDeviceTable * bleDevice = devices[side];
+	bleStar.resetSendMessage(bleDevice);
+	for (int i = 0; i < BLE_LINK_CHANNELS; i++) {
+		bleDevice->receiveChannel[i].channel = i;
+		bleStar.resetReceiveChannel(&bleDevice->receiveChannel[i]);
+	}
+	bleDevice->receiveStagingLength = 0;
+	bleDevice->rtt.reset(bleStar.getInitialRttForConnection(0));
+	bleDevice->writer.attach(&uarts[side], notificationsPerEvent * notificationLength * 1000 / CONNECTION_INTERVAL_MILLIS / 2);
+	uarts[side].sending.clear();
+	uarts[side].arriving.clear();
+	payloadBytesDelivered[side] = 0;
+}
+
+static void runBenchmark(int notificationsPerEvent, int mtu, int payloadLength, boolean isDelayedAck) {
+	Bluefruit.connection.mtu = mtu;
+	notificationLength = mtu - BLE_ATT_HEADER_LENGTH;
+	bleStar.setDelayedAck(isDelayedAck);
+	for (int i = 0; i < bleStar.mTable.getSize(); i++) { bleStar.mTable.getMessage(i)->invalidateMessage(); }
+	resetLink(0, notificationsPerEvent);
+	resetLink(1, notificationsPerEvent);
+	bleStar.mTable.defragmentMessages();
+	uint32_t piggybackedBefore = devices[0]->writer.getFramesPiggybacked() + devices[1]->writer.getFramesPiggybacked();
+	messagesFailed = 0;
+
+	uint32_t start = millis();
+	uint32_t now = start;
+	while (now - start < SIMULATED_MILLIS) {
+		setHostMillis(++now);
+		if (now % CONNECTION_INTERVAL_MILLIS == 0) {								// what was written during the last event arrives
+			notificationsLeft = notificationsPerEvent;
+			uarts[0].arriving.swap(uarts[0].sending);
+			uarts[1].arriving.swap(uarts[1].sending);
+			deliver(&uarts[0], devices[1]);
+			deliver(&uarts[1], devices[0]);
+		}
+		if (bleStar.mTable.defragmentMessageTable()) { bleStar.mTable.defragmentMessageBuffer(); }	// frees the origins of finished messages
+		for (int i = 0; i < 2; i++) {
+			int side = (i + now + now / CONNECTION_INTERVAL_MILLIS) % 2;			// neither side always gets to the airtime first
+			devices[side]->writer.beginPass();
+			keepChannelsBusy(side, payloadLength);
+			bleStar.pollSendingMessage(devices[side]);
+		}
+	}
+
+	uint32_t piggybacked = devices[0]->writer.getFramesPiggybacked() + devices[1]->writer.getFramesPiggybacked() - piggybackedBefore;
+	uint32_t goodput[2] = { payloadBytesDelivered[0] / (SIMULATED_MILLIS / 1000), payloadBytesDelivered[1] / (SIMULATED_MILLIS / 1000) };
+	printf("%-8s %7d %6d %8d %10u %10u %10u %10u %7u %7d\n", isDelayedAck ? "delayed" : "alone", notificationsPerEvent,
+			notificationLength, payloadLength, goodput[0], goodput[1], goodput[0] + goodput[1], piggybacked, devices[0]->rtt.getSrtt(), messagesFailed);
+}
+
+int main() {
+	bleStar._thisDeviceName = thisDeviceName;
+	bleStar.setRoutedMessageReceivedCallback(messageDelivered);
+	bleStar.setTransmissionFailedCallback(messageFailed);
+	devices[0]->peerName = thisDeviceName;											// both ends are this device, so everything sent is delivered
+	devices[0]->connectionHandle = 0;
+	devices[1]->peerName = peerName;
+	devices[1]->connectionHandle = 0;
+	uint32_t random = 1;
+	for (int i = 0; i < MAX_COMPILED_MESSAGE_LENGTH; i++) {							// incompressible, so it's sent as is
+		random = random * 1103515245 + 12345;
+		payload[i] = (uint8_t)(random >> 16);
+	}
+
+	printf("%dms connection events, their notifications shared by both directions; payload bytes per second\n", CONNECTION_INTERVAL_MILLIS);
+	printf("%-8s %7s %6s %8s %10s %10s %10s %10s %7s %7s\n", "ACKs", "notifs", "chunk", "payload", "a->b", "b->a", "total",
+			"piggyback", "srtt", "failed");
+	int notificationsPerEvent[] = { 4, 12 };
+	int mtus[] = { MAX_BLE_CHUNK_LENGTH + BLE_ATT_HEADER_LENGTH, MAX_BLE_MTU };
+	int payloadLengths[] = { 200, 2000 };
+	for (int notifications : notificationsPerEvent) {
+		for (int mtu : mtus) {
+			for (int payloadLength : payloadLengths) {
+				runBenchmark(notifications, mtu, payloadLength, false);
+				runBenchmark(notifications, mtu, payloadLength, true);
+			}
+		}
+	}
+	return 0;
+}
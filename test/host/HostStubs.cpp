@@ -0,0 +1,21 @@
+#include "BleStar.h"
+
+// Objects the Arduino core and Bluefruit normally provide, and the statics the library declares but leaves to be
+// defined, so the tests link on the host
+
+HardwareSerial Serial;
+BluefruitClass Bluefruit;
+const uint8_t BLEUART_UUID_SERVICE[16] = { 0 };
+
+static uint32_t hostMillis = 0;
+uint32_t millis() { return hostMillis; }
+void delay(uint32_t ms) { hostMillis += ms; }
+void setHostMillis(uint32_t ms) { hostMillis = ms; }
+
+int Logger::_loggingLevel = 0;
+constexpr char Logger::LOGGING_LEVEL_TEXT[5][8];
+Logger Message::Log;
+boolean Message::_messagesHaveBeenChanged = false;
+BLEUuid BleStar::uuidForConnection;
+BLEUuid BleStar::uuidForSignalStrengthMonitoring;
+BleStar * BleStar::_pointerToBleStarClass = NULL;
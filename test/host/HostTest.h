@@ -0,0 +1,42 @@
+#ifndef HostTest_h
+#define HostTest_h
+
+#define private public															// the tests drive BleStar's internals directly
+#include "BleStar.h"
+#undef private
+
+/*
+	What every host test and benchmark shares.  CHECK records a failure and carries on, so a run reports every check
+	that fails, and a test's main() ends with return (getTestResult("...Test")).
+
+	bleStar is the instance they all drive.  It's wired to the library's static callbacks and its bleDeviceTable is
+	numbered as begin() would, without begin()'s calls into Bluefruit.  A test wanting a smaller message buffer defines
+	HOST_TEST_MESSAGE_BUFFER_CAPACITY before including this.
+*/
+
+#ifndef HOST_TEST_MESSAGE_BUFFER_CAPACITY
+#define HOST_TEST_MESSAGE_BUFFER_CAPACITY					8000
+#endif
+#define HOST_TEST_MESSAGE_TABLE_CAPACITY					40
+#define HOST_TEST_ROUTING_TABLE_CAPACITY					20
+
+static int failures = 0;
+#define CHECK(condition) do { if (!(condition)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #condition); failures++; } } while (0)
+
+static BleStar bleStar(HOST_TEST_MESSAGE_BUFFER_CAPACITY, HOST_TEST_MESSAGE_TABLE_CAPACITY, HOST_TEST_ROUTING_TABLE_CAPACITY);
+
+static struct HostTestSetup {
+	HostTestSetup() {
+		BleStar::_pointerToBleStarClass = &bleStar;
+		bleStar.mTable.setMessageCallbacks(BleStar::messageInUseCallbackWrapper, BleStar::messageMovedCallbackWrapper);
+		for (int i = 0; i < MAX_CENTRAL_CONNECTIONS + 2; i++) { bleStar.bleDeviceTable[i].index = i; }
+	}
+} hostTestSetup;
+
+// Prints the result, and returns main()'s exit code
+static inline int getTestResult(const char * testName) {
+	printf("%s %s\n", testName, failures == 0 ? "passed" : "FAILED");
+	return (failures == 0 ? 0 : 1);
+}
+
+#endif
@@ -0,0 +1,105 @@
+#include "HostTest.h"
+
+// Checks a link the heartbeat finds dead has its waiting messages routed again over another link, and that
+// BleLinkStatistics measures how long it took to find and how long from the messages going back to the router to the
+// first of them taking a send channel on the other link
+
+#define DETECTION_MILLIS		1200
+#define DISCONNECT_MILLIS		30											// the SoftDevice's disconnect callback, after Bluefruit.disconnect
+#define ROUTING_MILLIS			20											// until the next pass routes the messages and fills idle channels
+
+static char thisDeviceName[] = "node";
+static char peerName[] = "peer";
+static char otherPeerName[] = "other";
+static char destinationName[] = "dest";
+static BleDeviceTable * link = &bleStar.bleDeviceTable[BLE_CENTRAL_INDEX_0];
+static BleDeviceTable * otherLink = &bleStar.bleDeviceTable[BLE_PERIPHERAL_INDEX];	// the destination can be reached this way too
+
+// A message routed to the link's peer, waiting its turn to be sent
+static Message * addHopMessage() {
+	uint8_t payload[] = "for a device beyond the peer";
+	Message * m = bleStar.mTable.addNewMessageToSend(payload, sizeof(payload), thisDeviceName, destinationName, 1, true, MESSAGE_PRIORITY_NORMAL);
+	m->setMessageType(MESSAGE_TYPE_HOP);
+	m->setToHop(peerName);
+	m->setRequiresRouting(false);
+	return m;
+}
+
+// What the router does with each requeued message, then the other link's idle channels filled as pollSendingMessages does
+static void routeOverOtherLink() {
+	for (int i = 0; i < bleStar.mTable.getSize(); i++) {
+		Message * m = bleStar.mTable.getMessage(i);
+		if (m->getRequiresRouting()) { bleStar.mTable.setHopsInMessage(m, thisDeviceName, otherPeerName); }
+	}
+	for (int i = 0; i < BLE_LINK_CHANNELS; i++) {
+		if (otherLink->sendChannel[i].messageBeingSent != NULL) { continue; }
+		Message * m = bleStar.getNextMessageForHop(otherLink, true);
+		if (m == NULL) { break; }
+		bleStar.assignMessageToSendChannel(m, otherLink, &otherLink->sendChannel[i]);
+	}
+}
+
+int main() {
+	bleStar._thisDeviceName = thisDeviceName;
+	bleStar.setLinkFailureDetection(DETECTION_MILLIS);
+	link->peerName = peerName;
+	link->isConnected = true;
+	link->peerCapabilities = LINK_CAPABILITY_HEARTBEAT;
+	otherLink->peerName = otherPeerName;
+	otherLink->isConnected = true;
+
+	// heard from at 1000 ms, then nothing: probed while there's still time, then found dead
+	Message * m = addHopMessage();
+	link->lastreceivedTime = 1000;
+	uint32_t now = 1000;
+	while (!link->isLinkFailed && now < 1000 + 2 * DETECTION_MILLIS) {
+		setHostMillis(now += 10);
+		bleStar.pollLinkHeartbeat(link);
+	}
+	CHECK(link->isLinkFailed);
+	CHECK(now > 1000 + DETECTION_MILLIS && now <= 1000 + DETECTION_MILLIS + 10);
+	CHECK(link->lastHeartbeatTime != 0);
+	CHECK(m->getMessageType() == MESSAGE_TYPE_HOP);								// nothing moves until the disconnect
+
+	setHostMillis(now += DISCONNECT_MILLIS);
+	bleStar.requeueMessagesForLink(link);
+	CHECK(m->getMessageType() == MESSAGE_TYPE_INCOMING && m->getRequiresRouting() && m->getToHop() == NULL);
+
+	BleLinkStatistics stats;
+	CHECK(bleStar.getLinkStatistics(BLE_CENTRAL_INDEX_0, &stats));
+	CHECK(stats.linkFailures == 1);
+	CHECK(stats.lastDetectionMillis > DETECTION_MILLIS && stats.lastDetectionMillis <= DETECTION_MILLIS + 10);
+	CHECK(stats.lastFailoverMillis == 0);										// not on the other link yet
+
+	setHostMillis(now += ROUTING_MILLIS);
+	routeOverOtherLink();
+	CHECK(m->getToHop() == otherPeerName);
+	CHECK(otherLink->sendChannel[0].messageBeingSent == m);
+	CHECK(bleStar.getLinkStatistics(BLE_CENTRAL_INDEX_0, &stats));
+	CHECK(stats.lastFailoverMillis == ROUTING_MILLIS);
+	bleStar.resetSendChannel(&otherLink->sendChannel[0]);
+	m->invalidateMessage();
+	if (bleStar.mTable.defragmentMessageTable()) { bleStar.mTable.defragmentMessageBuffer(); }
+
+	// a link the supervision timeout takes down first is found dead by the disconnect itself
+	bleStar.resetLinkCapabilities(link);
+	link->peerCapabilities = LINK_CAPABILITY_HEARTBEAT;
+	m = addHopMessage();
+	link->lastreceivedTime = now;
+	setHostMillis(now += 400);
+	bleStar.requeueMessagesForLink(link);
+	CHECK(m->getMessageType() == MESSAGE_TYPE_INCOMING && m->getRequiresRouting());
+	CHECK(bleStar.getLinkStatistics(BLE_CENTRAL_INDEX_0, &stats));
+	CHECK(stats.linkFailures == 2);
+	CHECK(stats.lastDetectionMillis == 400);
+	CHECK(stats.lastFailoverMillis == 0);
+
+	// the router takes a while to get to it this time
+	setHostMillis(now += 3 * ROUTING_MILLIS);
+	routeOverOtherLink();
+	CHECK(otherLink->sendChannel[0].messageBeingSent == m);
+	CHECK(bleStar.getLinkStatistics(BLE_CENTRAL_INDEX_0, &stats));
+	CHECK(stats.lastFailoverMillis == 3 * ROUTING_MILLIS);
+
+	return (getTestResult("LinkFailureTest"));
+}
@@ -0,0 +1,61 @@
+#include "HostTest.h"
+
+// Checks a compiled message's crc8 and crc16 survive the round trip: compiled, stored as bytes, copied into a received
+// messageTable entry the way Receive.cpp does, and validated both whole and as a running crc16 built up chunk by chunk
+
+static MessageTable & mTable = bleStar.mTable;
+static char origin[] = "node";
+static char destination[] = "dest";
+static char fromHop[] = "peer";
+
+static void checkRoundTrip(int payloadLength, uint8_t flags) {
+	static uint8_t payload[MAX_COMPILED_MESSAGE_LENGTH];
+	for (int i = 0; i < payloadLength; i++) { payload[i] = (uint8_t)(flags == 0 ? i * 7 : ' ' + i % 10); }	// the second compresses
+	Message * m = mTable.addNewMessageToSend(payload, payloadLength, origin, destination, 0x1234, true, flags);
+	CHECK(m != NULL);
+	if (m == NULL) { return; }
+
+	uint8_t * compiled = m->getStartOfCompiledMessage();
+	int messageLength = m->getStoredMessageLength();
+	uint16_t crc16 = m->getCalculatedMessageCrc16();
+	CHECK(compiled[COMPILED_MESSAGE_CRC16_POSITION] == (crc16 & 0xFF));			// LSB first
+	CHECK(compiled[COMPILED_MESSAGE_CRC16_POSITION + 1] == (crc16 >> 8));
+	CHECK(m->getStoredMessageCrc16() == crc16);
+	CHECK(m->getIsMessageCrc16Valid());
+	CHECK(m->getIsMessageCrc8Valid());											// the crc8 covers the crc16, so it's worked out after it
+	CHECK(Message::getIsMessageCrc8Valid(compiled));
+
+	Message * received = mTable.reserveSpaceForIncomingMessage(messageLength + 1, fromHop);
+	CHECK(received != NULL);
+	if (received == NULL) { return; }
+	memcpy(received->getStartOfCompiledMessage(), compiled, messageLength);
+	received->importMessage(received->getStartOfCompiledMessage(), received->getStartOfCompiledMessage(), fromHop);
+	CHECK(received->getIsMessageCrc8Valid());
+	CHECK(received->getIsMessageCrc16Valid());
+	CHECK(received->getMessageId() == 0x1234);
+	CHECK(strcmp(received->getDestination(), destination) == 0);
+
+	uint16_t runningCrc16 = CRC_START_MODBUS;									// as setChunkReceived keeps it
+	for (int i = COMPILED_MESSAGE_ORIGIN_NAME_POSITION; i < messageLength; i += DATA_CHUNK_PAYLOAD_LENGTH(MAX_BLE_CHUNK_LENGTH)) {
+		runningCrc16 = CRC::updateCrc16(runningCrc16, &received->getStartOfCompiledMessage()[i],
+				min(DATA_CHUNK_PAYLOAD_LENGTH(MAX_BLE_CHUNK_LENGTH), messageLength - i));
+	}
+	CHECK(received->getIsMessageCrc16Valid(runningCrc16));
+
+	received->getStartOfCompiledMessage()[messageLength - 2] ^= 0x01;			// one bit of the payload
+	CHECK(!received->getIsMessageCrc16Valid());
+	received->getStartOfCompiledMessage()[COMPILED_MESSAGE_CRC16_POSITION] ^= 0x01;	// the stored crc16, inside the crc8's range
+	CHECK(!received->getIsMessageCrc8Valid());
+
+	m->invalidateMessage();
+	received->invalidateMessage();
+}
+
+int main() {
+	checkRoundTrip(1, 0);
+	checkRoundTrip(200, 0);
+	checkRoundTrip(200, MESSAGE_PRIORITY_URGENT);
+	checkRoundTrip(1500, 0);
+
+	return (getTestResult("MessageCrcTest"));
+}
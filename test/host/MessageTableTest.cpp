@@ -0,0 +1,95 @@
+#define HOST_TEST_MESSAGE_BUFFER_CAPACITY			4000
+#include "HostTest.h"
+
+// Checks messageTable reclaims freed (MESSAGE_TYPE_NONE) entries, but never one a channel still points at, and that the
+// channels and the moved messages' bytes follow when entries are compacted.  Superseded (conflated) messages are freed
+// entries like any other
+
+// as a system message, so canAcceptMoreMessagesFromThisDevice doesn't limit how many come from one origin
+static Message * addMessage(const char * payload) {
+	return (bleStar.mTable.addNewMessageToSend((uint8_t *)payload, strlen(payload), (char *)"node", (char *)"dest", 1, true, MESSAGE_PRIORITY_NORMAL));
+}
+
+int main() {
+	MessageTable * mTable = &bleStar.mTable;
+
+	// freed entries at the bottom go, one a receive channel holds stays, and the entries above move down with it
+	Message * freed[10];
+	for (int i = 0; i < 10; i++) { freed[i] = addMessage("an old message"); }
+	Message * received = addMessage("being received");
+	Message * sent = addMessage("being sent");
+	addMessage("queued");
+	for (int i = 0; i < 10; i++) { freed[i]->invalidateMessage(); }
+	received->setMessageType(MESSAGE_TYPE_NONE);								// as reserveSpaceForIncomingMessage leaves it
+	bleStar.bleDeviceTable[BLE_PERIPHERAL_INDEX].receiveChannel[1].messageBeingReceived = received;
+	sent->setMessageType(MESSAGE_TYPE_HOP_SENDING);
+	bleStar.bleDeviceTable[BLE_PERIPHERAL_INDEX].sendChannel[2].messageBeingSent = sent;
+	int bufferSizeBefore = mTable->getMessageBufferSize();
+
+	CHECK(mTable->getMessageBufferNeedsDefragmentation() == false);				// 13 of 40 entries
+	CHECK(mTable->defragmentMessageTable());
+	mTable->defragmentMessageBuffer();
+	CHECK(mTable->getSize() == 3);
+	Message * m = bleStar.bleDeviceTable[BLE_PERIPHERAL_INDEX].receiveChannel[1].messageBeingReceived;
+	CHECK(m == mTable->getMessage(0));
+	CHECK(m->getStartOfCompiledMessage() == mTable->_messageBuffer);
+	CHECK(strcmp((char *)m->getPayload(), "being received") == 0);
+	CHECK(m->getMessageBuilder()->getBuffer() == m->getStartOfCompiledMessage());
+	m = bleStar.bleDeviceTable[BLE_PERIPHERAL_INDEX].sendChannel[2].messageBeingSent;
+	CHECK(m == mTable->getMessage(1));
+	CHECK(strcmp((char *)m->getPayload(), "being sent") == 0);
+	CHECK(m->getIsMessageCrc16Valid());
+	CHECK(strcmp(mTable->getMessage(2)->getOrigin(), "node") == 0 && strcmp(mTable->getMessage(2)->getDestination(), "dest") == 0);
+	CHECK(mTable->getMessageBufferSize() < bufferSizeBefore);
+
+	// every freed entry has a MessageBuilder of its own, or none, so reusing them can't clear a message still there
+	for (int i = mTable->getSize(); i < 13; i++) {
+		MessageBuilder * mb = mTable->getMessage(i)->getMessageBuilder();
+		for (int j = 0; j < i && mb != NULL; j++) { CHECK(mTable->getMessage(j)->getMessageBuilder() != mb); }
+	}
+	Message * reused = addMessage("reuses a freed entry");
+	CHECK(reused == mTable->getMessage(3));
+	CHECK(strcmp((char *)mTable->getMessage(0)->getPayload(), "being received") == 0);
+	CHECK(strcmp((char *)reused->getPayload(), "reuses a freed entry") == 0);
+
+	// freed entries at the top are trimmed straight away, without moving anything
+	reused->invalidateMessage();
+	mTable->getMessage(2)->invalidateMessage();
+	CHECK(mTable->trimMessageTable() == 2);
+	CHECK(mTable->getSize() == 2);
+
+	// once the channels let go, everything goes
+	bleStar.bleDeviceTable[BLE_PERIPHERAL_INDEX].receiveChannel[1].messageBeingReceived = NULL;
+	bleStar.resetSendChannel(&bleStar.bleDeviceTable[BLE_PERIPHERAL_INDEX].sendChannel[2]);
+	CHECK(mTable->trimMessageTable() == 2);
+	CHECK(mTable->getSize() == 0 && mTable->getMessageBufferSize() == 0);
+
+	// a stream of conflated readings never fills the table: each one frees the last, and loop() reclaims them, except
+	// the one a send channel has started and must finish
+	Message * sending = NULL;
+	Message * latest = NULL;
+	for (int i = 0; i < 200; i++) {
+		char reading[20];
+		snprintf(reading, sizeof(reading), "reading %d", i);
+		latest = bleStar.mTable.addNewMessageToSend((uint8_t *)reading, strlen(reading), (char *)"node", (char *)"dest", i, true,
+				MESSAGE_PRIORITY_NORMAL | COMPILED_MESSAGE_CONFLATE_BIT);
+		if (latest == NULL) { break; }
+		mTable->supersedeMessages(latest);
+		if (i == 5) {
+			sending = latest;
+			sending->setMessageType(MESSAGE_TYPE_HOP_SENDING);
+			bleStar.bleDeviceTable[BLE_PERIPHERAL_INDEX].sendChannel[0].messageBeingSent = sending;
+		}
+		mTable->defragmentMessages();
+		sending = bleStar.bleDeviceTable[BLE_PERIPHERAL_INDEX].sendChannel[0].messageBeingSent;
+		latest = mTable->getMessage(mTable->getSize() - 1);
+	}
+	CHECK(latest != NULL && strcmp((char *)latest->getPayload(), "reading 199") == 0);
+	CHECK(mTable->getSize() <= mTable->getCapacity() / 2 + 1);
+	CHECK(sending != NULL && sending->getMessageType() == MESSAGE_TYPE_HOP_SENDING && strcmp((char *)sending->getPayload(), "reading 5") == 0);
+	int queued = 0;
+	for (int i = 0; i < mTable->getSize(); i++) { queued += (mTable->getMessage(i)->getMessageType() == MESSAGE_TYPE_ORIGIN ? 1 : 0); }
+	CHECK(queued == 1);
+
+	return (getTestResult("MessageTableTest"));
+}
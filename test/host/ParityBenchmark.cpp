@@ -0,0 +1,173 @@
+#define HOST_TEST_MESSAGE_BUFFER_CAPACITY 20000									// three messages in flight, and their copies as they arrive
+#include "HostTest.h"
+#include <vector>
+
+// What parity chunks buy on a lossy link: messages sent one way with each chunk (parity chunks included) dropped at
+// random, with FEC off and at a few group sizes.  Reports payload bytes per second, the SACKs the receiver sent per
+// message (each one a resend round trip), and the chunks written per message against the fewest it could take.  The
+// link is simulated as in GoodputBenchmark, but each way has notifications of its own, and only chunks are lost
+
+#define CONNECTION_INTERVAL_MILLIS		8
+#define NOTIFICATIONS_PER_EVENT			6											// each way
+#define SIMULATED_MILLIS				20000
+#define PAYLOAD_LENGTH					1000
+#define CHANNELS_KEPT_BUSY				(BLE_LINK_CHANNELS - BLE_LINK_CHANNELS_KEPT_FOR_URGENT)
+
+static char thisDeviceName[] = "dest";
+static char peerName[] = "peer";
+static char * origins[CHANNELS_KEPT_BUSY] = { (char *)"s0", (char *)"s1", (char *)"s2" };
+static BleDeviceTable * sender = &bleStar.bleDeviceTable[BLE_CENTRAL_INDEX_0];
+static BleDeviceTable * receiver = &bleStar.bleDeviceTable[BLE_PERIPHERAL_INDEX];
+static uint8_t payload[PAYLOAD_LENGTH];
+static uint16_t nextMessageId = 1;
+static int compiledMessageLength = 0;
+
+// One direction of the link.  A write is a chunk or a control frame, and the FIFO takes all of it or none, so a lost
+// notification is a lost chunk.  Chunks are dropped at lossPermille
+class SimulatedUart : public Stream {
+public:
+	std::vector<uint8_t> sending;													// written during this connection event
+	std::vector<uint8_t> arriving;													// written during the last one
+	int notificationsLeft = 0;
+	int lossPermille = 0;
+	uint32_t random = 1;
+	uint32_t chunks = 0;
+	uint32_t selectiveAcks = 0;
+	size_t write(uint8_t c) { return (write(&c, 1)); }
+	size_t write(const uint8_t * buffer, size_t size) {
+		int notificationsNeeded = (int)(size + MAX_BLE_CHUNK_LENGTH - 1) / MAX_BLE_CHUNK_LENGTH;
+		if (notificationsNeeded > notificationsLeft) { return 0; }
+		notificationsLeft -= notificationsNeeded;
+		if (buffer[0] == LINK_CONTROL_FRAME_MARKER) {
+			selectiveAcks += (size > 1 && buffer[1] == LINK_CONTROL_SACK ? 1 : 0);
+		} else {
+			chunks++;
+			random = random * 1103515245 + 12345;
+			if ((int)((random >> 16) % 1000) < lossPermille) { return size; }	// gone, though the sender can't tell
+		}
+		sending.insert(sending.end(), buffer, buffer + size);
+		return size;
+	}
+	int available() { return 0; }
+	int read() { return -1; }
+};
+static SimulatedUart toReceiver;
+static SimulatedUart toSender;
+
+static uint32_t messagesDelivered = 0;
+static int messagesFailed = 0;
+static void messageDelivered(Message * m) {
+	messagesDelivered++;
+}
+static void messageFailed(uint16_t messageId) {
+	messagesFailed++;
+}
+
+// Hands everything that arrived on uart to bleDevice, as much as its staging buffer takes at a time
+static void deliver(SimulatedUart * uart, BleDeviceTable * bleDevice) {
+	size_t index = 0;
+	while (index < uart->arriving.size()) {
+		int length = min((int)(uart->arriving.size() - index), RECEIVE_STAGING_BUFFER_LENGTH - bleDevice->receiveStagingLength);
+		memcpy(&bleDevice->receiveStagingBuffer[bleDevice->receiveStagingLength], &uart->arriving[index], length);
+		bleDevice->receiveStagingLength += length;
+		index += length;
+		bleStar.processReceiveStagingBuffer(bleDevice);
+	}
+	uart->arriving.clear();
+}
+
+static void keepChannelsBusy() {
+	for (int i = 0; i < CHANNELS_KEPT_BUSY; i++) {
+		BleSendChannel * channel = &sender->sendChannel[i];
+		if (channel->messageBeingSent != NULL) { continue; }
+		Message * m = bleStar.mTable.addNewMessageToSend(payload, PAYLOAD_LENGTH, origins[i], thisDeviceName, nextMessageId++, false, MESSAGE_PRIORITY_NORMAL);
+		if (m == NULL) { return; }
+		m->setToHop(sender->peerName);
+		compiledMessageLength = m->getMessageBuilder()->getLength();
+		bleStar.assignMessageToSendChannel(m, sender, channel);
+	}
+}
+
+static void resetLink(BleDeviceTable * bleDevice, SimulatedUart * uart) {
+	bleStar.resetSendMessage(bleDevice);
+	for (int i = 0; i < BLE_LINK_CHANNELS; i++) {
+		bleDevice->receiveChannel[i].channel = i;
+		bleStar.resetReceiveChannel(&bleDevice->receiveChannel[i]);
+	}
+	bleDevice->receiveStagingLength = 0;
+	bleDevice->rtt.reset(bleStar.getInitialRttForConnection(0));
+	bleDevice->writer.attach(uart, NOTIFICATIONS_PER_EVENT * MAX_BLE_CHUNK_LENGTH * 1000 / CONNECTION_INTERVAL_MILLIS);
+	uart->sending.clear();
+	uart->arriving.clear();
+	uart->chunks = 0;
+	uart->selectiveAcks = 0;
+}
+
+static void runBenchmark(int lossPermille, int groupSize) {
+	bleStar.setForwardErrorCorrection(groupSize);
+	receiver->peerFecGroupSize = groupSize;
+	for (int i = 0; i < bleStar.mTable.getSize(); i++) { bleStar.mTable.getMessage(i)->invalidateMessage(); }
+	resetLink(sender, &toReceiver);
+	resetLink(receiver, &toSender);
+	bleStar.mTable.defragmentMessages();
+	toReceiver.lossPermille = lossPermille;
+	uint32_t repairedBefore = receiver->chunksRepairedByParity;
+	messagesDelivered = 0;
+	messagesFailed = 0;
+
+	uint32_t start = millis();
+	uint32_t now = start;
+	while (now - start < SIMULATED_MILLIS) {
+		setHostMillis(++now);
+		if (now % CONNECTION_INTERVAL_MILLIS == 0) {								// what was written during the last event arrives
+			toReceiver.notificationsLeft = NOTIFICATIONS_PER_EVENT;
+			toSender.notificationsLeft = NOTIFICATIONS_PER_EVENT;
+			toReceiver.arriving.swap(toReceiver.sending);
+			toSender.arriving.swap(toSender.sending);
+			deliver(&toReceiver, receiver);
+			deliver(&toSender, sender);
+		}
+		if (bleStar.mTable.defragmentMessageTable()) { bleStar.mTable.defragmentMessageBuffer(); }	// frees the origins of finished messages
+		sender->writer.beginPass();
+		receiver->writer.beginPass();
+		keepChannelsBusy();
+		bleStar.pollSendingMessage(sender);
+		bleStar.pollReceivingMessage(BLE_PERIPHERAL_INDEX);							// its SACK timers, for lost tails
+	}
+
+	int chunksPerMessage = bleStar.getNumberOfChunksForMessageLength(compiledMessageLength, MAX_BLE_CHUNK_LENGTH);
+	uint32_t messages = max((uint32_t)1, messagesDelivered);
+	char groupSizeText[8];
+	snprintf(groupSizeText, sizeof(groupSizeText), groupSize == 0 ? "off" : "%d", groupSize);
+	printf("%5d.%d%% %6s %10u %8u %12u.%02u %12u.%d  (%d) %10u %7d\n", lossPermille / 10, lossPermille % 10,
+			groupSizeText, messagesDelivered * PAYLOAD_LENGTH / (SIMULATED_MILLIS / 1000), messagesDelivered,
+			toSender.selectiveAcks / messages, toSender.selectiveAcks * 100 / messages % 100,
+			toReceiver.chunks / messages, toReceiver.chunks * 10 / messages % 10, chunksPerMessage,
+			receiver->chunksRepairedByParity - repairedBefore, messagesFailed);
+}
+
+int main() {
+	bleStar._thisDeviceName = thisDeviceName;
+	bleStar.setRoutedMessageReceivedCallback(messageDelivered);
+	bleStar.setTransmissionFailedCallback(messageFailed);
+	sender->peerName = thisDeviceName;												// the receiver is this device, so everything sent is delivered
+	sender->peerCapabilities = LINK_CAPABILITY_PARITY_CHUNKS;
+	receiver->peerName = peerName;
+	receiver->isConnected = true;
+	uint32_t random = 1;
+	for (int i = 0; i < PAYLOAD_LENGTH; i++) {										// incompressible, so it's sent as is
+		random = random * 1103515245 + 12345;
+		payload[i] = (uint8_t)(random >> 16);
+	}
+
+	printf("%d byte messages in %d byte chunks, %d notifications per %dms event each way\n", PAYLOAD_LENGTH, MAX_BLE_CHUNK_LENGTH,
+			NOTIFICATIONS_PER_EVENT, CONNECTION_INTERVAL_MILLIS);
+	printf("%7s %6s %10s %8s %15s %19s %10s %7s\n", "loss", "FEC K", "B/s", "messages", "SACKs/message", "chunks/message (min)",
+			"repaired", "failed");
+	int lossPermilles[] = { 0, 10, 50, 100 };
+	int groupSizes[] = { 0, 4, 8, 16 };
+	for (int lossPermille : lossPermilles) {
+		for (int groupSize : groupSizes) { runBenchmark(lossPermille, groupSize); }
+	}
+	return 0;
+}
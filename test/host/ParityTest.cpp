@@ -0,0 +1,121 @@
+#include "HostTest.h"
+#include <vector>
+
+// Sends a message with parity chunks through a link's real send path, then feeds the frames to a receive channel with
+// chunks dropped: one lost from a group is rebuilt from the group's parity chunk with no SACK, two lost from a group
+// can't be and are left for a SACK
+
+#define FEC_GROUP_SIZE			4
+#define PAYLOAD_LENGTH			300
+
+static char thisDeviceName[] = "dest";
+static char peerName[] = "peer";
+static uint8_t payload[PAYLOAD_LENGTH];
+
+// The sending link's UART: keeps everything written, so each chunk's frame can be cut out of it
+class CaptureUart : public Stream {
+public:
+	std::vector<uint8_t> bytes;
+	size_t write(uint8_t c) { bytes.push_back(c); return 1; }
+	using Print::write;
+	int available() { return 0; }
+	int read() { return -1; }
+};
+static CaptureUart uart;
+
+struct Frame { std::vector<uint8_t> bytes; int chunkNumber; boolean isParity; };
+static std::vector<Frame> frames;
+
+static int messagesDelivered = 0;
+static void messageDelivered(Message * m) {
+	messagesDelivered++;
+	CHECK(memcmp(m->getPayload(), payload, PAYLOAD_LENGTH) == 0);
+}
+
+static void sendMessage() {
+	BleDeviceTable * sender = &bleStar.bleDeviceTable[BLE_CENTRAL_INDEX_0];
+	sender->peerName = thisDeviceName;
+	sender->peerCapabilities = LINK_CAPABILITY_PARITY_CHUNKS;
+	sender->congestionWindow = MAX_BLE_CHUNKS;
+	sender->writer.attach(&uart, 100000);
+	bleStar.setForwardErrorCorrection(FEC_GROUP_SIZE);
+
+	uint32_t random = 1;
+	for (int i = 0; i < PAYLOAD_LENGTH; i++) {									// incompressible, so it's sent as is
+		random = random * 1103515245 + 12345;
+		payload[i] = (uint8_t)(random >> 16);
+	}
+	Message * m = bleStar.mTable.addNewMessageToSend(payload, PAYLOAD_LENGTH, peerName, thisDeviceName, 7, false, MESSAGE_PRIORITY_NORMAL);
+	BleSendChannel * channel = &sender->sendChannel[0];
+	bleStar.assignMessageToSendChannel(m, sender, channel);
+	CHECK(channel->fecGroupSize == FEC_GROUP_SIZE);
+
+	uint32_t now = 0;
+	for (int pass = 0; pass < 10000; pass++) {
+		setHostMillis(now += 10);
+		sender->writer.beginPass();
+		size_t frameStart = uart.bytes.size();
+		boolean isParity = (channel->sendParityChunkCount > 0);
+		int chunkNumber = (isParity ? channel->sendParityFromChunk : channel->sendChunkInProgress);
+		int result = bleStar.writeNextChunk(sender, channel);
+		if (result == CHUNK_WRITE_NOTHING_TO_SEND) { break; }
+		if (result != CHUNK_WRITE_COMPLETE) { continue; }
+		Frame frame = { std::vector<uint8_t>(uart.bytes.begin() + frameStart, uart.bytes.end()), chunkNumber, isParity };
+		frames.push_back(frame);
+	}
+	CHECK(channel->sendChunksExpected > 2 * FEC_GROUP_SIZE);
+}
+
+// Feeds every frame but the dropped chunks to the receiving link, a frame at a time.  Returns the chunks repaired
+static int receiveMessage(std::vector<int> droppedChunks) {
+	BleDeviceTable * receiver = &bleStar.bleDeviceTable[BLE_PERIPHERAL_INDEX];
+	receiver->peerName = peerName;
+	receiver->peerFecGroupSize = FEC_GROUP_SIZE;
+	uint32_t repairedBefore = receiver->chunksRepairedByParity;
+	messagesDelivered = 0;
+
+	for (Frame & frame : frames) {
+		boolean isDropped = false;
+		for (int chunk : droppedChunks) { isDropped = isDropped || (!frame.isParity && frame.chunkNumber == chunk); }
+		if (isDropped) { continue; }
+		memcpy(receiver->receiveStagingBuffer, frame.bytes.data(), frame.bytes.size());
+		receiver->receiveStagingLength = (int)frame.bytes.size();
+		bleStar.processReceiveStagingBuffer(receiver);
+		CHECK(receiver->receiveStagingLength == 0);
+	}
+	return ((int)(receiver->chunksRepairedByParity - repairedBefore));
+}
+
+int main() {
+	bleStar._thisDeviceName = thisDeviceName;
+	bleStar.setRoutedMessageReceivedCallback(messageDelivered);
+	BleReceiveChannel * channel = &bleStar.bleDeviceTable[BLE_PERIPHERAL_INDEX].receiveChannel[0];
+
+	sendMessage();
+	int parityChunks = 0;
+	for (Frame & frame : frames) { parityChunks += (frame.isParity ? 1 : 0); }
+	int dataChunks = (int)frames.size() - parityChunks;
+	CHECK(parityChunks == (dataChunks - 1 + FEC_GROUP_SIZE - 1) / FEC_GROUP_SIZE);	// every group from chunk 1, the last maybe short
+
+	// nothing lost
+	CHECK(receiveMessage({}) == 0);
+	CHECK(messagesDelivered == 1);
+
+	// one chunk from each of three groups, including the last chunk of the message, in the last (short) group
+	CHECK(receiveMessage({ 2, FEC_GROUP_SIZE + 4, dataChunks - 1 }) == 3);
+	CHECK(messagesDelivered == 1);
+	CHECK(channel->messageBeingReceived == NULL);
+
+	// the first chunk of one group and the last of the next
+	CHECK(receiveMessage({ FEC_GROUP_SIZE + 1, 3 * FEC_GROUP_SIZE }) == 2);
+	CHECK(messagesDelivered == 1);
+
+	// two from the same group: the parity can't rebuild either, so the message waits for them to be resent
+	CHECK(receiveMessage({ 1, 3 }) == 0);
+	CHECK(messagesDelivered == 0);
+	CHECK(channel->messageBeingReceived != NULL);
+	CHECK(!bleStar.getChunkReceived(channel, 1) && !bleStar.getChunkReceived(channel, 3) && bleStar.getChunkReceived(channel, 2));
+	bleStar.failAndClearReceiveChannel(&bleStar.bleDeviceTable[BLE_PERIPHERAL_INDEX], channel);
+
+	return (getTestResult("ParityTest"));
+}
@@ -0,0 +1,255 @@
+#include "HostTest.h"
+#include <chrono>
+
+// Bytes per second through the chunk-at-a-time receive path (processReceiveStagingBuffer and decodeReceivedFrame) and
+// through the byte-at-a-time parser it replaced.  Both are fed the same messages, in order with nothing lost, in the
+// 20 byte chunks every link starts with; the new path is also run at the largest negotiated chunk length.  Each
+// complete message is imported and delivered the same way, and its messageTable entry freed, so only the parsing differs
+
+static char peerName[] = "peer";
+static char thisDeviceName[] = "dest";
+
+// ------------ the byte-at-a-time parser, as parseAndReorderReceivedData was before chunk-granular receive -------------
+//
+// The state machine and per-byte work are unchanged.  Two slips that stopped it getting past chunk 0 are fixed: it
+// read the stored length from a messageBeingReceived that didn't exist yet, and only looked for a chunk number when
+// indexWithinReceiveChunk was 0, which it never was after chunk 0
+
+#define AWAITING_END_OF_FIRST_CHUNK								2
+#define AWAITING_START_OF_IN_SEQUENCE_CHUNK						3
+#define AWAITING_START_OF_OUT_OF_SEQUENCE_CHUNK					4
+#define AWAITING_END_OF_IN_SEQUENCE_CHUNK						5
+#define AWAITING_END_OF_OUT_OF_SEQUENCE_CHUNK					6
+
+struct ByteParser {
+	int receiveState = AWAITING_NEW_MESSAGE;
+	int indexWithinReceiveChunk = 0;
+	int receiveChunkInProgress = 0;
+	int receiveChunksExpected = 0;
+	uint32_t lastreceivedTime = 0;
+	MessageBuilder tempReceiveBuffer = MessageBuilder(MAX_BLE_CHUNK_LENGTH);
+	MessageBuilder * receiveBuffer = &tempReceiveBuffer;
+	boolean isUsingTempReceiveBuffer = true;
+	Message * messageBeingReceived = NULL;
+	uint8_t receivedChunkFlags[CHUNK_FLAG_TABLE_CAPACITY];
+
+	ByteParser() { reset(); }
+
+	static int getMessageBuilderIndexForChunkNumber(int chunkNumber) {
+		return (chunkNumber > 0 ? MAX_BLE_CHUNK_LENGTH + (chunkNumber - 1) * (MAX_BLE_CHUNK_LENGTH - 1) : 0);
+	}
+	static int getNumberOfChunksForMessageLength(int messageLength) {
+		return (messageLength <= MAX_BLE_CHUNK_LENGTH ? 1 : 2 + (messageLength - MAX_BLE_CHUNK_LENGTH - 1) / (MAX_BLE_CHUNK_LENGTH - 1));
+	}
+
+	void reset() {
+		receiveState = AWAITING_NEW_MESSAGE;
+		indexWithinReceiveChunk = 0;
+		tempReceiveBuffer.reset();
+		isUsingTempReceiveBuffer = true;
+		receiveBuffer = &tempReceiveBuffer;
+		if (messageBeingReceived != NULL) { messageBeingReceived->setMessageType(MESSAGE_TYPE_NONE); }
+		messageBeingReceived = NULL;
+		memset(receivedChunkFlags, 0xFF, sizeof(receivedChunkFlags));
+	}
+
+	void setChunkReceived(int chunkNumber) { receivedChunkFlags[chunkNumber / 8] &= ~(1 << (chunkNumber % 8)); }
+	boolean getAllChunksReceived() {
+		for (int i = 0; i < receiveChunksExpected; i++) {
+			if ((receivedChunkFlags[i / 8] & (1 << (i % 8))) != 0) { return false; }
+		}
+		return true;
+	}
+
+	void parse(uint8_t u) {
+		lastreceivedTime = millis();
+		switch (receiveState) {
+			case AWAITING_NEW_MESSAGE:
+				if (u < ' ') { return; }
+				receiveState = (u == '#' ? AWAITING_END_OF_FIRST_CHUNK : RECEIVING_UNFORMED_MESSAGE);
+				break;
+			case AWAITING_START_OF_IN_SEQUENCE_CHUNK: parseExpectedStartOfChunk(u, true); return;
+			case AWAITING_START_OF_OUT_OF_SEQUENCE_CHUNK: parseExpectedStartOfChunk(u, false); return;
+		}
+
+		if (!receiveBuffer->append(u)) {
+			if (!isUsingTempReceiveBuffer) { reset(); return; }
+			messageBeingReceived = bleStar.mTable.reserveSpaceForIncomingMessage(DEFAULT_EXPECTED_MESSAGE_LENGTH * 8, peerName);
+			if (messageBeingReceived == NULL) { reset(); return; }
+			receiveBuffer = messageBeingReceived->getMessageBuilder();
+			receiveBuffer->append(tempReceiveBuffer.getBuffer(), tempReceiveBuffer.getLength());
+			receiveBuffer->append(u);
+			isUsingTempReceiveBuffer = false;
+		}
+		indexWithinReceiveChunk++;
+
+		switch (receiveState) {
+			case AWAITING_END_OF_FIRST_CHUNK: checkForFirstChunkComplete(); return;
+			case AWAITING_END_OF_IN_SEQUENCE_CHUNK: checkForEndOfChunk(); return;
+			case AWAITING_END_OF_OUT_OF_SEQUENCE_CHUNK: checkForEndOfChunk(); return;
+		}
+	}
+
+	void parseExpectedStartOfChunk(uint8_t u, boolean isInSequence) {
+		if (isInSequence && u == receiveChunkInProgress) {
+			receiveState = AWAITING_END_OF_IN_SEQUENCE_CHUNK;
+			return;
+		}
+		if (u > receiveChunksExpected) { reset(); return; }
+		receiveChunkInProgress = u;
+		receiveBuffer->setReadIndex(getMessageBuilderIndexForChunkNumber(u));
+	}
+
+	void checkForFirstChunkComplete() {
+		if (indexWithinReceiveChunk < COMPILED_MESSAGE_ORIGIN_NAME_POSITION) { return; }
+		uint16_t messageLength = Message::getStoredMessageLength(receiveBuffer->getBuffer());
+		if (indexWithinReceiveChunk != MAX_BLE_CHUNK_LENGTH && receiveBuffer->getLength() < messageLength) { return; }
+		if (!Message::getIsMessageCrc8Valid(receiveBuffer->getBuffer())) { reset(); return; }
+
+		receiveChunksExpected = getNumberOfChunksForMessageLength(messageLength);
+		setChunkReceived(0);
+		receiveChunkInProgress = 1;
+		indexWithinReceiveChunk = 1;
+		receiveState = AWAITING_START_OF_IN_SEQUENCE_CHUNK;
+	}
+
+	void checkForEndOfChunk() {
+		uint16_t messageLengthPerHeaderPreamble = messageBeingReceived->getStoredMessageLength();
+		int currentMessageLength = receiveBuffer->getLength();
+
+		if (currentMessageLength < messageLengthPerHeaderPreamble) {
+			if (indexWithinReceiveChunk < MAX_BLE_CHUNK_LENGTH) { return; }
+			setChunkReceived(receiveChunkInProgress);
+			indexWithinReceiveChunk = 1;
+			receiveChunkInProgress += (receiveState == AWAITING_END_OF_IN_SEQUENCE_CHUNK ? 1 : 0);
+			receiveState = (receiveState == AWAITING_END_OF_IN_SEQUENCE_CHUNK ?
+					AWAITING_START_OF_IN_SEQUENCE_CHUNK : AWAITING_START_OF_OUT_OF_SEQUENCE_CHUNK);
+			return;
+		}
+
+		setChunkReceived(receiveChunkInProgress);
+		if (!getAllChunksReceived()) {
+			receiveState = AWAITING_START_OF_OUT_OF_SEQUENCE_CHUNK;
+			indexWithinReceiveChunk = 1;
+			return;
+		}
+		if (messageBeingReceived->getIsMessageCrc16Valid()) {
+			Message * m = messageBeingReceived;
+			messageBeingReceived = NULL;
+			m->importMessage(m->getStartOfCompiledMessage(), m->getStartOfCompiledMessage(), peerName);
+			bleStar.deliverRoutedMessage(m);
+		}
+		reset();
+	}
+};
+
+
+// ------------ the streams each parser is fed ------------------------------------------------------------------------
+
+static int compileMessage(uint8_t * compiled, int payloadLength) {
+	static uint8_t payload[MAX_COMPILED_MESSAGE_LENGTH];
+	uint32_t random = 1;
+	for (int i = 0; i < payloadLength; i++) {									// incompressible, so delivering it costs next to nothing
+		random = random * 1103515245 + 12345;
+		payload[i] = (uint8_t)(random >> 16);
+	}
+	Message * m = bleStar.mTable.addNewMessageToSend(payload, payloadLength, peerName, thisDeviceName, 1, false, MESSAGE_PRIORITY_NORMAL);
+	int length = m->getStoredMessageLength();
+	memcpy(compiled, m->getStartOfCompiledMessage(), length);
+	m->invalidateMessage();
+	bleStar.mTable.trimMessageTable();
+	return length;
+}
+
+static int appendByteParserStream(uint8_t * stream, uint8_t * compiled, int messageLength) {
+	int length = 0;
+	for (int chunk = 0; chunk < ByteParser::getNumberOfChunksForMessageLength(messageLength); chunk++) {
+		int chunkStart = ByteParser::getMessageBuilderIndexForChunkNumber(chunk);
+		int chunkEnd = min(messageLength, ByteParser::getMessageBuilderIndexForChunkNumber(chunk + 1));
+		if (chunk > 0) { stream[length++] = (uint8_t)chunk; }
+		memcpy(&stream[length], &compiled[chunkStart], chunkEnd - chunkStart);
+		length += chunkEnd - chunkStart;
+	}
+	return length;
+}
+
+// Chunk 0 carries the chunk length, so either chunk length decodes on the same link
+static int appendChunkStream(uint8_t * stream, uint8_t * compiled, int messageLength, int chunkLength) {
+	int length = 0;
+	for (int chunk = 0; chunk < bleStar.getNumberOfChunksForMessageLength(messageLength, chunkLength); chunk++) {
+		int chunkStart = bleStar.getMessageBuilderIndexForChunkNumber(chunk, chunkLength);
+		int chunkEnd = min(messageLength, bleStar.getMessageBuilderIndexForChunkNumber(chunk + 1, chunkLength));
+		stream[length++] = (uint8_t)(chunk == 0 ? FIRST_CHUNK_MARKER : DATA_CHUNK_MARKER);
+		stream[length++] = (uint8_t)(chunk == 0 ? chunkLength : chunk);
+		stream[length++] = (uint8_t)(chunkEnd - chunkStart);
+		memcpy(&stream[length], &compiled[chunkStart], chunkEnd - chunkStart);
+		length += chunkEnd - chunkStart;
+	}
+	return length;
+}
+
+
+// ------------ the runs -----------------------------------------------------------------------------------------------
+
+#define MESSAGES_PER_RUN		2000
+
+static double getSeconds(std::chrono::steady_clock::time_point start) {
+	return (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+}
+
+static void report(const char * name, int payloadLength, long bytes, double seconds, int delivered) {
+	printf("%-32s %5d byte payload  %8.1f MB/s  (%d of %d messages)\n", name, payloadLength, bytes / seconds / 1e6, delivered, MESSAGES_PER_RUN);
+}
+
+static int deliveredCount = 0;
+static void messageDelivered(Message * m) { deliveredCount++; }
+
+static void runByteParser(uint8_t * compiled, int messageLength, int payloadLength) {
+	static uint8_t stream[MAX_COMPILED_MESSAGE_LENGTH * 2];
+	int streamLength = appendByteParserStream(stream, compiled, messageLength);
+	ByteParser parser;
+	deliveredCount = 0;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < MESSAGES_PER_RUN; i++) {
+		for (int j = 0; j < streamLength; j++) { parser.parse(stream[j]); }
+		bleStar.mTable.trimMessageTable();
+	}
+	report("byte at a time, 20 byte chunks", payloadLength, (long)streamLength * MESSAGES_PER_RUN, getSeconds(start), deliveredCount);
+}
+
+static void runChunkParser(uint8_t * compiled, int messageLength, int payloadLength, int chunkLength, const char * name) {
+	static uint8_t stream[MAX_COMPILED_MESSAGE_LENGTH * 2];
+	int streamLength = appendChunkStream(stream, compiled, messageLength, chunkLength);
+	BleDeviceTable * bleDevice = &bleStar.bleDeviceTable[BLE_PERIPHERAL_INDEX];
+	deliveredCount = 0;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < MESSAGES_PER_RUN; i++) {
+		for (int j = 0; j < streamLength; ) {									// as readFromBleDevice fills the staging buffer
+			int bytesRead = min(streamLength - j, RECEIVE_STAGING_BUFFER_LENGTH - bleDevice->receiveStagingLength);
+			memcpy(&bleDevice->receiveStagingBuffer[bleDevice->receiveStagingLength], &stream[j], bytesRead);
+			bleDevice->receiveStagingLength += bytesRead;
+			j += bytesRead;
+			bleStar.processReceiveStagingBuffer(bleDevice);
+		}
+		bleStar.mTable.trimMessageTable();
+	}
+	report(name, payloadLength, (long)streamLength * MESSAGES_PER_RUN, getSeconds(start), deliveredCount);
+}
+
+int main() {
+	bleStar._thisDeviceName = thisDeviceName;
+	bleStar.bleDeviceTable[BLE_PERIPHERAL_INDEX].peerName = peerName;
+	bleStar.setRoutedMessageReceivedCallback(messageDelivered);
+
+	int payloadLengths[] = { 40, 400, 1800 };
+	static uint8_t compiled[MAX_COMPILED_MESSAGE_LENGTH];
+	for (int payloadLength : payloadLengths) {
+		int messageLength = compileMessage(compiled, payloadLength);
+		runByteParser(compiled, messageLength, payloadLength);
+		runChunkParser(compiled, messageLength, payloadLength, MAX_BLE_CHUNK_LENGTH, "chunk at a time, 20 byte chunks");
+		runChunkParser(compiled, messageLength, payloadLength, MAX_NEGOTIATED_BLE_CHUNK_LENGTH, "chunk at a time, largest chunks");
+	}
+	return 0;
+}
@@ -0,0 +1,78 @@
+#include "HostTest.h"
+
+// Checks a chunk that fits no message on its channel is skipped on its own: a late resend, a chunk whose chunk 0 was
+// lost, a chunk number past the end, or a stray parity chunk costs nothing but that frame, on that channel or any other
+
+static char thisDeviceName[] = "dest";
+static char peerName[] = "peer";
+static BleDeviceTable * receiver = &bleStar.bleDeviceTable[BLE_PERIPHERAL_INDEX];
+
+static int messagesDelivered = 0;
+static void messageDelivered(Message * m) { messagesDelivered++; }
+
+static uint8_t compiled[2][MAX_COMPILED_MESSAGE_LENGTH];
+static int messageLength[2];
+
+static void compileMessage(int i, int payloadLength) {
+	static uint8_t payload[MAX_COMPILED_MESSAGE_LENGTH];
+	uint32_t random = (uint32_t)i + 1;
+	for (int j = 0; j < payloadLength; j++) {									// incompressible, so it's sent as is
+		random = random * 1103515245 + 12345;
+		payload[j] = (uint8_t)(random >> 16);
+	}
+	Message * m = bleStar.mTable.addNewMessageToSend(payload, payloadLength, peerName, thisDeviceName, (uint16_t)(i + 1), false, MESSAGE_PRIORITY_NORMAL);
+	messageLength[i] = m->getStoredMessageLength();
+	memcpy(compiled[i], m->getStartOfCompiledMessage(), messageLength[i]);
+	m->invalidateMessage();
+	bleStar.mTable.trimMessageTable();
+}
+
+// Feeds the receiving link one frame: chunk chunkNumber of message i on channel, as writeNextChunk frames it
+static void receiveChunk(int i, int channel, int chunkNumber) {
+	uint8_t * frame = receiver->receiveStagingBuffer;
+	int chunkStart = bleStar.getMessageBuilderIndexForChunkNumber(chunkNumber, MAX_BLE_CHUNK_LENGTH);
+	int chunkEnd = min(messageLength[i], bleStar.getMessageBuilderIndexForChunkNumber(chunkNumber + 1, MAX_BLE_CHUNK_LENGTH));
+	frame[0] = (uint8_t)((chunkNumber == 0 ? FIRST_CHUNK_MARKER : DATA_CHUNK_MARKER) | channel);
+	frame[1] = (uint8_t)(chunkNumber == 0 ? MAX_BLE_CHUNK_LENGTH : chunkNumber);
+	frame[DATA_CHUNK_PAYLOAD_LENGTH_POSITION] = (uint8_t)max(0, chunkEnd - chunkStart);
+	memcpy(&frame[DATA_CHUNK_HEADER_LENGTH], &compiled[i][chunkStart], max(0, chunkEnd - chunkStart));
+	receiver->receiveStagingLength = DATA_CHUNK_HEADER_LENGTH + frame[DATA_CHUNK_PAYLOAD_LENGTH_POSITION];
+	bleStar.processReceiveStagingBuffer(receiver);
+	CHECK(receiver->receiveStagingLength == 0);									// the whole frame, and only it, was used
+}
+
+static int getChunks(int i) { return (bleStar.getNumberOfChunksForMessageLength(messageLength[i], MAX_BLE_CHUNK_LENGTH)); }
+
+int main() {
+	bleStar._thisDeviceName = thisDeviceName;
+	bleStar.setRoutedMessageReceivedCallback(messageDelivered);
+	receiver->peerName = peerName;
+	compileMessage(0, 200);
+	compileMessage(1, 100);
+
+	// message 0 on channel 0, with strays on channels 0 and 1 between its chunks
+	receiveChunk(0, 0, 0);
+	receiveChunk(1, 1, 3);														// channel 1 never saw its chunk 0
+	receiveChunk(0, 0, 1);
+	receiveChunk(1, 0, getChunks(0) + 1);										// past the end of channel 0's message
+	uint8_t parity[] = { PARITY_CHUNK_MARKER | 1, 1, 2, 3, 0, 0, 0 };			// a parity chunk for channel 1, which has no message
+	memcpy(receiver->receiveStagingBuffer, parity, sizeof(parity));
+	receiver->receiveStagingLength = sizeof(parity);
+	bleStar.processReceiveStagingBuffer(receiver);
+	CHECK(receiver->receiveStagingLength == 0);
+	for (int n = 2; n < getChunks(0); n++) { receiveChunk(0, 0, n); }
+	CHECK(messagesDelivered == 1);
+
+	// a late resend of a chunk of message 0, now complete, then message 1 on the same channel
+	receiveChunk(0, 0, 2);
+	for (int n = 0; n < getChunks(1); n++) { receiveChunk(1, 0, n); }
+	CHECK(messagesDelivered == 2);
+
+	// message 1's chunk 0 lost on channel 2: the rest is skipped, and a resend from chunk 0 still arrives
+	for (int n = 1; n < getChunks(1); n++) { receiveChunk(1, 2, n); }
+	CHECK(receiver->receiveChannel[2].messageBeingReceived == NULL);
+	for (int n = 0; n < getChunks(1); n++) { receiveChunk(1, 2, n); }
+	CHECK(messagesDelivered == 3);
+
+	return (getTestResult("ReceiveTest"));
+}
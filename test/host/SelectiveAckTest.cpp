@@ -0,0 +1,68 @@
+#include "HostTest.h"
+
+// Checks a chunk a SACK reports missing is counted lost once per send, however many later SACKs report the same hole
+// before its resend arrives, so the link's loss rate and congestion window only see it once
+
+static char thisDeviceName[] = "node";
+static char peerName[] = "peer";
+static BleDeviceTable * sender = &bleStar.bleDeviceTable[BLE_CENTRAL_INDEX_0];
+static BleSendChannel * channel = &sender->sendChannel[0];
+static uint32_t now = 0;
+
+// Assigns a new message to channel 0, and marks all its chunks sent.  As a system message, so canAcceptMoreMessagesFromThisDevice
+// doesn't limit how many come from one origin
+static void sendMessage(uint16_t messageId) {
+	static uint8_t payload[300];
+	uint32_t random = messageId;
+	for (int i = 0; i < (int)sizeof(payload); i++) {							// incompressible, so it's several chunks
+		random = random * 1103515245 + 12345;
+		payload[i] = (uint8_t)(random >> 16);
+	}
+	Message * m = bleStar.mTable.addNewMessageToSend(payload, sizeof(payload), peerName, thisDeviceName, messageId, true, MESSAGE_PRIORITY_NORMAL);
+	bleStar.assignMessageToSendChannel(m, sender, channel);
+	for (int i = 0; i < channel->sendChunksExpected; i++) { bleStar.setChunkSent(channel, i); }
+	channel->sendChunkInProgress = channel->sendChunksExpected;
+}
+
+// A SACK from the peer reporting chunk missingChunk missing, long enough after the last that the window may shrink again
+static void receiveSelectiveAck(int missingChunk) {
+	setHostMillis(now += 10 * sender->rtt.getSrtt());
+	uint16_t crc16 = channel->messageBeingSent->getStoredMessageCrc16();
+	uint8_t body[SACK_BODY_HEADER_LENGTH + 1] = { 0, (uint8_t)(crc16 >> 8), (uint8_t)crc16, (uint8_t)missingChunk, 8, 0x01 };
+	bleStar.processSelectiveAck(sender, body, sizeof(body));
+}
+
+int main() {
+	bleStar._thisDeviceName = thisDeviceName;
+	sender->peerName = peerName;
+	sender->congestionWindow = 32;
+	sendMessage(1);
+	CHECK(channel->sendChunksExpected > 4);
+
+	// the hole is reported, resent, and reported again by SACKs sent before the resend arrived
+	receiveSelectiveAck(2);
+	CHECK(sender->chunksLostInWindow == 1);
+	CHECK(sender->congestionWindow == 16);
+	CHECK(bleStar.getChunkNeedsToBeSent(channel, 2));
+	for (int i = 0; i < 3; i++) {
+		bleStar.setChunkSent(channel, 2);
+		receiveSelectiveAck(2);
+		CHECK(bleStar.getChunkNeedsToBeSent(channel, 2));						// still resent each time
+	}
+	CHECK(sender->chunksLostInWindow == 1);
+	CHECK(sender->congestionWindow == 16);
+
+	// a different chunk of the same message is a new loss
+	bleStar.setChunkSent(channel, 2);
+	receiveSelectiveAck(3);
+	CHECK(sender->chunksLostInWindow == 2);
+	CHECK(sender->congestionWindow == 8);
+
+	// the next message on the channel counts its own losses afresh
+	bleStar.resetSendChannel(channel);
+	sendMessage(2);
+	receiveSelectiveAck(2);
+	CHECK(sender->chunksLostInWindow == 3);
+
+	return (getTestResult("SelectiveAckTest"));
+}
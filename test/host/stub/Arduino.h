@@ -0,0 +1,56 @@
+#ifndef Arduino_h
+#define Arduino_h
+
+// Just enough of the Arduino core for the library's platform independent files to build and run on the host
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <type_traits>
+
+typedef bool boolean;
+class __FlashStringHelper;
+#define F(x) (x)
+
+template<class T, class U> typename std::common_type<T, U>::type min(T a, U b) { return (a < b ? a : b); }
+template<class T, class U> typename std::common_type<T, U>::type max(T a, U b) { return (a > b ? a : b); }
+
+uint32_t millis();
+void delay(uint32_t ms);
+void setHostMillis(uint32_t ms);												// host only: moves the clock millis() reads
+
+class Print {
+public:
+	virtual size_t write(uint8_t c) = 0;
+	virtual size_t write(const uint8_t * buffer, size_t size) { for (size_t i = 0; i < size; i++) { write(buffer[i]); } return size; }
+	size_t print(const char * s) { return fputs(s, stdout); }
+	size_t print(int i) { return ::printf("%d", i); }
+	size_t println(const char * s) { return puts(s); }
+	size_t println() { return puts(""); }
+	size_t printf(const char * format, ...) { va_list args; va_start(args, format); int n = vprintf(format, args); va_end(args); return n; }
+};
+
+class Stream : public Print {
+public:
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual int peek() { return -1; }
+	virtual void flush() {}
+	int read(uint8_t * buffer, size_t size) { size_t n = 0; while (n < size && available() > 0) { buffer[n++] = (uint8_t)read(); } return (int)n; }
+};
+
+class HardwareSerial : public Stream {
+public:
+	size_t write(uint8_t c) { return (size_t)putchar(c); }
+	using Print::write;
+	int available() { return 0; }
+	int read() { return -1; }
+	operator bool() { return false; }											// so the library's Loggers stay quiet
+};
+extern HardwareSerial Serial;
+
+#define ARDUINO_ARCH_NRF52 1
+
+#endif
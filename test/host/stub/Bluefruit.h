@@ -0,0 +1,134 @@
+#ifndef Bluefruit_h
+#define Bluefruit_h
+
+// The parts of the Adafruit Bluefruit nRF52 API the library calls, doing nothing, so it links on the host.  Tests feed
+// received bytes straight into a link's receiveStagingBuffer rather than through a UART
+
+#include "Arduino.h"
+
+#define BLE_CONN_HANDLE_INVALID						0xFFFF
+#define BLE_GATTC_WRITE_CMD_TX_QUEUE_SIZE_DEFAULT	1
+#define BLE_GAP_AD_TYPE_COMPLETE_LOCAL_NAME			9
+#define BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE	6
+#define BLE_GAP_PHY_AUTO							0
+
+struct ble_data_t { uint8_t * p_data; uint16_t len; };
+struct ble_gap_addr_t { uint8_t addr[6]; };
+struct ble_gap_evt_adv_report_t { ble_data_t data; int8_t rssi; ble_gap_addr_t peer_addr; };
+
+class BLEUuid {
+public:
+	uint8_t _uuid128[16];
+	BLEUuid() {}
+	BLEUuid(const uint8_t * uuid128) {}
+	BLEUuid(uint16_t uuid16) {}
+};
+extern const uint8_t BLEUART_UUID_SERVICE[16];
+
+class BLEService {};
+
+class BLEUart : public Stream, public BLEService {
+public:
+	BLEUuid uuid;
+	void begin() {}
+	size_t write(uint8_t c) { return 1; }
+	size_t write(const uint8_t * buffer, size_t size) { return size; }
+	int available() { return 0; }
+	int read() { return -1; }
+	using Stream::read;
+	void setRxCallback(void (*callback)(uint16_t)) {}
+	void bufferTXD(bool enabled) {}
+};
+
+class BLEClientUart : public Stream {
+public:
+	bool begin() { return true; }
+	bool discover(uint16_t connectionHandle) { return true; }
+	bool discovered() { return true; }
+	bool enableTXD() { return true; }
+	size_t write(uint8_t c) { return 1; }
+	size_t write(const uint8_t * buffer, size_t size) { return size; }
+	int available() { return 0; }
+	int read() { return -1; }
+	using Stream::read;
+	void setRxCallback(void (*callback)(BLEClientUart &)) {}
+	uint16_t connHandle() { return 0; }
+};
+
+class BLEDfu : public BLEService {
+public:
+	void begin() {}
+};
+
+class BLEConnection {
+public:
+	uint16_t mtu = 23;															// set by a test for a link with larger chunks
+	uint16_t getMtu() { return mtu; }
+	uint16_t getConnectionInterval() { return 6; }
+	bool requestMtuExchange(uint16_t mtu) { return true; }
+	bool requestDataLengthUpdate(void * parameters = NULL) { return true; }
+	bool requestPHY(uint8_t phy = 0) { return true; }
+	bool requestConnectionParameter(uint16_t interval, uint16_t latency = 0, uint16_t timeout = 0) { return true; }
+	void getPeerName(char * name, uint16_t length) {}
+	bool disconnect() { return true; }
+};
+
+class BluefruitScanner {
+public:
+	void setRxCallback(void (*callback)(ble_gap_evt_adv_report_t *)) {}
+	void restartOnDisconnect(bool enabled) {}
+	void filterUuid(BLEUuid uuid) {}
+	void setInterval(uint16_t interval, uint16_t window) {}
+	void useActiveScan(bool enabled) {}
+	bool start(uint16_t timeout) { return true; }
+	bool stop() { return true; }
+	void resume() {}
+	bool checkReportForUuid(ble_gap_evt_adv_report_t * report, BLEUuid uuid) { return false; }
+	uint8_t parseReportByType(ble_gap_evt_adv_report_t * report, uint8_t type, uint8_t * buffer, uint8_t length) { return 0; }
+	bool isRunning() { return false; }
+};
+
+class BluefruitAdvertising {
+public:
+	void addFlags(uint8_t flags) {}
+	void addTxPower() {}
+	void addUuid(BLEUuid uuid) {}
+	void addService(BLEService & service) {}
+	void addName() {}
+	void restartOnDisconnect(bool enabled) {}
+	void setInterval(uint16_t fast, uint16_t slow) {}
+	void setFastTimeout(uint16_t seconds) {}
+	bool start(uint16_t timeout = 0) { return true; }
+};
+
+class BluefruitScanResponse {
+public:
+	void addName() {}
+};
+
+class BluefruitRole {
+public:
+	void setConnectCallback(void (*callback)(uint16_t)) {}
+	void setDisconnectCallback(void (*callback)(uint16_t, uint8_t)) {}
+	bool connect(ble_gap_evt_adv_report_t * report) { return true; }
+};
+
+class BluefruitClass {
+public:
+	BluefruitScanner Scanner;
+	BluefruitAdvertising Advertising;
+	BluefruitScanResponse ScanResponse;
+	BluefruitRole Periph;
+	BluefruitRole Central;
+	void configPrphConn(uint16_t mtu, uint16_t eventLength, uint8_t hvnQueue, uint8_t writeQueue) {}
+	void configCentralConn(uint16_t mtu, uint16_t eventLength, uint8_t hvnQueue, uint8_t writeQueue) {}
+	bool begin(uint8_t peripherals = 1, uint8_t centrals = 0) { return true; }
+	void setTxPower(int8_t power) {}
+	void setName(const char * name) {}
+	BLEConnection connection;													// every valid handle is this one link
+	BLEConnection * Connection(uint16_t connectionHandle) { return (connectionHandle == BLE_CONN_HANDLE_INVALID ? NULL : &connection); }
+	bool disconnect(uint16_t connectionHandle) { return true; }
+};
+extern BluefruitClass Bluefruit;
+
+#endif